@@ -0,0 +1,707 @@
+#ifndef BLOCKCOMPRESSION_H
+#define BLOCKCOMPRESSION_H
+
+#include <glad/glad.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// EXT_texture_compression_s3tc isn't core and not every glad build has its enums
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+// CPU encoder and decoder for the block formats the globe uses, 4x4 texels a block:
+//  - BC1 (GL_COMPRESSED_RGB_S3TC_DXT1_EXT) for the colour maps, 8 bytes: two RGB565
+//    endpoints along the principal axis of the block, refined by least squares on the
+//    chosen indices, and 2-bit indices into the 4 colour palette
+//  - BC7 (GL_COMPRESSED_RGBA_BPTC_UNORM) for the colour maps at twice the size, 16 bytes:
+//    the better of mode 6, one pair of 7-bit endpoints with 4-bit indices, and mode 1, two
+//    pairs of 6-bit endpoints over the most promising of its 64 partitions with 3-bit
+//    indices. Alpha is left opaque, the other six modes are never written and decodeBC7
+//    doesn't read them
+//  - BC4 (GL_COMPRESSED_RED_RGTC1) for the grey height and specular maps, 8 bytes: two
+//    8-bit endpoints and 3-bit indices into the 8 value palette
+// The nearest palette entry of the 16 texels is picked simd::FloatPack lanes at a time and
+// compress() spreads the block rows over the thread pool.
+class BlockCompression {
+public:
+    static bool isCompressed(GLenum internalFormat) {
+        return internalFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM
+            || internalFormat == GL_COMPRESSED_RED_RGTC1;
+    }
+
+    static int blockBytes(GLenum internalFormat) {
+        return internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM ? 16 : 8;
+    }
+
+    // texel channels the format stores, BC7 blocks are encoded opaque from RGB
+    static int channels(GLenum internalFormat) {
+        return internalFormat == GL_COMPRESSED_RED_RGTC1 ? 1 : 3;
+    }
+
+    static const char* name(GLenum internalFormat) {
+        if (internalFormat == GL_COMPRESSED_RED_RGTC1)
+            return "BC4";
+        return internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM ? "BC7" : "BC1";
+    }
+
+    static size_t compressedBytes(int width, int height, GLenum internalFormat) {
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockBytes(internalFormat);
+    }
+
+    // tightly packed texels with channels(internalFormat) channels, edge blocks repeat the last row and column
+    static std::vector<unsigned char> compress(const unsigned char* texels, int width, int height, GLenum internalFormat, ThreadPool* pool) {
+        int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+        int channelCount = channels(internalFormat), bytes = blockBytes(internalFormat);
+        std::vector<unsigned char> blocks(compressedBytes(width, height, internalFormat));
+        pool->parallelFor(blocksY, [&](int by) {
+            float block[3][16];
+            for (int bx = 0; bx < blocksX; bx++) {
+                for (int k = 0; k < 16; k++) {
+                    int x = bx * 4 + k % 4, y = by * 4 + k / 4;
+                    x = x < width ? x : width - 1;
+                    y = y < height ? y : height - 1;
+                    const unsigned char* texel = texels + ((size_t)y * width + x) * channelCount;
+                    for (int c = 0; c < channelCount; c++)
+                        block[c][k] = texel[c];
+                }
+                unsigned char* out = blocks.data() + ((size_t)by * blocksX + bx) * bytes;
+                if (internalFormat == GL_COMPRESSED_RED_RGTC1)
+                    encodeBC4(block[0], out);
+                else if (internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM)
+                    encodeBC7(block, out);
+                else
+                    encodeBC1(block, out);
+            }
+        });
+        return blocks;
+    }
+
+    // back to tightly packed texels, for the CPU copy of the heightmap and the PSNR report
+    static std::vector<unsigned char> decompress(const unsigned char* blocks, int width, int height, GLenum internalFormat) {
+        int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+        int channelCount = channels(internalFormat), bytes = blockBytes(internalFormat);
+        std::vector<unsigned char> texels((size_t)width * height * channelCount);
+        unsigned char decoded[16][3];
+        for (int by = 0; by < blocksY; by++) {
+            for (int bx = 0; bx < blocksX; bx++) {
+                const unsigned char* block = blocks + ((size_t)by * blocksX + bx) * bytes;
+                if (internalFormat == GL_COMPRESSED_RED_RGTC1)
+                    decodeBC4(block, decoded);
+                else if (internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM)
+                    decodeBC7(block, decoded);
+                else
+                    decodeBC1(block, decoded);
+                for (int k = 0; k < 16; k++) {
+                    int x = bx * 4 + k % 4, y = by * 4 + k / 4;
+                    if (x < width && y < height)
+                        memcpy(&texels[((size_t)y * width + x) * channelCount], decoded[k], channelCount);
+                }
+            }
+        }
+        return texels;
+    }
+
+    // over every channel of two images of the same size, infinity when they are equal
+    static double psnr(const unsigned char* a, const unsigned char* b, size_t count) {
+        double squaredError = 0.0;
+        for (size_t k = 0; k < count; k++) {
+            double d = (double)a[k] - (double)b[k];
+            squaredError += d * d;
+        }
+        if (squaredError == 0.0)
+            return INFINITY;
+        return 10.0 * log10(255.0 * 255.0 * count / squaredError);
+    }
+
+private:
+    typedef simd::FloatPack Pack;
+
+    // mode 1 partitions encodeBC7 fits in full, taken in the order the cheap line estimate ranks them
+    static const int bc7Partitions = 2;
+
+    // picks the nearest of paletteSize palette entries for every texel, returns the summed squared
+    // error of the first count texels
+    template<int channelCount>
+    static float selectIndices(const float block[][16], const float palette[][3], int paletteSize, int indices[16], int count = 16) {
+        float error = 0.0f;
+        for (int k = 0; k < count; k += Pack::width) {
+            Pack best(1e30f), bestIndex(0.0f);
+            for (int p = 0; p < paletteSize; p++) {
+                Pack distance(0.0f);
+                for (int c = 0; c < channelCount; c++) {
+                    Pack d = Pack::load(&block[c][k]) - Pack(palette[p][c]);
+                    distance = distance + d * d;
+                }
+                Pack closer = simd::lessThan(distance, best);
+                best = simd::select(closer, distance, best);
+                bestIndex = simd::select(closer, Pack((float)p), bestIndex);
+            }
+            float lanes[Pack::width], laneIndices[Pack::width];
+            best.store(lanes);
+            bestIndex.store(laneIndices);
+            for (int lane = 0; lane < Pack::width; lane++) {
+                error += k + lane < count ? lanes[lane] : 0.0f;
+                indices[k + lane] = (int)laneIndices[lane];
+            }
+        }
+        return error;
+    }
+
+    static uint16_t packRGB565(const float color[3]) {
+        int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+        int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+        int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+        r = r < 0 ? 0 : (r > 31 ? 31 : r);
+        g = g < 0 ? 0 : (g > 63 ? 63 : g);
+        b = b < 0 ? 0 : (b > 31 ? 31 : b);
+        return (uint16_t)((r << 11) | (g << 5) | b);
+    }
+
+    static void unpackRGB565(uint16_t packed, float color[3]) {
+        int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+        color[0] = (float)((r << 3) | (r >> 2));
+        color[1] = (float)((g << 2) | (g >> 4));
+        color[2] = (float)((b << 3) | (b >> 2));
+    }
+
+    // 4 colour mode, color0 > color1
+    static void paletteBC1(uint16_t color0, uint16_t color1, float palette[4][3]) {
+        unpackRGB565(color0, palette[0]);
+        unpackRGB565(color1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        }
+    }
+
+    // quantizes the endpoints, orders them for the 4 colour mode and picks the indices
+    static float fitBC1(const float block[3][16], const float end0[3], const float end1[3], uint16_t& color0, uint16_t& color1, int indices[16]) {
+        color0 = packRGB565(end0);
+        color1 = packRGB565(end1);
+        if (color0 < color1) {
+            uint16_t swap = color0;
+            color0 = color1;
+            color1 = swap;
+        }
+        float palette[4][3];
+        paletteBC1(color0, color1, palette);
+        // equal endpoints would select the 3 colour mode, index 0 is their colour in both
+        return selectIndices<3>(block, palette, color0 == color1 ? 1 : 4, indices);
+    }
+
+    // of the covariance rr, rg, rb, gg, gb, bb by power iteration, starting from the luminance direction
+    static void principalAxis(const float covariance[6], int iterations, float axis[3]) {
+        axis[0] = 0.3f; axis[1] = 0.6f; axis[2] = 0.1f;
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+            float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+            float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+            float length = std::sqrt(x * x + y * y + z * z);
+            if (length < 1e-6f)
+                break;
+            axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+        }
+    }
+
+    // the extremes of the first count texels along their principal axis
+    static void principalEndpoints(const float block[3][16], int count, float end0[3], float end1[3]) {
+        float mean[3] = { 0.0f, 0.0f, 0.0f };
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < count; k++)
+                mean[c] += block[c][k];
+            mean[c] /= (float)count;
+        }
+        float covariance[6] = {};
+        for (int k = 0; k < count; k++) {
+            float r = block[0][k] - mean[0], g = block[1][k] - mean[1], b = block[2][k] - mean[2];
+            covariance[0] += r * r; covariance[1] += r * g; covariance[2] += r * b;
+            covariance[3] += g * g; covariance[4] += g * b; covariance[5] += b * b;
+        }
+        float axis[3];
+        principalAxis(covariance, 8, axis);
+        float minT = 1e30f, maxT = -1e30f;
+        for (int k = 0; k < count; k++) {
+            float t = (block[0][k] - mean[0]) * axis[0] + (block[1][k] - mean[1]) * axis[1] + (block[2][k] - mean[2]) * axis[2];
+            minT = t < minT ? t : minT;
+            maxT = t > maxT ? t : maxT;
+        }
+        for (int c = 0; c < 3; c++) {
+            end0[c] = mean[c] + axis[c] * maxT;
+            end1[c] = mean[c] + axis[c] * minT;
+        }
+    }
+
+    static void encodeBC1(const float block[3][16], unsigned char out[8]) {
+        float end0[3], end1[3];
+        principalEndpoints(block, 16, end0, end1);
+        uint16_t color0, color1;
+        int indices[16];
+        float error = fitBC1(block, end0, end1, color0, color1, indices);
+
+        // least squares endpoints for the chosen indices, kept while they lower the error
+        static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+        for (int iteration = 0; iteration < 2 && error > 0.0f && color0 != color1; iteration++) {
+            float aa = 0.0f, ab = 0.0f, bb = 0.0f, ap[3] = {}, bp[3] = {};
+            for (int k = 0; k < 16; k++) {
+                float a = weights[indices[k]], b = 1.0f - a;
+                aa += a * a; ab += a * b; bb += b * b;
+                for (int c = 0; c < 3; c++) {
+                    ap[c] += a * block[c][k];
+                    bp[c] += b * block[c][k];
+                }
+            }
+            float determinant = aa * bb - ab * ab;
+            if (std::fabs(determinant) < 1e-6f)
+                break;
+            for (int c = 0; c < 3; c++) {
+                end0[c] = (bb * ap[c] - ab * bp[c]) / determinant;
+                end1[c] = (aa * bp[c] - ab * ap[c]) / determinant;
+            }
+            uint16_t refined0, refined1;
+            int refinedIndices[16];
+            float refinedError = fitBC1(block, end0, end1, refined0, refined1, refinedIndices);
+            if (refinedError >= error)
+                break;
+            error = refinedError;
+            color0 = refined0;
+            color1 = refined1;
+            memcpy(indices, refinedIndices, sizeof(refinedIndices));
+        }
+
+        uint32_t bits = 0;
+        for (int k = 0; k < 16; k++)
+            bits |= (uint32_t)indices[k] << (2 * k);
+        out[0] = (unsigned char)(color0 & 0xff);
+        out[1] = (unsigned char)(color0 >> 8);
+        out[2] = (unsigned char)(color1 & 0xff);
+        out[3] = (unsigned char)(color1 >> 8);
+        for (int b = 0; b < 4; b++)
+            out[4 + b] = (unsigned char)(bits >> (8 * b));
+    }
+
+    // 8 value mode, red0 > red1: index 0 and 1 are the endpoints, 2..7 go from red0 to red1
+    static void paletteBC4(int red0, int red1, float palette[8][3]) {
+        palette[0][0] = (float)red0;
+        palette[1][0] = (float)red1;
+        for (int j = 2; j < 8; j++)
+            palette[j][0] = ((8 - j) * red0 + (j - 1) * red1) / 7.0f;
+    }
+
+    static float fitBC4(const float values[16], float end0, float end1, int& red0, int& red1, int indices[16]) {
+        red0 = (int)(end0 + 0.5f);
+        red1 = (int)(end1 + 0.5f);
+        red0 = red0 < 0 ? 0 : (red0 > 255 ? 255 : red0);
+        red1 = red1 < 0 ? 0 : (red1 > 255 ? 255 : red1);
+        if (red0 < red1) {
+            int swap = red0;
+            red0 = red1;
+            red1 = swap;
+        }
+        float palette[8][3];
+        paletteBC4(red0, red1, palette);
+        // equal endpoints select the 6 value mode, index 0 is their value in both
+        return selectIndices<1>((const float(*)[16])values, palette, red0 == red1 ? 1 : 8, indices);
+    }
+
+    static void encodeBC4(const float values[16], unsigned char out[8]) {
+        float minValue = 255.0f, maxValue = 0.0f;
+        for (int k = 0; k < 16; k++) {
+            minValue = values[k] < minValue ? values[k] : minValue;
+            maxValue = values[k] > maxValue ? values[k] : maxValue;
+        }
+        int red0, red1;
+        int indices[16];
+        float error = fitBC4(values, maxValue, minValue, red0, red1, indices);
+
+        static const float weights[8] = { 1.0f, 0.0f, 6.0f / 7.0f, 5.0f / 7.0f, 4.0f / 7.0f, 3.0f / 7.0f, 2.0f / 7.0f, 1.0f / 7.0f };
+        for (int iteration = 0; iteration < 2 && error > 0.0f && red0 != red1; iteration++) {
+            float aa = 0.0f, ab = 0.0f, bb = 0.0f, ap = 0.0f, bp = 0.0f;
+            for (int k = 0; k < 16; k++) {
+                float a = weights[indices[k]], b = 1.0f - a;
+                aa += a * a; ab += a * b; bb += b * b;
+                ap += a * values[k];
+                bp += b * values[k];
+            }
+            float determinant = aa * bb - ab * ab;
+            if (std::fabs(determinant) < 1e-6f)
+                break;
+            int refined0, refined1;
+            int refinedIndices[16];
+            float refinedError = fitBC4(values, (bb * ap - ab * bp) / determinant, (aa * bp - ab * ap) / determinant, refined0, refined1, refinedIndices);
+            if (refinedError >= error)
+                break;
+            error = refinedError;
+            red0 = refined0;
+            red1 = refined1;
+            memcpy(indices, refinedIndices, sizeof(refinedIndices));
+        }
+
+        uint64_t bits = 0;
+        for (int k = 0; k < 16; k++)
+            bits |= (uint64_t)indices[k] << (3 * k);
+        out[0] = (unsigned char)red0;
+        out[1] = (unsigned char)red1;
+        for (int b = 0; b < 6; b++)
+            out[2 + b] = (unsigned char)(bits >> (8 * b));
+    }
+
+    // the two BC7 modes encodeBC7 writes
+    struct BC7Mode {
+        int number, subsets, colorBits, indexBits;
+        // lowest p-bit tried, mode 6 keeps its p-bits at 1 so its alpha of 127 decodes to 255
+        int firstPbit;
+    };
+
+    struct BC7Block {
+        int mode, partition;
+        // [subset][endpoint][channel] before expansion, one p-bit a subset
+        int colors[2][2][3], pbits[2];
+        int indices[16];
+        float error;
+    };
+
+    static const BC7Mode& modeBC7(int number) {
+        static const BC7Mode mode1 = { 1, 2, 6, 3, 0 }, mode6 = { 6, 1, 7, 4, 1 };
+        return number == 1 ? mode1 : mode6;
+    }
+
+    // bit k is set when texel k is in the second subset of a two subset partition
+    static uint32_t partitionBC7(int partition) {
+        static const uint16_t masks[64] = {
+            0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80, 0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+            0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE, 0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+            0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A, 0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+            0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C, 0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22
+        };
+        return masks[partition];
+    }
+
+    // texel of the second subset that stores its index without the top bit, texel 0 is the first one's
+    static int anchorBC7(int partition) {
+        static const unsigned char anchors[64] = {
+            15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+            15, 2, 8, 2, 2, 8, 8, 15, 2, 8, 2, 2, 8, 8, 2, 2,
+            15, 15, 6, 8, 2, 8, 15, 15, 2, 8, 2, 2, 2, 15, 15, 6,
+            6, 2, 6, 8, 15, 15, 2, 2, 15, 15, 15, 15, 15, 2, 2, 15
+        };
+        return anchors[partition];
+    }
+
+    // of endpoint 1 in 64ths
+    static const int* weightsBC7(int indexBits) {
+        static const int weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+        static const int weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+        return indexBits == 3 ? weights3 : weights4;
+    }
+
+    static int interpolateBC7(int end0, int end1, int weight) {
+        return ((64 - weight) * end0 + weight * end1 + 32) >> 6;
+    }
+
+    // a channel of colorBits bits with the p-bit below them, widened to 8 bits by repeating its top bits
+    static int expandBC7(int color, int pbit, int colorBits) {
+        int bits = colorBits + 1, value = (color << 1) | pbit;
+        return (value << (8 - bits)) | (value >> (2 * bits - 8));
+    }
+
+    // the channel whose expansion with pbit is nearest to value
+    static int quantizeBC7(float value, int pbit, int colorBits) {
+        value = value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value);
+        int guess = (int)((value * ((1 << (colorBits + 1)) - 1) / 255.0f - pbit) * 0.5f + 0.5f);
+        int best = 0;
+        float bestError = 1e30f;
+        for (int color = guess - 1; color <= guess + 1; color++) {
+            if (color < 0 || color >= 1 << colorBits)
+                continue;
+            float d = expandBC7(color, pbit, colorBits) - value;
+            if (d * d < bestError) {
+                bestError = d * d;
+                best = color;
+            }
+        }
+        return best;
+    }
+
+    // quantizes the endpoints with pbit and picks the indices of the first count texels
+    static float fitBC7(const float texels[3][16], int count, const BC7Mode& mode, const float end0[3], const float end1[3], int pbit, int colors[2][3], int indices[16]) {
+        const int* weights = weightsBC7(mode.indexBits);
+        int paletteSize = 1 << mode.indexBits;
+        float palette[16][3];
+        for (int c = 0; c < 3; c++) {
+            colors[0][c] = quantizeBC7(end0[c], pbit, mode.colorBits);
+            colors[1][c] = quantizeBC7(end1[c], pbit, mode.colorBits);
+            int expanded0 = expandBC7(colors[0][c], pbit, mode.colorBits), expanded1 = expandBC7(colors[1][c], pbit, mode.colorBits);
+            for (int p = 0; p < paletteSize; p++)
+                palette[p][c] = (float)interpolateBC7(expanded0, expanded1, weights[p]);
+        }
+        return selectIndices<3>(texels, palette, paletteSize, indices, count);
+    }
+
+    // endpoints, p-bit and indices of the first count texels, returns their squared error
+    static float fitBC7Subset(const float texels[3][16], int count, const BC7Mode& mode, int colors[2][3], int& pbit, int indices[16]) {
+        float start0[3], start1[3];
+        principalEndpoints(texels, count, start0, start1);
+        const int* weights = weightsBC7(mode.indexBits);
+        float bestError = 1e30f;
+        for (int p = mode.firstPbit; p < 2; p++) {
+            int fitColors[2][3], fitIndices[16];
+            float error = fitBC7(texels, count, mode, start0, start1, p, fitColors, fitIndices);
+            // least squares endpoints for the chosen indices, as for BC1
+            for (int iteration = 0; iteration < 2 && error > 0.0f; iteration++) {
+                float aa = 0.0f, ab = 0.0f, bb = 0.0f, ap[3] = {}, bp[3] = {};
+                for (int k = 0; k < count; k++) {
+                    float b = weights[fitIndices[k]] / 64.0f, a = 1.0f - b;
+                    aa += a * a; ab += a * b; bb += b * b;
+                    for (int c = 0; c < 3; c++) {
+                        ap[c] += a * texels[c][k];
+                        bp[c] += b * texels[c][k];
+                    }
+                }
+                float determinant = aa * bb - ab * ab;
+                if (std::fabs(determinant) < 1e-6f)
+                    break;
+                float end0[3], end1[3];
+                for (int c = 0; c < 3; c++) {
+                    end0[c] = (bb * ap[c] - ab * bp[c]) / determinant;
+                    end1[c] = (aa * bp[c] - ab * ap[c]) / determinant;
+                }
+                int refinedColors[2][3], refinedIndices[16];
+                float refinedError = fitBC7(texels, count, mode, end0, end1, p, refinedColors, refinedIndices);
+                if (refinedError >= error)
+                    break;
+                error = refinedError;
+                memcpy(fitColors, refinedColors, sizeof(fitColors));
+                memcpy(fitIndices, refinedIndices, sizeof(fitIndices));
+            }
+            if (error < bestError) {
+                bestError = error;
+                pbit = p;
+                memcpy(colors, fitColors, sizeof(fitColors));
+                memcpy(indices, fitIndices, sizeof(fitIndices));
+            }
+        }
+        return bestError;
+    }
+
+    // mode fitted to the block split by partition, which mode 6 ignores
+    static void fitBC7Block(const float block[3][16], const BC7Mode& mode, int partition, BC7Block& fit) {
+        fit.mode = mode.number;
+        fit.partition = partition;
+        fit.error = 0.0f;
+        uint32_t second = mode.subsets == 2 ? partitionBC7(partition) : 0;
+        int top = 1 << (mode.indexBits - 1);
+        for (int subset = 0; subset < mode.subsets; subset++) {
+            // the texels of the subset first, the rest of the lanes repeat its first texel
+            float texels[3][16];
+            int members[16], count = 0;
+            for (int k = 0; k < 16; k++) {
+                if ((int)(second >> k & 1) != subset)
+                    continue;
+                for (int c = 0; c < 3; c++)
+                    texels[c][count] = block[c][k];
+                members[count++] = k;
+            }
+            for (int k = count; k < 16; k++)
+                for (int c = 0; c < 3; c++)
+                    texels[c][k] = texels[c][0];
+            int indices[16];
+            fit.error += fitBC7Subset(texels, count, mode, fit.colors[subset], fit.pbits[subset], indices);
+
+            // the anchor's top index bit isn't stored, swapping the endpoints clears it
+            int anchor = subset == 0 ? 0 : anchorBC7(partition);
+            bool swap = false;
+            for (int j = 0; j < count; j++)
+                swap = swap || (members[j] == anchor && indices[j] >= top);
+            for (int j = 0; j < count; j++)
+                fit.indices[members[j]] = swap ? 2 * top - 1 - indices[j] : indices[j];
+            if (swap) {
+                for (int c = 0; c < 3; c++) {
+                    int color = fit.colors[subset][0][c];
+                    fit.colors[subset][0][c] = fit.colors[subset][1][c];
+                    fit.colors[subset][1][c] = color;
+                }
+            }
+        }
+    }
+
+    // the partitions whose two subsets lie closest to a line each before quantization, best first
+    static void rankPartitionsBC7(const float block[3][16], int ranked[], int rankedCount) {
+        float errors[64];
+        for (int partition = 0; partition < 64; partition++) {
+            uint32_t second = partitionBC7(partition);
+            errors[partition] = 0.0f;
+            for (int subset = 0; subset < 2; subset++) {
+                float count = 0.0f, sum[3] = {}, products[6] = {};
+                for (int k = 0; k < 16; k++) {
+                    if ((int)(second >> k & 1) != subset)
+                        continue;
+                    float r = block[0][k], g = block[1][k], b = block[2][k];
+                    count += 1.0f;
+                    sum[0] += r; sum[1] += g; sum[2] += b;
+                    products[0] += r * r; products[1] += r * g; products[2] += r * b;
+                    products[3] += g * g; products[4] += g * b; products[5] += b * b;
+                }
+                float covariance[6] = {
+                    products[0] - sum[0] * sum[0] / count, products[1] - sum[0] * sum[1] / count, products[2] - sum[0] * sum[2] / count,
+                    products[3] - sum[1] * sum[1] / count, products[4] - sum[1] * sum[2] / count, products[5] - sum[2] * sum[2] / count
+                };
+                // the spread off the principal axis: the trace less the variance along it
+                float axis[3];
+                principalAxis(covariance, 4, axis);
+                float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+                float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+                float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+                errors[partition] += covariance[0] + covariance[3] + covariance[5] - (x * axis[0] + y * axis[1] + z * axis[2]);
+            }
+        }
+        for (int r = 0; r < rankedCount; r++) {
+            int best = 0;
+            for (int partition = 1; partition < 64; partition++)
+                best = errors[partition] < errors[best] ? partition : best;
+            ranked[r] = best;
+            errors[best] = 1e30f;
+        }
+    }
+
+    // LSB first from position on, into a zeroed block
+    static void writeBits(unsigned char* block, int& position, uint32_t value, int bits) {
+        for (int b = 0; b < bits; b++, position++)
+            block[position >> 3] |= (unsigned char)((value >> b & 1) << (position & 7));
+    }
+
+    static uint32_t readBits(const unsigned char* block, int& position, int bits) {
+        uint32_t value = 0;
+        for (int b = 0; b < bits; b++, position++)
+            value |= (uint32_t)(block[position >> 3] >> (position & 7) & 1) << b;
+        return value;
+    }
+
+    static void encodeBC7(const float block[3][16], unsigned char out[16]) {
+        BC7Block best, candidate;
+        fitBC7Block(block, modeBC7(6), 0, best);
+        // mode 1 only pays where mode 6 leaves more than an average error of a level a channel
+        if (best.error > 48.0f) {
+            int ranked[bc7Partitions];
+            rankPartitionsBC7(block, ranked, bc7Partitions);
+            for (int r = 0; r < bc7Partitions; r++) {
+                fitBC7Block(block, modeBC7(1), ranked[r], candidate);
+                if (candidate.error < best.error)
+                    best = candidate;
+            }
+        }
+
+        const BC7Mode& mode = modeBC7(best.mode);
+        memset(out, 0, 16);
+        int position = 0;
+        // mode m is m zero bits and a one
+        writeBits(out, position, 1u << mode.number, mode.number + 1);
+        if (mode.subsets == 2)
+            writeBits(out, position, best.partition, 6);
+        for (int c = 0; c < 3; c++)
+            for (int subset = 0; subset < mode.subsets; subset++)
+                for (int e = 0; e < 2; e++)
+                    writeBits(out, position, best.colors[subset][e][c], mode.colorBits);
+        if (mode.number == 6) {
+            writeBits(out, position, 127, 7);
+            writeBits(out, position, 127, 7);
+            writeBits(out, position, best.pbits[0], 1);
+            writeBits(out, position, best.pbits[0], 1);
+        }
+        else {
+            writeBits(out, position, best.pbits[0], 1);
+            writeBits(out, position, best.pbits[1], 1);
+        }
+        int anchor = mode.subsets == 2 ? anchorBC7(best.partition) : 0;
+        for (int k = 0; k < 16; k++)
+            writeBits(out, position, best.indices[k], k == 0 || k == anchor ? mode.indexBits - 1 : mode.indexBits);
+    }
+
+    static void decodeBC1(const unsigned char* block, unsigned char texels[16][3]) {
+        uint16_t color0 = (uint16_t)(block[0] | (block[1] << 8));
+        uint16_t color1 = (uint16_t)(block[2] | (block[3] << 8));
+        float palette[4][3];
+        unpackRGB565(color0, palette[0]);
+        unpackRGB565(color1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            if (color0 > color1) {
+                palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+                palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+            }
+            else {
+                palette[2][c] = (palette[0][c] + palette[1][c]) / 2.0f;
+                palette[3][c] = 0.0f;
+            }
+        }
+        uint32_t bits = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+        for (int k = 0; k < 16; k++)
+            for (int c = 0; c < 3; c++)
+                texels[k][c] = (unsigned char)(palette[(bits >> (2 * k)) & 3][c] + 0.5f);
+    }
+
+    static void decodeBC4(const unsigned char* block, unsigned char texels[16][3]) {
+        int red0 = block[0], red1 = block[1];
+        float palette[8];
+        palette[0] = (float)red0;
+        palette[1] = (float)red1;
+        if (red0 > red1) {
+            for (int j = 2; j < 8; j++)
+                palette[j] = ((8 - j) * red0 + (j - 1) * red1) / 7.0f;
+        }
+        else {
+            for (int j = 2; j < 6; j++)
+                palette[j] = ((6 - j) * red0 + (j - 1) * red1) / 5.0f;
+            palette[6] = 0.0f;
+            palette[7] = 255.0f;
+        }
+        uint64_t bits = 0;
+        for (int b = 0; b < 6; b++)
+            bits |= (uint64_t)block[2 + b] << (8 * b);
+        for (int k = 0; k < 16; k++)
+            texels[k][0] = (unsigned char)(palette[(bits >> (3 * k)) & 7] + 0.5f);
+    }
+    // modes 1 and 6 with their alpha dropped, blocks of the other modes decode black
+    static void decodeBC7(const unsigned char* block, unsigned char texels[16][3]) {
+        int number = 0;
+        while (number < 8 && !(block[0] >> number & 1))
+            number++;
+        if (number != 1 && number != 6) {
+            memset(texels, 0, 16 * 3);
+            return;
+        }
+        const BC7Mode& mode = modeBC7(number);
+        int position = number + 1;
+        int partition = mode.subsets == 2 ? (int)readBits(block, position, 6) : 0;
+        int colors[2][2][3], pbits[2][2];
+        for (int c = 0; c < 3; c++)
+            for (int subset = 0; subset < mode.subsets; subset++)
+                for (int e = 0; e < 2; e++)
+                    colors[subset][e][c] = (int)readBits(block, position, mode.colorBits);
+        if (number == 6) {
+            position += 14;
+            pbits[0][0] = (int)readBits(block, position, 1);
+            pbits[0][1] = (int)readBits(block, position, 1);
+        }
+        else {
+            pbits[0][0] = pbits[0][1] = (int)readBits(block, position, 1);
+            pbits[1][0] = pbits[1][1] = (int)readBits(block, position, 1);
+        }
+        uint32_t second = mode.subsets == 2 ? partitionBC7(partition) : 0;
+        int anchor = mode.subsets == 2 ? anchorBC7(partition) : 0;
+        const int* weights = weightsBC7(mode.indexBits);
+        for (int k = 0; k < 16; k++) {
+            int index = (int)readBits(block, position, k == 0 || k == anchor ? mode.indexBits - 1 : mode.indexBits);
+            int subset = (int)(second >> k & 1);
+            for (int c = 0; c < 3; c++) {
+                int end0 = expandBC7(colors[subset][0][c], pbits[subset][0], mode.colorBits);
+                int end1 = expandBC7(colors[subset][1][c], pbits[subset][1], mode.colorBits);
+                texels[k][c] = (unsigned char)interpolateBC7(end0, end1, weights[index]);
+            }
+        }
+    }
+};
+#endif
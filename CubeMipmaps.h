@@ -0,0 +1,333 @@
+#ifndef CUBEMIPMAPS_H
+#define CUBEMIPMAPS_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "Simd.h"
+#include "ThreadPool.h"
+
+enum CubeMipmapMode {
+    NO_CUBE_MIPMAPS,        // level 0 only, minified with GL_LINEAR
+    CPU_CUBE_MIPMAPS,       // CubeMipmaps::build, baked into the texture containers
+    GL_CUBE_MIPMAPS         // glGenerateMipmap after level 0 is uploaded
+};
+
+// Mip chains of cube maps built on the CPU. glGenerateMipmap filters every face as an image
+// of its own, so the texels along a face edge only ever average texels of that face and the
+// two sides of an edge drift apart level by level, which shows as seams once the globe is
+// small on screen. Here every level is filtered with a tent a little over two texels wide
+// whose taps past a face edge read the texels of the neighbouring face, found through the
+// GL cube map face rules. Faces don't have to be a power of two (the globe faces are 1000
+// texels), the tent is stretched to the real ratio between two levels.
+// The rows of every face are spread over the thread pool; the vertical pass of the tent
+// runs simd::FloatPack lanes at a time over whole rows.
+class CubeMipmaps {
+public:
+    // levels[0][f] holds face f (GL_TEXTURE_CUBE_MAP_POSITIVE_X + f) of level 0, size x size
+    // texels of channels interleaved GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_FLOAT channels;
+    // the levels down to 1x1 are appended, each made from the one before
+    static void build(std::vector<std::vector<std::vector<unsigned char>>>& levels, int size, int channels, GLenum type, ThreadPool* pool) {
+        if (type == GL_FLOAT)
+            build<float>(levels, size, channels, pool);
+        else if (type == GL_UNSIGNED_SHORT)
+            build<uint16_t>(levels, size, channels, pool);
+        else
+            build<unsigned char>(levels, size, channels, pool);
+    }
+
+    // levels 1.. of build() into the cube map bound to the active unit, level 0 is already there
+    static void upload(const std::vector<std::vector<std::vector<unsigned char>>>& levels, int size, GLenum internalFormat, GLenum format, GLenum type) {
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t l = 1; l < levels.size(); l++) {
+            size = size > 1 ? size / 2 : 1;
+            for (int face = 0; face < 6; face++)
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, (GLint)l, internalFormat, size, size, 0, format, type, levels[l][face].data());
+        }
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    // once the faces of the cube map bound to the active unit are in: generates the levels for
+    // GL_CUBE_MIPMAPS and switches to trilinear minification when there are levels to use,
+    // returns whether it did
+    static bool finish(CubeMipmapMode mode) {
+        if (mode == NO_CUBE_MIPMAPS)
+            return false;
+        GLint levelWidth = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 1, GL_TEXTURE_WIDTH, &levelWidth);
+        if (levelWidth == 0) {
+            // faces that failed to load leave CPU_CUBE_MIPMAPS without a chain, and an
+            // incomplete cube map is an error for glGenerateMipmap
+            if (mode != GL_CUBE_MIPMAPS)
+                return false;
+            GLint firstWidth = 0;
+            glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_WIDTH, &firstWidth);
+            for (int face = 0; face < 6; face++) {
+                GLint width = 0;
+                glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_TEXTURE_WIDTH, &width);
+                if (width == 0 || width != firstWidth)
+                    return false;
+            }
+            // a container without levels set GL_TEXTURE_MAX_LEVEL to 0
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, 1000);
+            glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        }
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        return true;
+    }
+
+    // finish() for a cube map in immutable storage, by name, with uploadedLevels of its levels
+    // in: the filter is left to the sampler it is used with, so this only says whether there is
+    // a chain to minify trilinearly from. GL_CUBE_MIPMAPS generates the levels the storage has
+    // room for past a single uploaded one.
+    static bool finish(CubeMipmapMode mode, GLuint texture, int uploadedLevels) {
+        if (mode == NO_CUBE_MIPMAPS)
+            return false;
+        if (uploadedLevels > 1)
+            return true;
+        if (mode != GL_CUBE_MIPMAPS)
+            return false;
+        GLint storageLevels = 0;
+        glGetTextureParameteriv(texture, GL_TEXTURE_IMMUTABLE_LEVELS, &storageLevels);
+        if (storageLevels <= 1)
+            return false;
+        glTextureParameteri(texture, GL_TEXTURE_MAX_LEVEL, storageLevels - 1);
+        glGenerateTextureMipmap(texture);
+        return true;
+    }
+
+    // times build() on one thread and on the pool against glGenerateMipmap on the same faces,
+    // decoded to RGBA8 like the globe's colour cube map
+    static void benchmark(const std::vector<std::string>& paths, ThreadPool* pool) {
+        std::vector<std::vector<unsigned char>> faces(6);
+        int size = 0;
+        for (int face = 0; face < 6; face++) {
+            int width, height, channels;
+            unsigned char* data = stbi_load(paths[face].c_str(), &width, &height, &channels, 4);
+            if (!data || width != height || (face > 0 && width != size)) {
+                std::cout << "Cube map mipmap benchmark: " << paths[face] << " failed to load" << std::endl;
+                stbi_image_free(data);
+                return;
+            }
+            size = width;
+            faces[face].assign(data, data + (size_t)size * size * 4);
+            stbi_image_free(data);
+        }
+        std::vector<std::vector<std::vector<unsigned char>>> serialLevels(1, faces), levels(1, faces);
+        ThreadPool serialPool(1);
+        auto start = std::chrono::high_resolution_clock::now();
+        build(serialLevels, size, 4, GL_UNSIGNED_BYTE, &serialPool);
+        auto serialEnd = std::chrono::high_resolution_clock::now();
+        build(levels, size, 4, GL_UNSIGNED_BYTE, pool);
+        auto parallelEnd = std::chrono::high_resolution_clock::now();
+
+        // on a texture of its own, the cube map bound to the active unit stays
+        GLint bound = 0;
+        glGetIntegerv(GL_TEXTURE_BINDING_CUBE_MAP, &bound);
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        for (int face = 0; face < 6; face++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, faces[face].data());
+        glFinish();
+        auto generateStart = std::chrono::high_resolution_clock::now();
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        glFinish();
+        auto generateEnd = std::chrono::high_resolution_clock::now();
+        upload(levels, size, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        glFinish();
+        auto uploadEnd = std::chrono::high_resolution_clock::now();
+        glDeleteTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, bound);
+
+        double serialMs = std::chrono::duration<double, std::milli>(serialEnd - start).count();
+        double parallelMs = std::chrono::duration<double, std::milli>(parallelEnd - serialEnd).count();
+        double generateMs = std::chrono::duration<double, std::milli>(generateEnd - generateStart).count();
+        double uploadMs = std::chrono::duration<double, std::milli>(uploadEnd - generateEnd).count();
+        bool same = true;
+        for (size_t l = 0; l < levels.size(); l++)
+            same = same && levels[l] == serialLevels[l];
+        std::cout << "Cube map mipmaps, 6 faces of " << size << "x" << size << " RGBA8, " << levels.size() << " levels ("
+            << (const char*)glGetString(GL_RENDERER) << ")" << std::endl
+            << "  seam-aware tent, 1 thread: " << serialMs << " ms" << std::endl
+            << "  seam-aware tent, " << pool->size() << " threads: " << parallelMs << " ms, output "
+            << (same ? "identical" : "DIFFERENT") << " to 1 thread, upload of levels 1.. " << uploadMs << " ms" << std::endl
+            << "  glGenerateMipmap (box filter per face): " << generateMs << " ms" << std::endl;
+    }
+
+private:
+    // output rows of one face filtered by a single job
+    static const int stripeRows = 16;
+    static const int maxTaps = 8;
+
+    // input texels -1 .. size (one past each edge) that make up an output texel of the next level
+    struct Taps {
+        int first, count;
+        float weights[maxTaps];
+    };
+
+    // the tent is as wide as two texels of the next level, [1 3 3 1] / 8 when halving exactly
+    static std::vector<Taps> taps(int size, int nextSize) {
+        float scale = (float)size / nextSize;
+        std::vector<Taps> result(nextSize);
+        for (int x = 0; x < nextSize; x++) {
+            float center = (x + 0.5f) * scale - 0.5f;
+            int first = (int)std::ceil(center - scale);
+            int last = (int)std::floor(center + scale);
+            first = first < -1 ? -1 : first;
+            last = last > size ? size : last;
+            Taps& tap = result[x];
+            tap.first = first;
+            tap.count = 0;
+            float sum = 0.0f;
+            for (int i = first; i <= last && tap.count < maxTaps; i++) {
+                float weight = 1.0f - std::fabs(i - center) / scale;
+                if (weight <= 0.0f && tap.count == 0) {
+                    tap.first++;
+                    continue;
+                }
+                tap.weights[tap.count++] = weight > 0.0f ? weight : 0.0f;
+                sum += weight > 0.0f ? weight : 0.0f;
+            }
+            for (int k = 0; k < tap.count; k++)
+                tap.weights[k] /= sum;
+        }
+        return result;
+    }
+
+    // face and texel of a cube map of size x size faces that texel (x, y) of face lands on when
+    // it lies past the edge of that face: its centre as a direction, through the face selection
+    // and (s, t) of the GL cube map rules (table 8.19 of the 4.5 spec), like Heightmap::sampleCube
+    static void neighbour(int face, int x, int y, int size, int& outFace, int& outX, int& outY) {
+        float sc = 2.0f * (x + 0.5f) / size - 1.0f;
+        float tc = 2.0f * (y + 0.5f) / size - 1.0f;
+        float r[3];
+        switch (face) {
+        case 0: r[0] = 1.0f; r[1] = -tc; r[2] = -sc; break;
+        case 1: r[0] = -1.0f; r[1] = -tc; r[2] = sc; break;
+        case 2: r[0] = sc; r[1] = 1.0f; r[2] = tc; break;
+        case 3: r[0] = sc; r[1] = -1.0f; r[2] = -tc; break;
+        case 4: r[0] = sc; r[1] = -tc; r[2] = 1.0f; break;
+        default: r[0] = -sc; r[1] = -tc; r[2] = -1.0f; break;
+        }
+        float ax = std::fabs(r[0]), ay = std::fabs(r[1]), az = std::fabs(r[2]);
+        float ma;
+        if (ax >= ay && ax >= az) {
+            outFace = r[0] >= 0 ? 0 : 1;
+            sc = r[0] >= 0 ? -r[2] : r[2];
+            tc = -r[1];
+            ma = ax;
+        }
+        else if (ay >= az) {
+            outFace = r[1] >= 0 ? 2 : 3;
+            sc = r[0];
+            tc = r[1] >= 0 ? r[2] : -r[2];
+            ma = ay;
+        }
+        else {
+            outFace = r[2] >= 0 ? 4 : 5;
+            sc = r[2] >= 0 ? r[0] : -r[0];
+            tc = -r[1];
+            ma = az;
+        }
+        outX = (int)std::floor(0.5f * (sc / ma + 1.0f) * size);
+        outY = (int)std::floor(0.5f * (tc / ma + 1.0f) * size);
+        outX = outX < 0 ? 0 : (outX >= size ? size - 1 : outX);
+        outY = outY < 0 ? 0 : (outY >= size ? size - 1 : outY);
+    }
+
+    // row y (-1 .. size) of face with one texel of the neighbouring faces on either end,
+    // size + 2 texels; the rows past the top and bottom edge come from the faces there
+    template<class T>
+    static void fetchRow(const std::vector<std::vector<unsigned char>>& faces, int size, int channels, int face, int y, float* row) {
+        if (y >= 0 && y < size) {
+            const T* texels = (const T*)faces[face].data() + (size_t)y * size * channels;
+            for (int k = 0; k < size * channels; k++)
+                row[channels + k] = (float)texels[k];
+            fetchTexel<T>(faces, size, channels, face, -1, y, row);
+            fetchTexel<T>(faces, size, channels, face, size, y, row + (size_t)(size + 1) * channels);
+            return;
+        }
+        for (int x = -1; x <= size; x++)
+            fetchTexel<T>(faces, size, channels, face, x, y, row + (size_t)(x + 1) * channels);
+    }
+
+    template<class T>
+    static void fetchTexel(const std::vector<std::vector<unsigned char>>& faces, int size, int channels, int face, int x, int y, float* texel) {
+        int otherFace, otherX, otherY;
+        neighbour(face, x, y, size, otherFace, otherX, otherY);
+        const T* source = (const T*)faces[otherFace].data() + ((size_t)otherY * size + otherX) * channels;
+        for (int c = 0; c < channels; c++)
+            texel[c] = (float)source[c];
+    }
+
+    template<class T>
+    static void build(std::vector<std::vector<std::vector<unsigned char>>>& levels, int size, int channels, ThreadPool* pool) {
+        typedef simd::FloatPack Pack;
+        // integer channels round to nearest
+        const float rounding = std::is_integral<T>::value ? 0.5f : 0.0f;
+        while (size > 1) {
+            int nextSize = size / 2;
+            std::vector<Taps> levelTaps = taps(size, nextSize);
+            const std::vector<std::vector<unsigned char>>& faces = levels.back();
+            std::vector<std::vector<unsigned char>> next(6, std::vector<unsigned char>((size_t)nextSize * nextSize * channels * sizeof(T)));
+            int rowFloats = (size + 2) * channels;
+            int stripes = (nextSize + stripeRows - 1) / stripeRows;
+            pool->parallelFor(6 * stripes, [&](int job) {
+                int face = job / stripes;
+                int firstRow = job % stripes * stripeRows;
+                int endRow = firstRow + stripeRows < nextSize ? firstRow + stripeRows : nextSize;
+                // the padded input rows the stripe reads, fetched once
+                int firstInput = levelTaps[firstRow].first;
+                int endInput = levelTaps[endRow - 1].first + levelTaps[endRow - 1].count;
+                std::vector<float> rows((size_t)(endInput - firstInput) * rowFloats);
+                for (int y = firstInput; y < endInput; y++)
+                    fetchRow<T>(faces, size, channels, face, y, &rows[(size_t)(y - firstInput) * rowFloats]);
+                std::vector<float> column(rowFloats);
+                T* output = (T*)next[face].data();
+                for (int y = firstRow; y < endRow; y++) {
+                    // vertical pass over the whole padded row
+                    const Taps& vertical = levelTaps[y];
+                    const float* input = &rows[(size_t)(vertical.first - firstInput) * rowFloats];
+                    int k = 0;
+                    for (; k + Pack::width <= rowFloats; k += Pack::width) {
+                        Pack sum(0.0f);
+                        for (int t = 0; t < vertical.count; t++)
+                            sum = sum + Pack(vertical.weights[t]) * Pack::load(input + (size_t)t * rowFloats + k);
+                        sum.store(&column[k]);
+                    }
+                    for (; k < rowFloats; k++) {
+                        float sum = 0.0f;
+                        for (int t = 0; t < vertical.count; t++)
+                            sum += vertical.weights[t] * input[(size_t)t * rowFloats + k];
+                        column[k] = sum;
+                    }
+                    // horizontal pass, column holds texels -1 .. size
+                    T* outputRow = output + (size_t)y * nextSize * channels;
+                    for (int x = 0; x < nextSize; x++) {
+                        const Taps& horizontal = levelTaps[x];
+                        const float* texels = &column[(size_t)(horizontal.first + 1) * channels];
+                        for (int c = 0; c < channels; c++) {
+                            float sum = 0.0f;
+                            for (int t = 0; t < horizontal.count; t++)
+                                sum += horizontal.weights[t] * texels[t * channels + c];
+                            outputRow[x * channels + c] = (T)(sum + rounding);
+                        }
+                    }
+                }
+            });
+            levels.push_back(std::move(next));
+            size = nextSize;
+        }
+    }
+};
+#endif
@@ -1,14 +1,12 @@
 #ifndef CUBESPHERE_H
 #define CUBESPHERE_H
 
-enum CubeFace {
-    POSX,
-    NEGX,
-    POSY,
-    NEGY,
-    POSZ,
-    NEGZ
-};
+#include "CubesphereMesh.h"
+#include "MeshCache.h"
+#include "ImageLoader.h"
+#include "TilePyramid.h"
+#include "GLState.h"
+#include "Samplers.h"
 
 class Cubesphere {
 public:
@@ -19,361 +17,519 @@ public:
     unsigned int cubemapHeightTexture;
     unsigned int cubemapSpecularTexture;
     unsigned int VAO, VBO, EBO;
+    // ProceduralSphere uniform block of shader.vs, only with PROCEDURAL_VERTICES
+    unsigned int proceduralUBO;
+    // red channel of the height texture, kept by the init functions for bakeDisplacement
+    Heightmap heightmap;
+    MeshSettings settings;
     int numberOfVerticesToDraw;
+    // index ranges for TileCulling, empty when settings.tilesPerSide is 0
+    std::vector<MeshTile> tiles;
     Shader* shader;
-    Cubesphere(int subdivision, Shader* shader, int useCubeTexture) {
+    // the ShaderFeature bits of the shader variant that draws a mesh of settings, with the cube
+    // map textures (from tile pyramids, see useTilePyramid()) or the 2D maps (the imagery from
+    // a virtual texture); the feedback pass of the virtual texture adds SHADER_PAGE_FEEDBACK
+    static unsigned int shaderFeatures(const MeshSettings& settings, int useCubeTexture, bool tilePyramids = false, bool virtualTexture = false) {
+        return (useCubeTexture ? SHADER_CUBE_MAPS : 0)
+            | (settings.format == PACKED_VERTICES ? SHADER_PACKED_VERTICES : 0)
+            | (settings.format == PROCEDURAL_VERTICES ? SHADER_PROCEDURAL_VERTICES : 0)
+            | (useCubeTexture && tilePyramids ? SHADER_EQUAL_ANGLE : 0)
+            | (!useCubeTexture && virtualTexture ? SHADER_VIRTUAL_TEXTURE : 0);
+    }
+
+    // shader has to be the shaderFeatures() variant, its samplers are bound to the units the
+    // init functions use in the shaders themselves; without withMesh there are only the
+    // textures and the heightmap, for a globe CubesphereLod draws
+    Cubesphere(MeshSettings settings, Shader* shader, ThreadPool* pool = nullptr, int useMeshCache = 0, bool withMesh = true) {
         this->shader = shader;
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
+        this->settings = settings;
+        cubemapTexture = texture2D = heightTexture = specularTexture = cubemapHeightTexture = cubemapSpecularTexture = 0;
+        proceduralUBO = 0;
+        if (!withMesh) {
+            VAO = VBO = EBO = 0;
+            numberOfVerticesToDraw = 0;
+            return;
+        }
+        if (GLState::get().directStateAccess) {
+            // the buffers are created along with their storage, see uploadMesh
+            glCreateVertexArrays(1, &VAO);
+            VBO = EBO = 0;
+        }
+        else {
+            glGenVertexArrays(1, &VAO);
+            glGenBuffers(1, &VBO);
+            glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        numberOfVerticesToDraw = generateCubeSphereVertices(subdivision);
-
-        shader->use();
-        shader->setInt("useTexture", useCubeTexture);
-        shader->setInt("textureMap", 0);
-        shader->setInt("textureCubeMap", 1);
-        shader->setInt("heightMap", 2);
-        shader->setInt("specularMap", 3);
-        shader->setInt("heightCubeMap", 4);
-        shader->setInt("specularCubeMap", 5);
-        
-        
+            GLState::get().bindVertexArray(VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, VBO);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        }
+        if (settings.format == PROCEDURAL_VERTICES)
+            numberOfVerticesToDraw = generateFaceIndexPattern(settings);
+        else if (settings.format == DISPLACED_VERTICES)
+            numberOfVerticesToDraw = 0; // needs the heightmap, see bakeDisplacement
+        else
+            numberOfVerticesToDraw = generateCubeSphereVertices(settings, pool, useMeshCache);
     }
-    void initEarthTextureCubeMap(std::vector<std::string> faces) {
-        glGenTextures(1, &cubemapTexture);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        unsigned char* data;
-
-        for (unsigned int i = 0; i < faces.size(); i++)
-        {
-            data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
+    // faces from tiles instead when given, see useTilePyramid()
+    void initEarthTextureCubeMap(ImageLoader& loader, std::vector<std::string> faces, CubeMipmapMode mipmaps = NO_CUBE_MIPMAPS, const TilePyramid* tiles = nullptr) {
+        cubemapTexture = createTexture(1, GL_TEXTURE_CUBE_MAP);
+        // map the faces when converted; with direct state access the container and the tile
+        // pyramid go in by name, only the decoded faces get the texture bound
+        const TextureContainer* container = tiles ? nullptr : loader.uploadContainer(faces[0], GL_TEXTURE_CUBE_MAP, cubemapTexture, mipmaps == GL_CUBE_MIPMAPS);
+        if (tiles)
+            useTilePyramid(*tiles, GL_RGB8, 1, cubemapTexture);
+        else if (!container) {
+            GLState::get().bindTexture(1, GL_TEXTURE_CUBE_MAP, cubemapTexture);
+            loader.uploadCubeMap(faces, mipmaps, [&](int i, const DecodedImage& image) {
+                uploadImage(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, image);
+            });
         }
-        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        finishCubeMap(1, cubemapTexture, mipmaps, tiles ? tiles->header.levels : (container ? container->header.levels : 0));
     }
 
-    void initEarthTexture2D() {
-        glGenTextures(1, &texture2D);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture2D);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-        unsigned char* data = stbi_load("earth.jpg", &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-            glGenerateMipmap(GL_TEXTURE_2D);
-        }
-        else
-        {
-            std::cout << "Failed to load texture" << std::endl;
+    void initEarthTexture2D(ImageLoader& loader) {
+        texture2D = createTexture(0, GL_TEXTURE_2D);
+        // mapped with its mip chain when converted, otherwise decoded and mipmapped here
+        if (!loader.uploadContainer("earth.jpg", GL_TEXTURE_2D, texture2D)) {
+            loader.upload("earth.jpg", [&](const DecodedImage& image) {
+                if (image.data)
+                {
+                    uploadMap(0, texture2D, image);
+                }
+                else
+                {
+                    std::cout << "Failed to load texture" << std::endl;
+                }
+            });
         }
-        stbi_image_free(data);
+        Samplers::bind(0, GL_TEXTURE_2D, texture2D, SAMPLER_MAP_2D);
     }
 
-    void initEarthHeightTexture() {
-        glGenTextures(1, &heightTexture);
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, heightTexture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-        unsigned char* data = stbi_load("heightMap.png", &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-            glGenerateMipmap(GL_TEXTURE_2D);
+    void initEarthHeightTexture(ImageLoader& loader, const std::string& path = "heightMap.png") {
+        heightTexture = createTexture(2, GL_TEXTURE_2D);
+        // mapped with its mip chain when converted, otherwise decoded and mipmapped here
+        const TextureContainer* container = loader.uploadContainer(path, GL_TEXTURE_2D, heightTexture);
+        if (container) {
+            std::vector<unsigned char> texels = container->texels(0, 0);
+            heightmap.setImage(0, texels.data(), container->header.width, container->header.height, container->header.channels, 0, container->bytesPerChannel());
         }
-        else
-        {
-            std::cout << "Failed to load texture" << std::endl;
+        else {
+            loader.upload(path, [&](const DecodedImage& image) {
+                if (image.data)
+                {
+                    uploadMap(2, heightTexture, image);
+                    heightmap.setImage(0, image.data, image.width, image.height, image.channels, 0, image.bytesPerChannel());
+                }
+                else
+                {
+                    std::cout << "Failed to load texture" << std::endl;
+                }
+            });
         }
-        stbi_image_free(data);
+        Samplers::bind(2, GL_TEXTURE_2D, heightTexture, SAMPLER_MAP_2D);
     }
 
-    void initEarthSpecularTexture() {
-        glGenTextures(1, &specularTexture);
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, specularTexture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-        unsigned char* data = stbi_load("specularMap.png", &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-            glGenerateMipmap(GL_TEXTURE_2D);
+    void initEarthSpecularTexture(ImageLoader& loader) {
+        specularTexture = createTexture(3, GL_TEXTURE_2D);
+        // mapped with its mip chain when converted, otherwise decoded and mipmapped here
+        if (!loader.uploadContainer("specularMap.png", GL_TEXTURE_2D, specularTexture)) {
+            loader.upload("specularMap.png", [&](const DecodedImage& image) {
+                if (image.data)
+                {
+                    uploadMap(3, specularTexture, image);
+                }
+                else
+                {
+                    std::cout << "Failed to load texture" << std::endl;
+                }
+            });
         }
-        else
-        {
-            std::cout << "Failed to load texture" << std::endl;
+        Samplers::bind(3, GL_TEXTURE_2D, specularTexture, SAMPLER_MAP_2D);
+    }
+
+    void initEarthHeightTextureCubeMap(ImageLoader& loader, std::vector<std::string> faces, CubeMipmapMode mipmaps = NO_CUBE_MIPMAPS, const TilePyramid* tiles = nullptr, GLenum internalFormat = GL_R8) {
+        cubemapHeightTexture = createTexture(4, GL_TEXTURE_CUBE_MAP);
+        // upload the decoded faces, or map them when converted
+        const TextureContainer* container = tiles ? nullptr : loader.uploadContainer(faces[0], GL_TEXTURE_CUBE_MAP, cubemapHeightTexture, mipmaps == GL_CUBE_MIPMAPS);
+        if (tiles) {
+            useTilePyramid(*tiles, internalFormat, 4, cubemapHeightTexture);
+            for (int i = 0; i < 6; i++) {
+                std::vector<unsigned char> texels = tiles->faceTexels(i, 0);
+                heightmap.setImage(i, texels.data(), tiles->levelSize(0), tiles->levelSize(0), tiles->header.channels, 1, tiles->header.type == GL_UNSIGNED_SHORT ? 2 : 1);
+            }
+            heightmap.equalAngle = 1;
         }
-        stbi_image_free(data);
+        else if (container) {
+            for (unsigned int i = 0; i < faces.size(); i++) {
+                std::vector<unsigned char> texels = container->texels(i, 0);
+                heightmap.setImage(i, texels.data(), container->header.width, container->header.height, container->header.channels, 1, container->bytesPerChannel());
+            }
+        }
+        else {
+            GLState::get().bindTexture(4, GL_TEXTURE_CUBE_MAP, cubemapHeightTexture);
+            loader.uploadCubeMap(faces, mipmaps, [&](int i, const DecodedImage& image) {
+                uploadImage(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, image);
+                if (image.data)
+                    heightmap.setImage(i, image.data, image.width, image.height, image.channels, 1, image.bytesPerChannel());
+            });
+        }
+        finishCubeMap(4, cubemapHeightTexture, mipmaps, tiles ? tiles->header.levels : (container ? container->header.levels : 0));
     }
 
-    void initEarthHeightTextureCubeMap(std::vector<std::string> faces) {
-        glGenTextures(1, &cubemapHeightTexture);
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapHeightTexture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        unsigned char* data;
-
-        for (unsigned int i = 0; i < faces.size(); i++)
-        {
-            data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
+    void initEarthSpecularTextureCubeMap(ImageLoader& loader, std::vector<std::string> faces, CubeMipmapMode mipmaps = NO_CUBE_MIPMAPS, const TilePyramid* tiles = nullptr) {
+        cubemapSpecularTexture = createTexture(5, GL_TEXTURE_CUBE_MAP);
+        // upload the decoded faces, or map them when converted
+        const TextureContainer* container = tiles ? nullptr : loader.uploadContainer(faces[0], GL_TEXTURE_CUBE_MAP, cubemapSpecularTexture, mipmaps == GL_CUBE_MIPMAPS);
+        if (tiles)
+            useTilePyramid(*tiles, GL_R8, 5, cubemapSpecularTexture);
+        else if (!container) {
+            GLState::get().bindTexture(5, GL_TEXTURE_CUBE_MAP, cubemapSpecularTexture);
+            loader.uploadCubeMap(faces, mipmaps, [&](int i, const DecodedImage& image) {
+                uploadImage(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, image);
+            });
         }
+        finishCubeMap(5, cubemapSpecularTexture, mipmaps, tiles ? tiles->header.levels : (container ? container->header.levels : 0));
     }
 
-    void initEarthSpecularTextureCubeMap(std::vector<std::string> faces) {
-        glGenTextures(1, &cubemapSpecularTexture);
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapSpecularTexture);
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        // load image, create texture and generate mipmaps
-        int width, height, nrChannels;
-        unsigned char* data;
-
-        for (unsigned int i = 0; i < faces.size(); i++)
-        {
-            data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
+    // every level of the cube map on unit from a tile pyramid; its faces are on the
+    // equal-angle grid, which the SHADER_EQUAL_ANGLE variant samples through
+    void useTilePyramid(const TilePyramid& tiles, GLenum internalFormat, int unit, unsigned int texture) {
+        if (GLState::get().directStateAccess)
+            tiles.upload(internalFormat, texture);
+        else {
+            GLState::get().bindTexture(unit, GL_TEXTURE_CUBE_MAP, texture);
+            tiles.upload(internalFormat);
         }
     }
 
-private:
-    int generateCubeSphereVertices(int subdivision) {
-
-        int numOfFaces = 6;
-
-        const float DEG2RAD = acos(-1) / 180.0f;
-        const float pi = atan(1) * 4;
-        glm::vec3 n1;        // normal of longitudinal plane
-        glm::vec3 n2;        // normal of latitudinal plane
-        glm::vec3 v;         // direction vector intersecting 2 planes, n1 x n2
-        float a1;           // longitudinal angle
-        float a2;           // latitudinal angle
-
-        // compute the number of vertices per row, 2^n + 1
-        int verticesPerRow = (int)pow(2, subdivision) + 1;
-        float* vertices = new float[verticesPerRow * verticesPerRow * 5 * numOfFaces];
-        unsigned int* indices = new unsigned int[(verticesPerRow - 1) * (verticesPerRow - 1) * 2 * 3 * numOfFaces];
-        int vertexCounter = 0;
-        int indexCounter = 0;
-        for (int f = 0; f < numOfFaces; f++) {
-            // rotate latitudinal plane from 45 to -45 degrees
-            for (unsigned int i = 0; i < verticesPerRow; ++i)
-            {
-                // normal for latitudinal plane
-                // if latitude angle is 0, then normal vector of latitude plane is n2=(0,1,0)
-                // therefore, it is rotating (0,1,0) vector by latitude angle a2
-                a2 = DEG2RAD * (45.0f - 90.0f * i / (verticesPerRow - 1));
-                n2[0] = -sin(a2);
-                n2[1] = cos(a2);
-                n2[2] = 0;
-
-
-                // rotate longitudinal plane from -45 to 45
-                for (unsigned int j = 0; j < verticesPerRow; ++j)
-                {
-                    // normal for longitudinal plane
-                    // if longitude angle is 0, then normal vector of longitude is n1=(0,0,-1)
-                    // therefore, it is rotating (0,0,-1) vector by longitude angle a1
-                    a1 = DEG2RAD * (-45.0f + 90.0f * j / (verticesPerRow - 1));
-                    n1[0] = -sin(a1);
-                    n1[1] = 0;
-                    n1[2] = -cos(a1);
-
-
-                    // find direction vector of intersected line, n1 x n2 and normalize direction vector
-                    v = glm::normalize(glm::cross(n1, n2));
-
-                    // add a vertex into array (x,y,z,s,t)
-                    float x, y, z;
-                    x = calculateVertexCoord(v, (CubeFace)f, 0);
-                    y = calculateVertexCoord(v, (CubeFace)f, 1);
-                    z = calculateVertexCoord(v, (CubeFace)f, 2);
-                    float theta = atan2(-z, x);
-                    float phi = acos(-y);
-                    vertices[vertexCounter++] = x;
-                    vertices[vertexCounter++] = y;
-                    vertices[vertexCounter++] = z;
-                    vertices[vertexCounter++] = (theta + pi) / (2 * pi);
-                    vertices[vertexCounter++] = phi / pi;
-
-                    // generate indices for element buffer
-                    if (j < verticesPerRow - 1 && i < verticesPerRow - 1) {
-                        indices[indexCounter++] = j + verticesPerRow * i + f * verticesPerRow * verticesPerRow;
-                        indices[indexCounter++] = j + 1 + verticesPerRow * i + f * verticesPerRow * verticesPerRow;
-                        indices[indexCounter++] = j + verticesPerRow * (i + 1) + f * verticesPerRow * verticesPerRow;
-
-                        indices[indexCounter++] = j + 1 + verticesPerRow * i + f * verticesPerRow * verticesPerRow;
-                        indices[indexCounter++] = j + verticesPerRow * (i + 1) + f * verticesPerRow * verticesPerRow;
-                        indices[indexCounter++] = j + verticesPerRow * (i + 1) + 1 + f * verticesPerRow * verticesPerRow;
+    // GPU bytes of every loaded texture as the driver describes it, against the same levels as
+    // GL_RGB with 3 bytes a texel, which all of them were before; drivers usually pad that to 4
+    void textureMemoryReport() const {
+        struct { const char* name; GLenum target; int unit; unsigned int texture; } textures[] = {
+            { "earth", GL_TEXTURE_2D, 0, texture2D },
+            { "earth cube map", GL_TEXTURE_CUBE_MAP, 1, cubemapTexture },
+            { "height", GL_TEXTURE_2D, 2, heightTexture },
+            { "specular", GL_TEXTURE_2D, 3, specularTexture },
+            { "height cube map", GL_TEXTURE_CUBE_MAP, 4, cubemapHeightTexture },
+            { "specular cube map", GL_TEXTURE_CUBE_MAP, 5, cubemapSpecularTexture },
+        };
+        size_t totalBytes = 0, totalRgbBytes = 0;
+        std::cout << "Globe texture memory:" << std::endl;
+        for (int t = 0; t < 6; t++) {
+            if (textures[t].texture == 0)
+                continue;
+            // on the unit the globe samples it from
+            GLState::get().bindTexture(textures[t].unit, textures[t].target, textures[t].texture);
+            int faces = textures[t].target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+            GLenum levelTarget = faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X : GL_TEXTURE_2D;
+            GLint width = 0, height = 0, internalFormat = 0;
+            glGetTexLevelParameteriv(levelTarget, 0, GL_TEXTURE_WIDTH, &width);
+            glGetTexLevelParameteriv(levelTarget, 0, GL_TEXTURE_HEIGHT, &height);
+            glGetTexLevelParameteriv(levelTarget, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+            size_t bytes = 0, rgbBytes = 0;
+            int levels = 0;
+            for (; levels < 16; levels++) {
+                GLint levelWidth = 0, levelHeight = 0, compressed = 0;
+                glGetTexLevelParameteriv(levelTarget, levels, GL_TEXTURE_WIDTH, &levelWidth);
+                if (levelWidth == 0)
+                    break;
+                glGetTexLevelParameteriv(levelTarget, levels, GL_TEXTURE_HEIGHT, &levelHeight);
+                glGetTexLevelParameteriv(levelTarget, levels, GL_TEXTURE_COMPRESSED, &compressed);
+                if (compressed) {
+                    GLint size = 0;
+                    glGetTexLevelParameteriv(levelTarget, levels, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+                    bytes += (size_t)size * faces;
+                }
+                else {
+                    GLint bits = 0, channelBits;
+                    const GLenum channels[4] = { GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE };
+                    for (int c = 0; c < 4; c++) {
+                        glGetTexLevelParameteriv(levelTarget, levels, channels[c], &channelBits);
+                        bits += channelBits;
                     }
+                    bytes += (size_t)levelWidth * levelHeight * bits / 8 * faces;
                 }
+                rgbBytes += (size_t)levelWidth * levelHeight * 3 * faces;
             }
+            std::cout << "  " << textures[t].name << " " << width << "x" << height << ", " << levels << " levels, format 0x" << std::hex << internalFormat << std::dec
+                << ": " << bytes << " bytes, " << rgbBytes << " as GL_RGB (" << (double)rgbBytes / bytes << "x)" << std::endl;
+            totalBytes += bytes;
+            totalRgbBytes += rgbBytes;
+        }
+        std::cout << "  total " << totalBytes << " bytes, " << totalRgbBytes << " as GL_RGB" << std::endl;
+    }
 
+    // level 0 of a decoded image into target, or one face of it: the grey maps come decoded to
+    // one channel and go in as greyFormat(), and read back as grey through .rgb
+    static void uploadImage(GLenum target, GLenum imageTarget, const DecodedImage& image) {
+        // rows are packed, three channels wide ones too
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (image.channels != 1) {
+            glTexImage2D(imageTarget, 0, GL_RGB, image.width, image.height, 0, image.channels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, image.data);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+            return;
         }
+        glTexImage2D(imageTarget, 0, greyFormat(image), image.width, image.height, 0, GL_RED, image.type, image.data);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        glTexParameteri(target, GL_TEXTURE_SWIZZLE_G, GL_RED);
+        glTexParameteri(target, GL_TEXTURE_SWIZZLE_B, GL_RED);
+    }
 
-        glBufferData(GL_ARRAY_BUFFER, vertexCounter * sizeof(float), vertices, GL_STATIC_DRAW);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCounter * sizeof(float), indices, GL_STATIC_DRAW);
-        // position attribute
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
-        // texture coord attribute
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
-        delete[] vertices;
-        delete[] indices;
-        return indexCounter;
+    // a decoded 2D map with the mip chain under it. With direct state access into immutable
+    // storage by name, otherwise into the texture bound on unit like uploadImage
+    static void uploadMap(int unit, unsigned int texture, const DecodedImage& image) {
+        if (!GLState::get().directStateAccess) {
+            GLState::get().bindTexture(unit, GL_TEXTURE_2D, texture);
+            uploadImage(GL_TEXTURE_2D, GL_TEXTURE_2D, image);
+            glGenerateMipmap(GL_TEXTURE_2D);
+            return;
+        }
+        bool grey = image.channels == 1;
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTextureStorage2D(texture, TextureContainer::chainLevels(image.width, image.height), grey ? greyFormat(image) : GL_RGB8, image.width, image.height);
+        glTextureSubImage2D(texture, 0, 0, 0, image.width, image.height, grey ? GL_RED : (image.channels == 4 ? GL_RGBA : GL_RGB), grey ? image.type : GL_UNSIGNED_BYTE, image.data);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        if (grey) {
+            glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_G, GL_RED);
+            glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        }
+        glGenerateTextureMipmap(texture);
     }
 
-    float calculateVertexCoord(glm::vec3 vec, CubeFace face, int axis) {
-        switch (face) {
-        case POSX:
-            //x coord
-            if (axis == 0) {
-                return vec[0];
-            }
-            //y coord
-            else if (axis == 1) {
-                return vec[1];
-            }
-            //z coord
-            else {
-                return vec[2];
-            }
-            break;
-        case NEGX:
-            //x coord
-            if (axis == 0) {
-                return -vec[0];
-            }
-            //y coord
-            else if (axis == 1) {
-                return vec[1];
-            }
-            //z coord
-            else {
-                return -vec[2];
-            }
-            break;
-        case POSY:
-            //x coord
-            if (axis == 0) {
-                return -vec[2];
-            }
-            //y coord
-            else if (axis == 1) {
-                return vec[0];
-            }
-            //z coord
-            else {
-                return -vec[1];
-            }
-            break;
-        case NEGY:
-            //x coord
-            if (axis == 0) {
-                return vec[2];
-            }
-            //y coord
-            else if (axis == 1) {
-                return -vec[0];
-            }
-            //z coord
-            else {
-                return -vec[1];
-            }
-            break;
-        case POSZ:
-            //x coord
-            if (axis == 0) {
-                return -vec[2];
-            }
-            //y coord
-            else if (axis == 1) {
-                return vec[1];
-            }
-            //z coord
-            else {
-                return vec[0];
-            }
-            break;
-        case NEGZ:
-            //x coord
-            if (axis == 0) {
-                return vec[2];
-            }
-            //y coord
-            else if (axis == 1) {
-                return vec[1];
-            }
-            //z coord
-            else {
-                return -vec[0];
+    // R8 for a grey map, or the R16/R16F/R32F it was requested as or decoded to
+    static GLenum greyFormat(const DecodedImage& image) {
+        GLenum internalFormat = image.internalFormat;
+        if (internalFormat != GL_R16 && internalFormat != GL_R16F && internalFormat != GL_R32F)
+            internalFormat = image.type == GL_FLOAT ? GL_R32F : (image.type == GL_UNSIGNED_SHORT ? GL_R16 : GL_R8);
+        return internalFormat;
+    }
+
+    // once the faces of a cube map on unit are in: its mip chain for mipmaps and the sampler
+    // to go with it. levels came in by name with direct state access, 0 when the faces were
+    // decoded into the bound texture, which stays mutable and has its filter set on it.
+    static void finishCubeMap(int unit, unsigned int texture, CubeMipmapMode mipmaps, int levels) {
+        bool trilinear;
+        if (GLState::get().directStateAccess && levels > 0)
+            trilinear = CubeMipmaps::finish(mipmaps, texture, levels);
+        else {
+            GLState::get().bindTexture(unit, GL_TEXTURE_CUBE_MAP, texture);
+            trilinear = CubeMipmaps::finish(mipmaps);
+        }
+        Samplers::bind(unit, GL_TEXTURE_CUBE_MAP, texture, trilinear ? SAMPLER_CUBE_MAP_TRILINEAR : SAMPLER_CUBE_MAP);
+    }
+
+    // DISPLACED_VERTICES: builds the mesh with the heightmap resolved on the CPU, once one of the
+    // height init functions has loaded it, and uploads it for displacedShader.vs
+    int bakeDisplacement(const Heightmap& heightmap, ThreadPool* pool = nullptr) {
+        auto start = std::chrono::high_resolution_clock::now();
+        CubesphereMesh mesh(settings.subdivision, pool, settings.mapping);
+        if (settings.optimizeVertexCache)
+            mesh.optimizeVertexCache();
+        if (settings.tilesPerSide > 0)
+            mesh.splitIntoTiles(settings.tilesPerSide);
+        tiles = mesh.tiles;
+        std::vector<float> displaced = mesh.displaceVertices(heightmap, pool);
+
+        uploadMesh(DISPLACED_VERTICES, displaced.data(), displaced.size() * sizeof(float), mesh.indices.data(), mesh.indices.size());
+        GLState::get().bindVertexArray(0);
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Cubesphere mesh displaced in " << std::chrono::duration<double, std::milli>(end - start).count()
+            << " ms (" << (pool ? pool->size() : 1) << " threads), " << mesh.vertexCount() << " vertices, "
+            << displaced.size() * sizeof(float) + mesh.indices.size() * sizeof(unsigned int) << " buffer bytes" << std::endl;
+        numberOfVerticesToDraw = (int)mesh.indices.size();
+        return numberOfVerticesToDraw;
+    }
+
+    // GPU time of the vertex stage alone: the whole globe drawn repetitions times with
+    // rasterization turned off, after one warm-up draw
+    double timeVertexShading(int repetitions) {
+        GLState::get().bindVertexArray(VAO);
+        glEnable(GL_RASTERIZER_DISCARD);
+        glDrawElements(GL_TRIANGLES, numberOfVerticesToDraw, GL_UNSIGNED_INT, 0);
+        glFinish();
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int k = 0; k < repetitions; k++)
+            glDrawElements(GL_TRIANGLES, numberOfVerticesToDraw, GL_UNSIGNED_INT, 0);
+        glFinish();
+        auto end = std::chrono::high_resolution_clock::now();
+        glDisable(GL_RASTERIZER_DISCARD);
+        GLState::get().bindVertexArray(0);
+        return std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+    }
+
+private:
+    int generateCubeSphereVertices(const MeshSettings& settings, ThreadPool* pool, int useMeshCache) {
+        auto start = std::chrono::high_resolution_clock::now();
+        MeshCache cache(settings);
+        if (useMeshCache && cache.load()) {
+            uploadMesh(settings.format, cache.vertexData, (size_t)cache.header.vertexBytes, cache.indexData, cache.header.indexCount);
+            tiles.assign(cache.tileData, cache.tileData + cache.header.tileCount);
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << "Cubesphere mesh loaded from " << cache.path << " in " << std::chrono::duration<double, std::milli>(end - start).count()
+                << " ms (warm start), " << cache.header.vertexCount << " vertices, "
+                << cache.header.vertexBytes + cache.header.indexBytes << " buffer bytes" << std::endl;
+            return (int)cache.header.indexCount;
+        }
+
+        CubesphereMesh mesh(settings.subdivision, pool, settings.mapping);
+        if (settings.optimizeVertexCache)
+            mesh.optimizeVertexCache();
+        if (settings.tilesPerSide > 0)
+            mesh.splitIntoTiles(settings.tilesPerSide);
+        tiles = mesh.tiles;
+
+        std::vector<PackedVertex> packed;
+        const void* vertexData = mesh.vertices.data();
+        size_t vertexBytes = mesh.vertices.size() * sizeof(float);
+        if (settings.format == PACKED_VERTICES) {
+            packed = mesh.packVertices();
+            vertexData = packed.data();
+            vertexBytes = packed.size() * sizeof(PackedVertex);
+        }
+        uploadMesh(settings.format, vertexData, vertexBytes, mesh.indices.data(), mesh.indices.size());
+        if (useMeshCache && !cache.store(vertexData, mesh.vertexCount(), mesh.indices.data(), (uint32_t)mesh.indices.size(), tiles.data(), (uint32_t)tiles.size()))
+            std::cout << "Failed to write mesh cache " << cache.path << std::endl;
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Cubesphere mesh generated in " << std::chrono::duration<double, std::milli>(end - start).count()
+            << " ms (" << (useMeshCache ? "cold start, " : "") << (pool ? pool->size() : 1) << " threads), " << mesh.vertexCount() << " vertices, "
+            << vertexBytes + mesh.indices.size() * sizeof(unsigned int) << " buffer bytes" << std::endl;
+        return (int)mesh.indices.size();
+    }
+
+    // std140 layout of the ProceduralSphere block
+    struct ProceduralSphereBlock {
+        int verticesPerRow;
+        int padding[3];
+        float faceAxes[CubesphereMesh::numOfFaces][4][4];
+    };
+
+    // Only the index pattern of one face goes to the GPU. shader.vs rebuilds every vertex from
+    // gl_VertexID (j + verticesPerRow * i) and gl_InstanceID (the face), and the draw is
+    // instanced once per face.
+    int generateFaceIndexPattern(const MeshSettings& settings) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<unsigned int> pattern = CubesphereMesh::faceIndexPattern(settings.subdivision, settings.optimizeVertexCache);
+        if (GLState::get().directStateAccess) {
+            glCreateBuffers(1, &EBO);
+            glNamedBufferStorage(EBO, pattern.size() * sizeof(unsigned int), pattern.data(), 0);
+            glVertexArrayElementBuffer(VAO, EBO);
+        }
+        else {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, pattern.size() * sizeof(unsigned int), pattern.data(), GL_STATIC_DRAW);
+        }
+
+        ProceduralSphereBlock block;
+        memset(&block, 0, sizeof(block));
+        block.verticesPerRow = (1 << settings.subdivision) + 1;
+        for (int face = 0; face < CubesphereMesh::numOfFaces; face++) {
+            float axes[3][3];
+            CubesphereMesh::faceAxes(face, axes);
+            for (int column = 0; column < 3; column++)
+                memcpy(block.faceAxes[face][column], axes[column], 3 * sizeof(float));
+            block.faceAxes[face][3][3] = 1.0f;
+        }
+        if (GLState::get().directStateAccess) {
+            glCreateBuffers(1, &proceduralUBO);
+            glNamedBufferStorage(proceduralUBO, sizeof(block), &block, 0);
+        }
+        else {
+            glGenBuffers(1, &proceduralUBO);
+            glBindBuffer(GL_UNIFORM_BUFFER, proceduralUBO);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(block), &block, GL_STATIC_DRAW);
+        }
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, proceduralUBO);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Cubesphere procedural vertices set up in " << std::chrono::duration<double, std::milli>(end - start).count()
+            << " ms, 0 vertex bytes, " << pattern.size() << " indices for one face, "
+            << pattern.size() * sizeof(unsigned int) + sizeof(block) << " buffer bytes" << std::endl;
+        return (int)pattern.size();
+    }
+
+    struct VertexAttribute {
+        GLuint index;
+        GLint size;
+        GLenum type;
+        GLboolean normalized;
+        GLuint offset;
+    };
+
+    // the vertices go into VBO and the indices into EBO, with the attributes of format set on VAO.
+    // With direct state access both buffers get immutable storage, which can't be resized, so
+    // they are created anew when bakeDisplacement replaces the mesh; otherwise VAO is bound and
+    // the buffers are filled with glBufferData.
+    void uploadMesh(VertexFormat format, const void* vertexData, size_t vertexBytes, const unsigned int* indices, size_t indexCount) {
+        GLsizei stride;
+        std::vector<VertexAttribute> attributes;
+        if (format == DISPLACED_VERTICES) {
+            stride = CubesphereMesh::displacedFloatsPerVertex * sizeof(float);
+            // displaced position, texture coord attribute, displaced normal
+            attributes = { { 0, 3, GL_FLOAT, GL_FALSE, 0 }, { 1, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float) }, { 2, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float) } };
+        }
+        else if (format == PACKED_VERTICES) {
+            stride = sizeof(PackedVertex);
+            // octahedral direction, decoded in shader.vs, and texture coord attribute
+            attributes = { { 0, 2, GL_SHORT, GL_TRUE, 0 }, { 1, 2, GL_UNSIGNED_SHORT, GL_TRUE, 2 * sizeof(short) } };
+        }
+        else {
+            stride = 5 * sizeof(float);
+            // position attribute, texture coord attribute
+            attributes = { { 0, 3, GL_FLOAT, GL_FALSE, 0 }, { 1, 2, GL_FLOAT, GL_FALSE, 3 * sizeof(float) } };
+        }
+
+        if (GLState::get().directStateAccess) {
+            glDeleteBuffers(1, &VBO);
+            glDeleteBuffers(1, &EBO);
+            glCreateBuffers(1, &VBO);
+            glNamedBufferStorage(VBO, vertexBytes, vertexData, 0);
+            glCreateBuffers(1, &EBO);
+            glNamedBufferStorage(EBO, indexCount * sizeof(unsigned int), indices, 0);
+            glVertexArrayVertexBuffer(VAO, 0, VBO, 0, stride);
+            glVertexArrayElementBuffer(VAO, EBO);
+            for (const VertexAttribute& attribute : attributes) {
+                glVertexArrayAttribFormat(VAO, attribute.index, attribute.size, attribute.type, attribute.normalized, attribute.offset);
+                glVertexArrayAttribBinding(VAO, attribute.index, 0);
+                glEnableVertexArrayAttrib(VAO, attribute.index);
             }
-            break;
+            return;
+        }
+        GLState::get().bindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertexData, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+        for (const VertexAttribute& attribute : attributes) {
+            glVertexAttribPointer(attribute.index, attribute.size, attribute.type, attribute.normalized, stride, (void*)(size_t)attribute.offset);
+            glEnableVertexAttribArray(attribute.index);
         }
-        return 0;
+    }
 
+    // a texture for unit. With direct state access just the name: the Samplers bound next to
+    // it do the filtering. Otherwise bound to unit for the uploads after it, with the linear
+    // filtering of the globe's maps, clamped to the edge but along s of the 2D maps, the
+    // longitude, which wraps around.
+    static unsigned int createTexture(int unit, GLenum target) {
+        unsigned int texture;
+        if (GLState::get().directStateAccess) {
+            glCreateTextures(target, 1, &texture);
+            return texture;
+        }
+        glGenTextures(1, &texture);
+        GLState::get().bindTexture(unit, target, texture);
+        const GLint parameters[][2] = {
+            { GL_TEXTURE_WRAP_S, target == GL_TEXTURE_2D ? GL_REPEAT : GL_CLAMP_TO_EDGE },
+            { GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE },
+            { GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE },
+            { GL_TEXTURE_MIN_FILTER, GL_LINEAR },
+            { GL_TEXTURE_MAG_FILTER, GL_LINEAR },
+        };
+        for (const auto& parameter : parameters)
+            glTexParameteri(target, (GLenum)parameter[0], parameter[1]);
+        return texture;
     }
 };
 
@@ -0,0 +1,211 @@
+#ifndef CUBESPHERELOD_H
+#define CUBESPHERELOD_H
+
+#include <glad/glad.h>
+#include <glm/glm/glm.hpp>
+#include <cmath>
+#include <vector>
+#include "Shader.h"
+#include "CubesphereMesh.h"
+
+// one selected quadtree node, uploaded as per-instance attributes
+struct LodPatch {
+    float u, v;         // corner of the node on its face, in [0, 1]
+    float size;         // side of the node in face units
+    float face;
+    float morphStart;   // camera distance where the vertices start moving to the parent grid
+    float morphEnd;     // and where they reach it
+};
+
+// Chunked LOD (CDLOD, Strugar 2010) on the cube sphere: every face is a quadtree over
+// (u, v) in [0, 1]^2 and every selected node is drawn as the same patchQuads x patchQuads
+// grid, placed and projected onto the sphere in lodShader.vs. A node is split while the
+// camera is close enough that its quads would cover more than maxPixelError pixels.
+// Near the distance where the parent would have been drawn instead, the vertices the
+// parent grid doesn't have slide onto the parent's edges, so a patch meets a coarser
+// neighbour on exactly the coarser grid and levels fade in without popping or cracks.
+class CubesphereLod {
+public:
+    static const int maxDepthLimit = 16;
+    // fraction of a level's range spent morphing to the parent grid
+    static constexpr float morphRegion = 0.3f;
+
+    unsigned int VAO, gridVBO, gridEBO, instanceVBO;
+    int patchQuads;
+    int maxDepth;
+    float maxPixelError;
+    std::vector<LodPatch> patches;
+    Shader* shader;
+
+    CubesphereLod(Shader* shader, int patchQuads = 16, int maxDepth = 8, float maxPixelError = 4.0f) {
+        this->shader = shader;
+        this->patchQuads = patchQuads;
+        this->maxDepth = maxDepth < maxDepthLimit ? maxDepth : maxDepthLimit;
+        this->maxPixelError = maxPixelError;
+
+        // the grid shared by all patches, (column, row) / patchQuads
+        int verticesPerRow = patchQuads + 1;
+        std::vector<float> grid;
+        grid.reserve(verticesPerRow * verticesPerRow * 2);
+        for (int i = 0; i < verticesPerRow; i++) {
+            for (int j = 0; j < verticesPerRow; j++) {
+                grid.push_back((float)j / patchQuads);
+                grid.push_back((float)i / patchQuads);
+            }
+        }
+        // same triangle layout as CubesphereMesh
+        std::vector<unsigned short> gridIndices;
+        gridIndices.reserve(patchQuads * patchQuads * 6);
+        for (int i = 0; i < patchQuads; i++) {
+            for (int j = 0; j < patchQuads; j++) {
+                unsigned short topLeft = (unsigned short)(j + verticesPerRow * i);
+                gridIndices.push_back(topLeft);
+                gridIndices.push_back(topLeft + 1);
+                gridIndices.push_back(topLeft + verticesPerRow);
+
+                gridIndices.push_back(topLeft + 1);
+                gridIndices.push_back(topLeft + verticesPerRow + 1);
+                gridIndices.push_back(topLeft + verticesPerRow);
+            }
+        }
+        indexCount = (int)gridIndices.size();
+
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &gridVBO);
+        glGenBuffers(1, &gridEBO);
+        glGenBuffers(1, &instanceVBO);
+        GLState::get().bindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
+        glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(float), grid.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, gridIndices.size() * sizeof(unsigned short), gridIndices.data(), GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(LodPatch), (void*)0);
+        glEnableVertexAttribArray(2);
+        glVertexAttribDivisor(2, 1);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(LodPatch), (void*)(4 * sizeof(float)));
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+        GLState::get().bindVertexArray(0);
+
+        shader->use();
+        setUniforms(*shader);
+    }
+
+    // what the patches need of a program drawing them, for any other than the one given above
+    void setUniforms(const Shader& program) const {
+        program.setFloat("patchQuads", (float)patchQuads);
+    }
+
+    ~CubesphereLod() {
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &gridVBO);
+        glDeleteBuffers(1, &gridEBO);
+        glDeleteBuffers(1, &instanceVBO);
+    }
+
+    CubesphereLod(const CubesphereLod&) = delete;
+    CubesphereLod& operator=(const CubesphereLod&) = delete;
+
+    // picks the patches for a camera given in model space (the globe is a unit sphere there)
+    void select(glm::vec3 cameraPosition, float fovy, float viewportHeight) {
+        // a quad of a depth d node spans about (pi/2) / 2^d / patchQuads radians; it covers
+        // maxPixelError pixels at splitDistance[d]
+        const float pi = 3.14159265358979f;
+        float pixelsPerRadian = viewportHeight / (2.0f * tan(fovy / 2.0f));
+        for (int d = 0; d <= maxDepth; d++) {
+            float nodeAngle = pi / 2.0f / (float)(1 << d);
+            float screenRange = nodeAngle / patchQuads * pixelsPerRadian / maxPixelError;
+            // ranges must stay well above the node size or a patch could touch a neighbour
+            // two levels coarser, or one that is itself still morphing: with a bounding radius
+            // of about 0.71 nodeAngle and 30% morph regions that needs more than 3.6 nodeAngle
+            float safeRange = 4.0f * nodeAngle;
+            splitDistance[d] = screenRange > safeRange ? screenRange : safeRange;
+        }
+
+        patches.clear();
+        for (int face = 0; face < CubesphereMesh::numOfFaces; face++)
+            selectNode(cameraPosition, face, 0.0f, 0.0f, 1.0f, 0);
+    }
+
+    // one instanced draw for every selected patch
+    void draw() {
+        GLState::get().bindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        // orphan last frame's instances instead of waiting for the GPU to finish with them
+        glBufferData(GL_ARRAY_BUFFER, patches.size() * sizeof(LodPatch), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, patches.size() * sizeof(LodPatch), patches.data());
+        glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT, 0, (GLsizei)patches.size());
+    }
+
+    int triangleCount() const {
+        return (int)patches.size() * indexCount / 3;
+    }
+
+    // point of the unit sphere for (u, v) on a face, the mapping of CubesphereMesh and lodShader.vs
+    static glm::vec3 faceDirection(int face, float u, float v) {
+        const float DEG2RAD = 3.14159265358979f / 180.0f;
+        float a1 = DEG2RAD * (-45.0f + 90.0f * u);
+        float a2 = DEG2RAD * (45.0f - 90.0f * v);
+        glm::vec3 d = glm::normalize(glm::vec3(cos(a1) * cos(a2), cos(a1) * sin(a2), -sin(a1) * cos(a2)));
+        switch (face) {
+        case POSX: return d;
+        case NEGX: return glm::vec3(-d.x, d.y, -d.z);
+        case POSY: return glm::vec3(-d.z, d.x, -d.y);
+        case NEGY: return glm::vec3(d.z, -d.x, -d.y);
+        case POSZ: return glm::vec3(-d.z, d.y, d.x);
+        default:   return glm::vec3(d.z, d.y, -d.x);
+        }
+    }
+
+private:
+    int indexCount;
+    float splitDistance[maxDepthLimit + 1];
+
+    void selectNode(glm::vec3 cameraPosition, int face, float u, float v, float size, int depth) {
+        if (depth == maxDepth || distanceToNode(cameraPosition, face, u, v, size) > splitDistance[depth]) {
+            LodPatch patch;
+            patch.u = u;
+            patch.v = v;
+            patch.size = size;
+            patch.face = (float)face;
+            if (depth == 0) {
+                // nothing coarser to morph to
+                patch.morphStart = 1e30f;
+                patch.morphEnd = 2e30f;
+            }
+            else {
+                patch.morphEnd = splitDistance[depth - 1];
+                patch.morphStart = patch.morphEnd * (1.0f - morphRegion);
+            }
+            patches.push_back(patch);
+            return;
+        }
+        float half = size * 0.5f;
+        selectNode(cameraPosition, face, u, v, half, depth + 1);
+        selectNode(cameraPosition, face, u + half, v, half, depth + 1);
+        selectNode(cameraPosition, face, u, v + half, half, depth + 1);
+        selectNode(cameraPosition, face, u + half, v + half, half, depth + 1);
+    }
+
+    // lower bound of the distance from the camera to any vertex of the node, displaced or not
+    float distanceToNode(glm::vec3 cameraPosition, int face, float u, float v, float size) const {
+        glm::vec3 center = faceDirection(face, u + size * 0.5f, v + size * 0.5f);
+        float radius = 0.0f;
+        for (int k = 0; k < 8; k++) {
+            // corners and edge midpoints; the patch bulges less than the sphere between them
+            static const float offsets[8][2] = { {0,0}, {0.5f,0}, {1,0}, {1,0.5f}, {1,1}, {0.5f,1}, {0,1}, {0,0.5f} };
+            glm::vec3 p = faceDirection(face, u + size * offsets[k][0], v + size * offsets[k][1]);
+            float r = glm::length(p - center);
+            radius = r > radius ? r : radius;
+        }
+        float d = glm::length(cameraPosition - center) - radius - CubesphereMesh::maxHeight;
+        return d > 0.0f ? d : 0.0f;
+    }
+};
+#endif
@@ -0,0 +1,940 @@
+#ifndef CUBESPHEREMESH_H
+#define CUBESPHEREMESH_H
+
+#include <glm/glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "Heightmap.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+#include "VertexCacheOptimizer.h"
+
+enum CubeFace {
+    POSX,
+    NEGX,
+    POSY,
+    NEGY,
+    POSZ,
+    NEGZ
+};
+
+enum MeshMapping {
+    SEPARATE_FACES,     // every face has its own verticesPerRow^2 vertices
+    WELDED_FACES        // cube edges and corners shared, only the uv seam duplicated
+};
+
+enum VertexFormat {
+    FLOAT_VERTICES,     // x, y, z, s, t as floats, 20 bytes
+    PACKED_VERTICES,    // PackedVertex, 8 bytes
+    PROCEDURAL_VERTICES,// no vertex buffer, shader.vs computes the vertex from gl_VertexID and the face from gl_InstanceID
+    DISPLACED_VERTICES  // heightmap baked in: displaced x, y, z, normal, s, t as floats, 32 bytes, for displacedShader.vs
+};
+
+// unit direction as an octahedral encoded SNORM16 pair, uv as UNORM16
+struct PackedVertex {
+    short direction[2];
+    unsigned short texCoord[2];
+};
+
+// everything that decides the globe mesh buffers, also the key of MeshCache
+struct MeshSettings {
+    int subdivision;
+    MeshMapping mapping;
+    int optimizeVertexCache;
+    VertexFormat format;
+    int tilesPerSide;
+};
+
+// contiguous index range covering one square of a face, with the bounds the culling
+// stage tests (see TileCulling.h)
+struct MeshTile {
+    unsigned int firstIndex;
+    unsigned int indexCount;
+    float center[3];        // bounding sphere of the tile displaced by anything up to maxHeight
+    float radius;
+    float coneAxis[3];      // cone around every vertex normal (direction) of the tile
+    float coneAngle;
+    float innerRadius;      // closest the flat triangles come to the centre of the globe
+};
+
+enum MeshKernel {
+    SCALAR_KERNEL,      // original per-vertex loop
+    SIMD_KERNEL         // simd::FloatPack wide loop over precomputed plane normals
+};
+
+// axis permutation of a face, the same mapping as calculateVertexCoord but fixed at compile time
+template<int face> struct FaceAxes;
+template<> struct FaceAxes<POSX> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = vx; y = vy; z = vz; }
+};
+template<> struct FaceAxes<NEGX> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = simd::negate(vx); y = vy; z = simd::negate(vz); }
+};
+template<> struct FaceAxes<POSY> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = simd::negate(vz); y = vx; z = simd::negate(vy); }
+};
+template<> struct FaceAxes<NEGY> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = vz; y = simd::negate(vx); z = simd::negate(vy); }
+};
+template<> struct FaceAxes<POSZ> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = simd::negate(vz); y = vy; z = vx; }
+};
+template<> struct FaceAxes<NEGZ> {
+    template<class P> static void apply(P vx, P vy, P vz, P& x, P& y, P& z) { x = vz; y = vy; z = simd::negate(vx); }
+};
+
+// CPU side of the cube sphere: vertex (x,y,z,s,t) and index arrays, no GL calls
+class CubesphereMesh {
+public:
+    static const int numOfFaces = 6;
+    static const int floatsPerVertex = 5;
+    static const int displacedFloatsPerVertex = 8;
+    // rows of one face generated by a single job when running on a thread pool
+    static const int rowsPerBand = 32;
+    // quad rows Tipsify orders at once; every such band of a face has the same connectivity,
+    // so one order serves them all. FIFO 16 ACMR is 0.602 at subdivision 11 against 0.600 for
+    // a whole face, which takes over ten times as long and grows faster than the face.
+    static const int cacheOrderRows = 64;
+    // largest heightmap displacement shader.vs adds to the unit sphere, 11 km at a 20x exaggeration
+    static constexpr float maxHeight = 11.0f / 6371.0f * 20.0f;
+
+    int subdivision;
+    int verticesPerRow;
+    MeshMapping mapping;
+    MeshKernel kernel;
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<MeshTile> tiles;
+
+    // builds the mesh, serially when pool is null or has a single thread
+    // (welded faces are only implemented by the SIMD kernel)
+    CubesphereMesh(int subdivision, ThreadPool* pool = nullptr, MeshMapping mapping = SEPARATE_FACES, MeshKernel kernel = SIMD_KERNEL) {
+        this->subdivision = subdivision;
+        this->mapping = mapping;
+        this->kernel = mapping == WELDED_FACES ? SIMD_KERNEL : kernel;
+        // compute the number of vertices per row, 2^n + 1
+        verticesPerRow = (1 << subdivision) + 1;
+        computeFaceRegions();
+        vertices.resize((size_t)faceBase[numOfFaces] * floatsPerVertex);
+        indices.resize((size_t)(verticesPerRow - 1) * (verticesPerRow - 1) * 2 * 3 * numOfFaces);
+        if (this->kernel == SIMD_KERNEL)
+            computePlaneNormals();
+
+        // every (face, row band) job writes into its own slice of both arrays
+        int bandsPerFace = (verticesPerRow + rowsPerBand - 1) / rowsPerBand;
+        auto job = [this, bandsPerFace](int n) {
+            int f = n / bandsPerFace;
+            int rowBegin = (n % bandsPerFace) * rowsPerBand;
+            int rowEnd = rowBegin + rowsPerBand < verticesPerRow ? rowBegin + rowsPerBand : verticesPerRow;
+            if (this->kernel == SCALAR_KERNEL)
+                generateRows((CubeFace)f, rowBegin, rowEnd);
+            else
+                generateRowsSimd((CubeFace)f, rowBegin, rowEnd);
+        };
+        if (pool && pool->size() > 1) {
+            pool->parallelFor(numOfFaces * bandsPerFace, job);
+        }
+        else {
+            for (int n = 0; n < numOfFaces * bandsPerFace; n++)
+                job(n);
+        }
+        if (mapping == WELDED_FACES)
+            duplicateSeamVertices();
+    }
+
+    // reorders triangles for the post-transform cache, then vertices in first-use order; the
+    // faces list their triangles like faceIndexPattern, band after band
+    void optimizeVertexCache() {
+        VertexCacheOptimizer::reorderTriangles(indices, bandTriangleOrder(subdivision));
+        VertexCacheOptimizer::optimizeVertexFetch(vertices, floatsPerVertex, indices);
+    }
+
+    // Groups the triangles into tilesPerSide x tilesPerSide squares per face and gives each
+    // group a contiguous index range. Triangles go to the square of their centroid, found
+    // from the two equal-angle coordinates of its dominant axis, and keep their relative
+    // order so a vertex cache optimized buffer stays optimized within every tile.
+    void splitIntoTiles(int tilesPerSide) {
+        const float pi = 3.14159265358979f;
+        int tileCount = numOfFaces * tilesPerSide * tilesPerSide;
+        size_t triangleCount = indices.size() / 3;
+        std::vector<int> triangleTile(triangleCount);
+        std::vector<unsigned int> tileTriangles(tileCount + 1, 0);
+        for (size_t t = 0; t < triangleCount; t++) {
+            float c[3] = { 0.0f, 0.0f, 0.0f };
+            for (int k = 0; k < 3; k++) {
+                const float* v = &vertices[(size_t)indices[t * 3 + k] * floatsPerVertex];
+                c[0] += v[0];
+                c[1] += v[1];
+                c[2] += v[2];
+            }
+            int axis = 0;
+            if (std::fabs(c[1]) > std::fabs(c[axis]))
+                axis = 1;
+            if (std::fabs(c[2]) > std::fabs(c[axis]))
+                axis = 2;
+            int face = axis * 2 + (c[axis] < 0 ? 1 : 0);
+            float dominant = std::fabs(c[axis]);
+            int bin[2];
+            for (int k = 0; k < 2; k++) {
+                float angle = atan(c[(axis + 1 + k) % 3] / dominant);
+                bin[k] = (int)((angle / (pi / 2) + 0.5f) * tilesPerSide);
+                bin[k] = bin[k] < 0 ? 0 : (bin[k] >= tilesPerSide ? tilesPerSide - 1 : bin[k]);
+            }
+            triangleTile[t] = (face * tilesPerSide + bin[0]) * tilesPerSide + bin[1];
+            tileTriangles[triangleTile[t] + 1]++;
+        }
+        for (int n = 0; n < tileCount; n++)
+            tileTriangles[n + 1] += tileTriangles[n];
+
+        std::vector<unsigned int> sorted(indices.size());
+        std::vector<unsigned int> fill(tileTriangles.begin(), tileTriangles.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+            memcpy(&sorted[(size_t)fill[triangleTile[t]]++ * 3], &indices[t * 3], 3 * sizeof(unsigned int));
+        indices.swap(sorted);
+
+        tiles.clear();
+        for (int n = 0; n < tileCount; n++) {
+            if (tileTriangles[n + 1] == tileTriangles[n])
+                continue;
+            MeshTile tile;
+            tile.firstIndex = tileTriangles[n] * 3;
+            tile.indexCount = (tileTriangles[n + 1] - tileTriangles[n]) * 3;
+            computeTileBounds(tile);
+            tiles.push_back(tile);
+        }
+    }
+
+    // triangles of a single face in the same order and winding as the generated mesh, indices
+    // are j + verticesPerRow * i; drawn once per face with PROCEDURAL_VERTICES
+    static std::vector<unsigned int> faceIndexPattern(int subdivision, int optimizeVertexCache) {
+        int verticesPerRow = (1 << subdivision) + 1;
+        std::vector<unsigned int> pattern = quadRowIndices(verticesPerRow, verticesPerRow - 1);
+        if (optimizeVertexCache)
+            VertexCacheOptimizer::reorderTriangles(pattern, bandTriangleOrder(subdivision));
+        return pattern;
+    }
+
+    // Tipsify order of the triangles in the first cacheOrderRows quad rows of a face
+    static std::vector<unsigned int> bandTriangleOrder(int subdivision) {
+        int verticesPerRow = (1 << subdivision) + 1;
+        int rows = std::min(cacheOrderRows, verticesPerRow - 1);
+        return VertexCacheOptimizer::triangleOrder(quadRowIndices(verticesPerRow, rows), (rows + 1) * verticesPerRow);
+    }
+
+    static std::vector<unsigned int> quadRowIndices(int verticesPerRow, int rows) {
+        std::vector<unsigned int> pattern;
+        pattern.reserve((size_t)rows * (verticesPerRow - 1) * 6);
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < verticesPerRow - 1; j++) {
+                unsigned int topLeft = j + verticesPerRow * i;
+                pattern.push_back(topLeft);
+                pattern.push_back(topLeft + 1);
+                pattern.push_back(topLeft + verticesPerRow);
+
+                pattern.push_back(topLeft + 1);
+                pattern.push_back(topLeft + verticesPerRow + 1);
+                pattern.push_back(topLeft + verticesPerRow);
+            }
+        }
+        return pattern;
+    }
+
+    // FaceAxes of a face chosen at run time, as the columns of a rotation (out = axes * v)
+    static void faceAxes(int face, float axes[3][3]) {
+        for (int k = 0; k < 3; k++) {
+            simd::FloatPack1 v[3] = { 0.0f, 0.0f, 0.0f };
+            v[k] = 1.0f;
+            simd::FloatPack1 x, y, z;
+            switch (face) {
+            case POSX: FaceAxes<POSX>::apply(v[0], v[1], v[2], x, y, z); break;
+            case NEGX: FaceAxes<NEGX>::apply(v[0], v[1], v[2], x, y, z); break;
+            case POSY: FaceAxes<POSY>::apply(v[0], v[1], v[2], x, y, z); break;
+            case NEGY: FaceAxes<NEGY>::apply(v[0], v[1], v[2], x, y, z); break;
+            case POSZ: FaceAxes<POSZ>::apply(v[0], v[1], v[2], x, y, z); break;
+            default:   FaceAxes<NEGZ>::apply(v[0], v[1], v[2], x, y, z); break;
+            }
+            axes[k][0] = x.v;
+            axes[k][1] = y.v;
+            axes[k][2] = z.v;
+        }
+    }
+
+    // Moves every vertex out by its height like shader.vs does, and gives it the normal of the
+    // displaced surface: the cross product of central differences of the heightfield along two
+    // tangents, one quad apart, so copies of a vertex on face edges and the seam agree.
+    std::vector<float> displaceVertices(const Heightmap& heightmap, ThreadPool* pool = nullptr) const {
+        const int chunk = 4096;
+        int count = vertexCount();
+        std::vector<float> displaced((size_t)count * displacedFloatsPerVertex);
+        float step = 3.14159265358979f / 2.0f / (verticesPerRow - 1);
+        auto job = [&](int n) {
+            int end = (n + 1) * chunk < count ? (n + 1) * chunk : count;
+            for (int v = n * chunk; v < end; v++) {
+                const float* vertex = &vertices[(size_t)v * floatsPerVertex];
+                float* out = &displaced[(size_t)v * displacedFloatsPerVertex];
+                glm::vec3 direction(vertex[0], vertex[1], vertex[2]);
+                glm::vec3 position = direction * (1.0f + heightmap.sample(vertex) * maxHeight);
+
+                glm::vec3 east = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), direction);
+                east = glm::length(east) > 1e-4f ? glm::normalize(east) : glm::vec3(1.0f, 0.0f, 0.0f);
+                glm::vec3 north = glm::cross(direction, east);
+                glm::vec3 alongEast = displacedPoint(heightmap, direction + east * step) - displacedPoint(heightmap, direction - east * step);
+                glm::vec3 alongNorth = displacedPoint(heightmap, direction + north * step) - displacedPoint(heightmap, direction - north * step);
+                glm::vec3 normal = glm::normalize(glm::cross(alongEast, alongNorth));
+                if (glm::dot(normal, direction) < 0)
+                    normal = -normal;
+
+                out[0] = position.x;
+                out[1] = position.y;
+                out[2] = position.z;
+                out[3] = normal.x;
+                out[4] = normal.y;
+                out[5] = normal.z;
+                out[6] = vertex[3];
+                out[7] = vertex[4];
+            }
+        };
+        int jobs = (count + chunk - 1) / chunk;
+        if (pool && pool->size() > 1) {
+            pool->parallelFor(jobs, job);
+        }
+        else {
+            for (int n = 0; n < jobs; n++)
+                job(n);
+        }
+        return displaced;
+    }
+
+    std::vector<PackedVertex> packVertices() const {
+        std::vector<PackedVertex> packed(vertexCount());
+        for (size_t v = 0; v < packed.size(); v++) {
+            const float* vertex = &vertices[v * floatsPerVertex];
+            octEncode(vertex, packed[v].direction);
+            packed[v].texCoord[0] = (unsigned short)(glm::clamp(vertex[3], 0.0f, 1.0f) * 65535.0f + 0.5f);
+            packed[v].texCoord[1] = (unsigned short)(glm::clamp(vertex[4], 0.0f, 1.0f) * 65535.0f + 0.5f);
+        }
+        return packed;
+    }
+
+    // same decode as octDecode in shader.vs
+    static glm::vec3 octDecode(const short direction[2]) {
+        glm::vec3 v(glm::max(direction[0] / 32767.0f, -1.0f), glm::max(direction[1] / 32767.0f, -1.0f), 0.0f);
+        v.z = 1.0f - std::fabs(v.x) - std::fabs(v.y);
+        if (v.z < 0) {
+            float x = v.x;
+            v.x = (1.0f - std::fabs(v.y)) * (x >= 0 ? 1.0f : -1.0f);
+            v.y = (1.0f - std::fabs(x)) * (v.y >= 0 ? 1.0f : -1.0f);
+        }
+        return glm::normalize(v);
+    }
+
+    // projects onto the octahedron, unfolds the lower half and keeps whichever of the
+    // four neighbouring SNORM16 pairs decodes closest to the input
+    static void octEncode(const float* direction, short out[2]) {
+        float length = std::fabs(direction[0]) + std::fabs(direction[1]) + std::fabs(direction[2]);
+        float x = direction[0] / length, y = direction[1] / length;
+        if (direction[2] < 0) {
+            float unfoldedX = (1.0f - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+            y = (1.0f - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+            x = unfoldedX;
+        }
+        double bestError = 4.0;
+        for (int c = 0; c < 4; c++) {
+            short candidate[2];
+            candidate[0] = (short)((c & 1) ? std::ceil(x * 32767.0f) : std::floor(x * 32767.0f));
+            candidate[1] = (short)((c & 2) ? std::ceil(y * 32767.0f) : std::floor(y * 32767.0f));
+            double error = angleBetween(octDecode(candidate), direction);
+            if (error < bestError) {
+                bestError = error;
+                out[0] = candidate[0];
+                out[1] = candidate[1];
+            }
+        }
+    }
+
+    // in double precision, acos of a float dot product can't resolve angles below ~3e-4 radians
+    static double angleBetween(glm::vec3 a, const float* b) {
+        double cx = (double)a.y * b[2] - (double)a.z * b[1];
+        double cy = (double)a.z * b[0] - (double)a.x * b[2];
+        double cz = (double)a.x * b[1] - (double)a.y * b[0];
+        double d = (double)a.x * b[0] + (double)a.y * b[1] + (double)a.z * b[2];
+        return atan2(std::sqrt(cx * cx + cy * cy + cz * cz), d);
+    }
+
+    int vertexCount() const {
+        return (int)(vertices.size() / floatsPerVertex);
+    }
+
+    // vertex count and buffer sizes of every mapping and vertex format, the vertex bytes
+    // fetched per frame (FIFO 16 misses after cache optimization) and the packing error
+    static void memoryReport(int subdivision, ThreadPool* pool) {
+        MeshMapping mappings[] = { SEPARATE_FACES, WELDED_FACES };
+        const char* names[] = { "separate faces", "welded faces" };
+        for (int m = 0; m < 2; m++) {
+            CubesphereMesh mesh(subdivision, pool, mappings[m]);
+            mesh.optimizeVertexCache();
+            VertexCacheStats fifo = VertexCacheOptimizer::simulateFifo(mesh.indices, mesh.vertexCount(), 16);
+            size_t indexBytes = mesh.indices.size() * sizeof(unsigned int);
+            size_t strides[] = { floatsPerVertex * sizeof(float), sizeof(PackedVertex) };
+            for (int format = FLOAT_VERTICES; format <= PACKED_VERTICES; format++) {
+                size_t vertexBytes = mesh.vertexCount() * strides[format];
+                std::cout << "Cubesphere mesh, subdivision " << subdivision << ", " << names[m] << ", "
+                    << strides[format] << " bytes per vertex: " << mesh.vertexCount() << " vertices (" << vertexBytes << " bytes), "
+                    << mesh.indices.size() << " indices (" << indexBytes << " bytes), total "
+                    << vertexBytes + indexBytes << " bytes, vertex fetch " << fifo.misses * strides[format] << " bytes per frame" << std::endl;
+            }
+
+            std::vector<PackedVertex> packed = mesh.packVertices();
+            double maxAngle = 0, maxUvError = 0;
+            for (size_t v = 0; v < packed.size(); v++) {
+                const float* vertex = &mesh.vertices[v * floatsPerVertex];
+                double angle = angleBetween(octDecode(packed[v].direction), vertex);
+                maxAngle = angle > maxAngle ? angle : maxAngle;
+                for (int k = 0; k < 2; k++) {
+                    double error = std::fabs(packed[v].texCoord[k] / 65535.0 - vertex[3 + k]);
+                    maxUvError = error > maxUvError ? error : maxUvError;
+                }
+            }
+            std::cout << "  packed vertices: max angular error " << maxAngle * 180.0 / acos(-1.0) << " degrees ("
+                << maxAngle * 6371000.0 << " m on the earth), max uv error " << maxUvError << std::endl;
+        }
+
+        // one face of indices reused by all six faces, no vertex buffer to build, store or fetch
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<unsigned int> pattern = faceIndexPattern(subdivision, 1);
+        auto end = std::chrono::high_resolution_clock::now();
+        int verticesPerRow = (1 << subdivision) + 1;
+        VertexCacheStats fifo = VertexCacheOptimizer::simulateFifo(pattern, verticesPerRow * verticesPerRow, 16);
+        std::cout << "Cubesphere mesh, subdivision " << subdivision << ", procedural vertices: 0 vertex bytes, "
+            << pattern.size() << " indices for one face (" << pattern.size() * sizeof(unsigned int) << " bytes), built in "
+            << std::chrono::duration<double, std::milli>(end - start).count() << " ms, "
+            << fifo.misses * numOfFaces << " vertex shader invocations per frame" << std::endl;
+    }
+
+    // ACMR/ATVR of the generated and the optimized index order for subdivisions 1..maxSubdivision
+    static void vertexCacheReport(int maxSubdivision, MeshMapping mapping, ThreadPool* pool) {
+        const int fifoSize = 16, lruSize = 32;
+        std::cout << "Vertex cache, " << (mapping == WELDED_FACES ? "welded" : "separate") << " faces, FIFO "
+            << fifoSize << " / LRU " << lruSize << ", ACMR (ATVR) generated -> optimized" << std::endl;
+        for (int subdivision = 1; subdivision <= maxSubdivision; subdivision++) {
+            CubesphereMesh mesh(subdivision, pool, mapping);
+            VertexCacheStats fifoBefore = VertexCacheOptimizer::simulateFifo(mesh.indices, mesh.vertexCount(), fifoSize);
+            VertexCacheStats lruBefore = VertexCacheOptimizer::simulateLru(mesh.indices, mesh.vertexCount(), lruSize);
+            auto start = std::chrono::high_resolution_clock::now();
+            mesh.optimizeVertexCache();
+            auto end = std::chrono::high_resolution_clock::now();
+            VertexCacheStats fifoAfter = VertexCacheOptimizer::simulateFifo(mesh.indices, mesh.vertexCount(), fifoSize);
+            VertexCacheStats lruAfter = VertexCacheOptimizer::simulateLru(mesh.indices, mesh.vertexCount(), lruSize);
+            std::cout << "  subdivision " << subdivision << ": FIFO " << fifoBefore.acmr() << " (" << fifoBefore.atvr() << ") -> "
+                << fifoAfter.acmr() << " (" << fifoAfter.atvr() << "), LRU " << lruBefore.acmr() << " (" << lruBefore.atvr() << ") -> "
+                << lruAfter.acmr() << " (" << lruAfter.atvr() << "), optimized in "
+                << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+        }
+    }
+
+    // times the scalar and SIMD kernels against each other and serial against pooled generation
+    static void benchmark(int subdivision, ThreadPool* pool) {
+        auto start = std::chrono::high_resolution_clock::now();
+        CubesphereMesh scalar(subdivision, nullptr, SEPARATE_FACES, SCALAR_KERNEL);
+        auto scalarEnd = std::chrono::high_resolution_clock::now();
+        CubesphereMesh serial(subdivision, nullptr, SEPARATE_FACES, SIMD_KERNEL);
+        auto serialEnd = std::chrono::high_resolution_clock::now();
+        CubesphereMesh parallel(subdivision, pool, SEPARATE_FACES, SIMD_KERNEL);
+        auto parallelEnd = std::chrono::high_resolution_clock::now();
+
+        double scalarMs = std::chrono::duration<double, std::milli>(scalarEnd - start).count();
+        double simdMs = std::chrono::duration<double, std::milli>(serialEnd - scalarEnd).count();
+        double parallelMs = std::chrono::duration<double, std::milli>(parallelEnd - serialEnd).count();
+        double vertexCount = (double)scalar.vertices.size() / floatsPerVertex;
+
+        // positions are computed with the same operations, uvs go through simd::atan2
+        float maxPositionError = 0, maxUvError = 0;
+        for (size_t k = 0; k < scalar.vertices.size(); k++) {
+            float error = std::fabs(scalar.vertices[k] - serial.vertices[k]);
+            if (k % floatsPerVertex < 3)
+                maxPositionError = error > maxPositionError ? error : maxPositionError;
+            else
+                maxUvError = error > maxUvError ? error : maxUvError;
+        }
+        bool same = serial.vertices.size() == parallel.vertices.size()
+            && scalar.indices == serial.indices
+            && serial.indices == parallel.indices
+            && memcmp(serial.vertices.data(), parallel.vertices.data(), serial.vertices.size() * sizeof(float)) == 0;
+        std::cout << "Cubesphere mesh, subdivision " << subdivision << ", " << (int)vertexCount << " vertices" << std::endl
+            << "  scalar kernel: " << scalarMs << " ms (" << vertexCount / scalarMs / 1000.0 << " Mvertices/s)" << std::endl
+            << "  simd kernel, " << simd::FloatPack::width << " lanes: " << simdMs << " ms (" << vertexCount / simdMs / 1000.0
+            << " Mvertices/s), max position error " << maxPositionError << ", max uv error " << maxUvError << std::endl
+            << "  simd kernel, " << pool->size() << " threads: " << parallelMs << " ms, output "
+            << (same ? "identical" : "DIFFERENT") << " to serial" << std::endl;
+    }
+
+private:
+    static glm::vec3 displacedPoint(const Heightmap& heightmap, glm::vec3 direction) {
+        direction = glm::normalize(direction);
+        return direction * (1.0f + heightmap.sample(direction) * maxHeight);
+    }
+
+    // vertices are unit directions, so they are also the (undisplaced) normals
+    void computeTileBounds(MeshTile& tile) const {
+        glm::vec3 axis(0.0f);
+        for (unsigned int k = tile.firstIndex; k < tile.firstIndex + tile.indexCount; k++)
+            axis = axis + glm::vec3(vertices[(size_t)indices[k] * floatsPerVertex], vertices[(size_t)indices[k] * floatsPerVertex + 1], vertices[(size_t)indices[k] * floatsPerVertex + 2]);
+        axis = glm::normalize(axis);
+        // the centre sits halfway through the displacement shell below the axis
+        glm::vec3 center = axis * (1.0f + maxHeight * 0.5f);
+        float radius = 0.0f;
+        double coneAngle = 0.0;
+        for (unsigned int k = tile.firstIndex; k < tile.firstIndex + tile.indexCount; k++) {
+            const float* v = &vertices[(size_t)indices[k] * floatsPerVertex];
+            glm::vec3 direction(v[0], v[1], v[2]);
+            float low = glm::length(direction - center);
+            float high = glm::length(direction * (1.0f + maxHeight) - center);
+            radius = glm::max(radius, glm::max(low, high));
+            double angle = angleBetween(axis, v);
+            coneAngle = angle > coneAngle ? angle : coneAngle;
+        }
+        double innerRadius = 1.0;
+        for (unsigned int k = tile.firstIndex; k < tile.firstIndex + tile.indexCount; k += 3) {
+            const float* a = &vertices[(size_t)indices[k] * floatsPerVertex];
+            const float* b = &vertices[(size_t)indices[k + 1] * floatsPerVertex];
+            const float* c = &vertices[(size_t)indices[k + 2] * floatsPerVertex];
+            double e1[3] = { (double)b[0] - a[0], (double)b[1] - a[1], (double)b[2] - a[2] };
+            double e2[3] = { (double)c[0] - a[0], (double)c[1] - a[1], (double)c[2] - a[2] };
+            double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+            double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length == 0.0)
+                continue;
+            double planeDistance = std::fabs(n[0] * a[0] + n[1] * a[1] + n[2] * a[2]) / length;
+            innerRadius = planeDistance < innerRadius ? planeDistance : innerRadius;
+        }
+        for (int k = 0; k < 3; k++) {
+            tile.center[k] = center[k];
+            tile.coneAxis[k] = axis[k];
+        }
+        tile.innerRadius = (float)innerRadius * 0.9999f;
+        // a little slack for the float rounding of the culling tests
+        tile.radius = radius * 1.0001f;
+        tile.coneAngle = (float)coneAngle + 1e-5f;
+    }
+
+    // rows and columns of a face whose vertices are stored with that face
+    struct FaceRegion {
+        int firstRow, lastRow;
+        int firstColumn, lastColumn;
+    };
+    FaceRegion regions[numOfFaces];
+    // index of the first vertex of every face, faceBase[numOfFaces] is the vertex count before the seam copies
+    unsigned int faceBase[numOfFaces + 1];
+
+    // With welded faces a point on a cube edge belongs to the first face in CubeFace order
+    // that contains it: the x faces own all their vertices, the y faces drop the columns
+    // shared with the x faces, the z faces drop both border rows and columns.
+    void computeFaceRegions() {
+        int last = verticesPerRow - 1;
+        for (int f = 0; f < numOfFaces; f++) {
+            regions[f] = { 0, last, 0, last };
+            if (mapping == WELDED_FACES && f >= POSY) {
+                regions[f].firstColumn = 1;
+                regions[f].lastColumn = last - 1;
+            }
+            if (mapping == WELDED_FACES && f >= POSZ) {
+                regions[f].firstRow = 1;
+                regions[f].lastRow = last - 1;
+            }
+        }
+        faceBase[0] = 0;
+        for (int f = 0; f < numOfFaces; f++) {
+            int rows = regions[f].lastRow - regions[f].firstRow + 1;
+            int columns = regions[f].lastColumn - regions[f].firstColumn + 1;
+            faceBase[f + 1] = faceBase[f] + (rows > 0 && columns > 0 ? rows * columns : 0);
+        }
+    }
+
+    // position of vertex (i, j) of a face on the integer lattice [-N, N]^3, N = verticesPerRow - 1,
+    // using the axis permutation of FaceAxes on the unpermuted (N, N - 2i, N - 2j)
+    void latticePoint(int f, int i, int j, int point[3]) const {
+        int N = verticesPerRow - 1;
+        int vx = N, vy = N - 2 * i, vz = N - 2 * j;
+        switch (f) {
+        case POSX: point[0] = vx;  point[1] = vy;  point[2] = vz;  break;
+        case NEGX: point[0] = -vx; point[1] = vy;  point[2] = -vz; break;
+        case POSY: point[0] = -vz; point[1] = vx;  point[2] = -vy; break;
+        case NEGY: point[0] = vz;  point[1] = -vx; point[2] = -vy; break;
+        case POSZ: point[0] = -vz; point[1] = vy;  point[2] = vx;  break;
+        case NEGZ: point[0] = vz;  point[1] = vy;  point[2] = -vx; break;
+        }
+    }
+
+    // inverse of latticePoint for the face that owns the point
+    void ownerCoords(const int point[3], int& f, int& i, int& j) const {
+        int N = verticesPerRow - 1;
+        int x = point[0], y = point[1], z = point[2];
+        int vy, vz;
+        if (x == N)       { f = POSX; vy = y;  vz = z;  }
+        else if (x == -N) { f = NEGX; vy = y;  vz = -z; }
+        else if (y == N)  { f = POSY; vy = -z; vz = -x; }
+        else if (y == -N) { f = NEGY; vy = -z; vz = x;  }
+        else if (z == N)  { f = POSZ; vy = y;  vz = -x; }
+        else              { f = NEGZ; vy = y;  vz = x;  }
+        i = (N - vy) / 2;
+        j = (N - vz) / 2;
+    }
+
+    unsigned int vertexIndex(int f, int i, int j) const {
+        const FaceRegion& r = regions[f];
+        if (i < r.firstRow || i > r.lastRow || j < r.firstColumn || j > r.lastColumn) {
+            int point[3];
+            latticePoint(f, i, j, point);
+            ownerCoords(point, f, i, j);
+        }
+        const FaceRegion& owner = regions[f];
+        return faceBase[f] + (i - owner.firstRow) * (owner.lastColumn - owner.firstColumn + 1) + (j - owner.firstColumn);
+    }
+
+    // theta = atan2(-z, x) jumps from pi to -pi across the half plane x < 0, z = 0. Welded
+    // vertices on it get s = 0. A triangle whose s range is over a half crosses it, and its
+    // vertices on the s < 0.5 side use a copy with s + 1 instead: the seam vertices, and at
+    // subdivision 0 the cube corners next to it. The poles (x = z = 0) have no longitude, so
+    // each triangle of the fan around one gets its own pole vertex with the mean s of its other
+    // two; with a single s, whatever it is, the fan would have a triangle across the seam.
+    void duplicateSeamVertices() {
+        unsigned int count = (unsigned int)vertexCount();
+        auto onSeam = [this](unsigned int v) {
+            return vertices[v * floatsPerVertex] < 0 && vertices[v * floatsPerVertex + 2] == 0;
+        };
+        auto isPole = [this](unsigned int v) {
+            return vertices[v * floatsPerVertex] == 0 && vertices[v * floatsPerVertex + 2] == 0;
+        };
+        for (unsigned int v = 0; v < count; v++) {
+            if (onSeam(v))
+                vertices[v * floatsPerVertex + 3] = 0.0f;
+        }
+        // the copies in the order they are made, from the vertex and with the s they get
+        std::vector<std::pair<unsigned int, float>> copies;
+        std::unordered_map<unsigned int, unsigned int> wrapped;
+        std::map<std::pair<unsigned int, float>, unsigned int> poles;
+        auto copyOf = [&](unsigned int v, float s) {
+            unsigned int index = count + (unsigned int)copies.size();
+            copies.push_back(std::make_pair(v, s));
+            return index;
+        };
+        for (size_t k = 0; k < indices.size(); k += 3) {
+            float lowest = 2.0f, highest = -1.0f;
+            for (int c = 0; c < 3; c++) {
+                if (isPole(indices[k + c]))
+                    continue;
+                float u = vertices[(size_t)indices[k + c] * floatsPerVertex + 3];
+                lowest = std::min(lowest, u);
+                highest = std::max(highest, u);
+            }
+            float sum = 0.0f;
+            int others = 0;
+            for (int c = 0; c < 3; c++) {
+                unsigned int v = indices[k + c];
+                if (isPole(v))
+                    continue;
+                float u = vertices[(size_t)v * floatsPerVertex + 3];
+                if (highest - lowest > 0.5f && u < 0.5f) {
+                    auto it = wrapped.find(v);
+                    if (it == wrapped.end()) {
+                        unsigned int index = copyOf(v, u + 1.0f);
+                        it = wrapped.insert(std::make_pair(v, index)).first;
+                    }
+                    indices[k + c] = it->second;
+                    u += 1.0f;
+                }
+                sum += u;
+                others++;
+            }
+            for (int c = 0; c < 3 && others > 0; c++) {
+                unsigned int v = indices[k + c];
+                if (v >= count || !isPole(v))
+                    continue;
+                std::pair<unsigned int, float> key(v, sum / others);
+                auto it = poles.find(key);
+                if (it == poles.end()) {
+                    // the first triangle of the fan keeps the pole itself
+                    bool claimed = poles.lower_bound(std::make_pair(v, -1.0f)) != poles.lower_bound(std::make_pair(v + 1, -1.0f));
+                    unsigned int index = claimed ? copyOf(v, key.second) : v;
+                    if (!claimed)
+                        vertices[(size_t)v * floatsPerVertex + 3] = key.second;
+                    it = poles.insert(std::make_pair(key, index)).first;
+                }
+                indices[k + c] = it->second;
+            }
+        }
+        vertices.resize((size_t)(count + copies.size()) * floatsPerVertex);
+        for (size_t c = 0; c < copies.size(); c++) {
+            memcpy(&vertices[(size_t)(count + c) * floatsPerVertex], &vertices[(size_t)copies[c].first * floatsPerVertex], floatsPerVertex * sizeof(float));
+            vertices[(size_t)(count + c) * floatsPerVertex + 3] = copies[c].second;
+        }
+    }
+
+    // n1 only depends on the column, so the SIMD kernel reads it from tables padded to a whole pack
+    std::vector<float> columnN1x;
+    std::vector<float> columnN1z;
+
+    void computePlaneNormals() {
+        const float DEG2RAD = acos(-1) / 180.0f;
+        // a pack may start at any column up to the last one
+        int paddedColumns = verticesPerRow + simd::FloatPack::width - 1;
+        columnN1x.resize(paddedColumns);
+        columnN1z.resize(paddedColumns);
+        for (int j = 0; j < paddedColumns; j++) {
+            int column = j < verticesPerRow ? j : verticesPerRow - 1;
+            float a1 = DEG2RAD * (-45.0f + 90.0f * column / (verticesPerRow - 1));
+            columnN1x[j] = -sin(a1);
+            columnN1z[j] = -cos(a1);
+        }
+    }
+
+    void generateRowsSimd(CubeFace f, int rowBegin, int rowEnd) {
+        switch (f) {
+        case POSX: generateRowsSimd<POSX, simd::FloatPack>(rowBegin, rowEnd); break;
+        case NEGX: generateRowsSimd<NEGX, simd::FloatPack>(rowBegin, rowEnd); break;
+        case POSY: generateRowsSimd<POSY, simd::FloatPack>(rowBegin, rowEnd); break;
+        case NEGY: generateRowsSimd<NEGY, simd::FloatPack>(rowBegin, rowEnd); break;
+        case POSZ: generateRowsSimd<POSZ, simd::FloatPack>(rowBegin, rowEnd); break;
+        case NEGZ: generateRowsSimd<NEGZ, simd::FloatPack>(rowBegin, rowEnd); break;
+        }
+    }
+
+    // same output as generateRows, P::width vertices of a row per iteration
+    template<int face, class P> void generateRowsSimd(int rowBegin, int rowEnd) {
+        const float DEG2RAD = acos(-1) / 180.0f;
+        const float pi = atan(1) * 4;
+        const int width = P::width;
+        float x[width], y[width], z[width], s[width], t[width];
+        const FaceRegion& region = regions[face];
+        int regionWidth = region.lastColumn - region.firstColumn + 1;
+        size_t indexCounter = ((size_t)face * (verticesPerRow - 1) + rowBegin) * (verticesPerRow - 1) * 6;
+
+        for (int i = rowBegin; i < rowEnd; ++i)
+        {
+            // generate indices for element buffer
+            if (i < verticesPerRow - 1) {
+                for (int j = 0; j < verticesPerRow - 1; ++j) {
+                    unsigned int topLeft = vertexIndex(face, i, j);
+                    unsigned int topRight = vertexIndex(face, i, j + 1);
+                    unsigned int bottomLeft = vertexIndex(face, i + 1, j);
+                    unsigned int bottomRight = vertexIndex(face, i + 1, j + 1);
+                    indices[indexCounter++] = topLeft;
+                    indices[indexCounter++] = topRight;
+                    indices[indexCounter++] = bottomLeft;
+
+                    // clockwise from outside like the first one
+                    indices[indexCounter++] = topRight;
+                    indices[indexCounter++] = bottomRight;
+                    indices[indexCounter++] = bottomLeft;
+                }
+            }
+            if (i < region.firstRow || i > region.lastRow)
+                continue;
+            size_t vertexCounter = ((size_t)faceBase[face] + (size_t)(i - region.firstRow) * regionWidth) * floatsPerVertex;
+
+            // n2 only depends on the row
+            float a2 = DEG2RAD * (45.0f - 90.0f * i / (verticesPerRow - 1));
+            P n2x = P(-sin(a2));
+            P n2y = P(cos(a2));
+            P zero = P(0.0f);
+
+            for (int j = region.firstColumn; j <= region.lastColumn; j += width)
+            {
+                P n1x = P::load(&columnN1x[j]);
+                P n1z = P::load(&columnN1z[j]);
+                // glm::cross(n1, n2) with n1.y = n2.z = 0, kept in glm's operation order
+                // so the signed zeros on the theta = +-pi seam come out the same
+                P vx = zero * zero - n2y * n1z;
+                P vy = n1z * n2x - zero * n1x;
+                P vz = n1x * n2y - n2x * zero;
+                P inverseLength = P(1.0f) / simd::sqrt(vx * vx + vy * vy + vz * vz);
+                P px, py, pz;
+                FaceAxes<face>::apply(vx * inverseLength, vy * inverseLength, vz * inverseLength, px, py, pz);
+                P theta = simd::atan2(simd::negate(pz), px);
+                // acos(-y) = atan2(sqrt(1 - y^2), -y)
+                P phi = simd::atan2(simd::sqrt((P(1.0f) - py) * (P(1.0f) + py)), simd::negate(py));
+                px.store(x);
+                py.store(y);
+                pz.store(z);
+                ((theta + P(pi)) / P(2 * pi)).store(s);
+                (phi / P(pi)).store(t);
+
+                int lanes = region.lastColumn + 1 - j < width ? region.lastColumn + 1 - j : width;
+                for (int k = 0; k < lanes; k++) {
+                    vertices[vertexCounter++] = x[k];
+                    vertices[vertexCounter++] = y[k];
+                    vertices[vertexCounter++] = z[k];
+                    vertices[vertexCounter++] = s[k];
+                    vertices[vertexCounter++] = t[k];
+                }
+            }
+        }
+    }
+
+    // generates vertices of rows [rowBegin, rowEnd) of one face and the quads below them
+    void generateRows(CubeFace f, int rowBegin, int rowEnd) {
+        const float DEG2RAD = acos(-1) / 180.0f;
+        const float pi = atan(1) * 4;
+        glm::vec3 n1;        // normal of longitudinal plane
+        glm::vec3 n2;        // normal of latitudinal plane
+        glm::vec3 v;         // direction vector intersecting 2 planes, n1 x n2
+        float a1;           // longitudinal angle
+        float a2;           // latitudinal angle
+
+        unsigned int faceOffset = f * verticesPerRow * verticesPerRow;
+        size_t vertexCounter = ((size_t)faceOffset + (size_t)rowBegin * verticesPerRow) * floatsPerVertex;
+        size_t indexCounter = ((size_t)f * (verticesPerRow - 1) + rowBegin) * (verticesPerRow - 1) * 6;
+
+        // rotate latitudinal plane from 45 to -45 degrees
+        for (unsigned int i = rowBegin; i < (unsigned int)rowEnd; ++i)
+        {
+            // normal for latitudinal plane
+            // if latitude angle is 0, then normal vector of latitude plane is n2=(0,1,0)
+            // therefore, it is rotating (0,1,0) vector by latitude angle a2
+            a2 = DEG2RAD * (45.0f - 90.0f * i / (verticesPerRow - 1));
+            n2[0] = -sin(a2);
+            n2[1] = cos(a2);
+            n2[2] = 0;
+
+
+            // rotate longitudinal plane from -45 to 45
+            for (unsigned int j = 0; j < (unsigned int)verticesPerRow; ++j)
+            {
+                // normal for longitudinal plane
+                // if longitude angle is 0, then normal vector of longitude is n1=(0,0,-1)
+                // therefore, it is rotating (0,0,-1) vector by longitude angle a1
+                a1 = DEG2RAD * (-45.0f + 90.0f * j / (verticesPerRow - 1));
+                n1[0] = -sin(a1);
+                n1[1] = 0;
+                n1[2] = -cos(a1);
+
+
+                // find direction vector of intersected line, n1 x n2 and normalize direction vector
+                v = glm::normalize(glm::cross(n1, n2));
+
+                // add a vertex into array (x,y,z,s,t)
+                float x, y, z;
+                x = calculateVertexCoord(v, f, 0);
+                y = calculateVertexCoord(v, f, 1);
+                z = calculateVertexCoord(v, f, 2);
+                float theta = atan2(-z, x);
+                float phi = acos(-y);
+                vertices[vertexCounter++] = x;
+                vertices[vertexCounter++] = y;
+                vertices[vertexCounter++] = z;
+                vertices[vertexCounter++] = (theta + pi) / (2 * pi);
+                vertices[vertexCounter++] = phi / pi;
+
+                // generate indices for element buffer
+                if (j < verticesPerRow - 1 && i < verticesPerRow - 1) {
+                    indices[indexCounter++] = j + verticesPerRow * i + faceOffset;
+                    indices[indexCounter++] = j + 1 + verticesPerRow * i + faceOffset;
+                    indices[indexCounter++] = j + verticesPerRow * (i + 1) + faceOffset;
+
+                    indices[indexCounter++] = j + 1 + verticesPerRow * i + faceOffset;
+                    indices[indexCounter++] = j + verticesPerRow * (i + 1) + 1 + faceOffset;
+                    indices[indexCounter++] = j + verticesPerRow * (i + 1) + faceOffset;
+                }
+            }
+        }
+    }
+
+    static float calculateVertexCoord(glm::vec3 vec, CubeFace face, int axis) {
+        switch (face) {
+        case POSX:
+            //x coord
+            if (axis == 0) {
+                return vec[0];
+            }
+            //y coord
+            else if (axis == 1) {
+                return vec[1];
+            }
+            //z coord
+            else {
+                return vec[2];
+            }
+            break;
+        case NEGX:
+            //x coord
+            if (axis == 0) {
+                return -vec[0];
+            }
+            //y coord
+            else if (axis == 1) {
+                return vec[1];
+            }
+            //z coord
+            else {
+                return -vec[2];
+            }
+            break;
+        case POSY:
+            //x coord
+            if (axis == 0) {
+                return -vec[2];
+            }
+            //y coord
+            else if (axis == 1) {
+                return vec[0];
+            }
+            //z coord
+            else {
+                return -vec[1];
+            }
+            break;
+        case NEGY:
+            //x coord
+            if (axis == 0) {
+                return vec[2];
+            }
+            //y coord
+            else if (axis == 1) {
+                return -vec[0];
+            }
+            //z coord
+            else {
+                return -vec[1];
+            }
+            break;
+        case POSZ:
+            //x coord
+            if (axis == 0) {
+                return -vec[2];
+            }
+            //y coord
+            else if (axis == 1) {
+                return vec[1];
+            }
+            //z coord
+            else {
+                return vec[0];
+            }
+            break;
+        case NEGZ:
+            //x coord
+            if (axis == 0) {
+                return vec[2];
+            }
+            //y coord
+            else if (axis == 1) {
+                return vec[1];
+            }
+            //z coord
+            else {
+                return -vec[0];
+            }
+            break;
+        }
+        return 0;
+
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef FRAMEUNIFORMS_H
+#define FRAMEUNIFORMS_H
+
+#include <glad/glad.h>
+#include <glm/glm/glm.hpp>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "GLState.h"
+
+// the std140 layout of Light in the shaders: vec3s start on 16 bytes, a float can take the
+// last 4 bytes of the vec3 before it and the struct rounds up to 16
+struct FrameLight {
+    glm::vec3 position;
+    float padding0;
+    glm::vec3 ambient;
+    float padding1;
+    glm::vec3 diffuse;
+    float padding2;
+    glm::vec3 specular;
+    float constant;
+    float linear;
+    float quadratic;
+    float padding3[2];
+};
+
+// the FrameData uniform block every program declares at binding FrameUniforms::binding
+struct FrameData {
+    glm::mat4 view;
+    glm::mat4 projection;
+    // view without the translation, for the skybox
+    glm::mat4 skyboxView;
+    glm::vec3 viewPos;
+    float padding0;
+    FrameLight light;
+};
+static_assert(sizeof(FrameLight) == 80, "FrameLight has to match the std140 layout of Light");
+static_assert(sizeof(FrameData) == 288, "FrameData has to match the std140 layout of the FrameData block");
+
+// The camera and light data of a frame, written once and read by every program through one
+// uniform block. The buffer holds `slots` copies, persistently and coherently mapped: update()
+// writes the next copy and binds it with glBindBufferRange, so the copies the last frames'
+// draws still read are left alone. A fence per copy, placed when the following update() moves
+// on, tells when a copy can be written again; with a slot more than the frames the driver
+// queues that's always the case and the wait is only counted.
+class FrameUniforms {
+public:
+    static const GLuint binding = 1;
+
+    FrameData data;
+    struct Stats {
+        int updates;
+        int fenceWaits;     // updates whose slot the GPU was still reading
+    } stats;
+
+    FrameUniforms(int slots) : slots(slots), current(-1), buffer(0), mapped(nullptr), fences(slots, nullptr) {
+        memset((void*)&data, 0, sizeof(data));
+        memset(&stats, 0, sizeof(stats));
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        stride = (sizeof(FrameData) + alignment - 1) / alignment * alignment;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        if (GLState::get().bufferStorage) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_UNIFORM_BUFFER, stride * slots, NULL, flags);
+            mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, stride * slots, flags);
+        }
+        if (!mapped) {
+            // one copy, rewritten with glBufferSubData and left to the driver to synchronize
+            std::cout << "FrameData buffer not persistently mapped, updating it with glBufferSubData" << std::endl;
+            glDeleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    ~FrameUniforms() {
+        for (GLsync fence : fences) {
+            if (fence)
+                glDeleteSync(fence);
+        }
+        if (mapped) {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &buffer);
+    }
+
+    FrameUniforms(const FrameUniforms&) = delete;
+    FrameUniforms& operator=(const FrameUniforms&) = delete;
+
+    // copies data into the next slot and binds it for the draws until the next call
+    void update() {
+        stats.updates++;
+        if (!mapped) {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+            return;
+        }
+        // the draws since the last update read the current slot
+        if (current >= 0)
+            fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        current = (current + 1) % slots;
+        if (fences[current]) {
+            GLenum status = glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                stats.fenceWaits++;
+                glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            }
+            glDeleteSync(fences[current]);
+            fences[current] = nullptr;
+        }
+        memcpy(mapped + current * stride, &data, sizeof(FrameData));
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, current * stride, sizeof(FrameData));
+    }
+
+    void report() const {
+        std::cout << "FrameData: " << stats.updates << " updates through " << (mapped ? slots : 1) << " slots of " << stride
+            << " bytes, " << stats.fenceWaits << " waited for the GPU" << std::endl;
+    }
+
+private:
+    int slots, current;
+    size_t stride;
+    unsigned int buffer;
+    unsigned char* mapped;
+    std::vector<GLsync> fences;
+};
+#endif
@@ -0,0 +1,193 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <glad/glad.h>
+#include <cstring>
+#include <iostream>
+
+// Shadow of the GL state the render loop keeps changing: the program, the vertex array, the 2D
+// and cube map textures and the sampler of every unit with the active unit, and the depth and
+// culling state.
+// A call that would set what is already set isn't issued. Code that changes any of it with
+// plain GL calls has to call invalidate() afterwards, Main does once before the render loop.
+// There is one context, so one instance: GLState::get(). It also says whether buffers and
+// textures are created through GL 4.5 direct state access, see useDirectStateAccess(), and
+// which of the extensions older contexts fall back on are there, see loadExtensions().
+class GLState {
+public:
+    static const int maxUnits = 16;
+
+    // set by useDirectStateAccess(), read by the code creating buffers and textures
+    bool directStateAccess;
+    // set by loadExtensions(): glBufferStorage (GL 4.4 or ARB_buffer_storage) and
+    // glGetProgramBinary / glProgramBinary (GL 4.1 or ARB_get_program_binary) can be called
+    bool bufferStorage, programBinary;
+
+    struct Stats {
+        long long issued;       // GL calls made
+        long long filtered;     // calls skipped because the state was already set
+    } stats;
+
+    static GLState& get() {
+        static GLState state;
+        return state;
+    }
+
+    // nothing is known to be set, the next call of every kind is issued
+    void invalidate() {
+        program = vertexArray = unknown;
+        activeUnit = -1;
+        for (int unit = 0; unit < maxUnits; unit++)
+            textures2D[unit] = texturesCube[unit] = samplers[unit] = unknown;
+        depthTest = cullFace = -1;
+        depthFunction = frontFaceMode = 0;
+    }
+
+    void useProgram(GLuint id) {
+        if (changed(program, id))
+            glUseProgram(id);
+    }
+
+    void bindVertexArray(GLuint id) {
+        if (changed(vertexArray, id))
+            glBindVertexArray(id);
+    }
+
+    // binds texture on unit and leaves unit active, so glTexParameter and uploads after it
+    // apply to texture
+    void bindTexture(int unit, GLenum target, GLuint texture) {
+        activeTexture(unit);
+        if (unit < 0 || unit >= maxUnits || (target != GL_TEXTURE_2D && target != GL_TEXTURE_CUBE_MAP)) {
+            // not shadowed
+            glBindTexture(target, texture);
+            stats.issued++;
+            return;
+        }
+        GLuint& bound = target == GL_TEXTURE_2D ? textures2D[unit] : texturesCube[unit];
+        if (changed(bound, texture))
+            glBindTexture(target, texture);
+    }
+
+    // binds texture on unit for the shaders to sample; with direct state access through
+    // glBindTextureUnit, which leaves the active unit alone, otherwise like bindTexture
+    void bindTextureUnit(int unit, GLenum target, GLuint texture) {
+        // a name of 0 would unbind every target of the unit
+        if (!directStateAccess || texture == 0 || unit < 0 || unit >= maxUnits || (target != GL_TEXTURE_2D && target != GL_TEXTURE_CUBE_MAP)) {
+            bindTexture(unit, target, texture);
+            return;
+        }
+        GLuint& bound = target == GL_TEXTURE_2D ? textures2D[unit] : texturesCube[unit];
+        if (changed(bound, texture))
+            glBindTextureUnit(unit, texture);
+    }
+
+    // sampler overrides the parameters of the textures on unit, 0 leaves them to the textures
+    void bindSampler(int unit, GLuint sampler) {
+        if (unit < 0 || unit >= maxUnits) {
+            glBindSampler(unit, sampler);
+            stats.issued++;
+            return;
+        }
+        if (changed(samplers[unit], sampler))
+            glBindSampler(unit, sampler);
+    }
+
+    // unit becomes the one glTexParameter, glTexImage and glGetTexLevelParameter work on
+    void activeTexture(int unit) {
+        if (changed(activeUnit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    // buffers, vertex arrays and textures are created, given immutable storage and filled by
+    // name from now on when requested and the context has GL 4.5; false when they stay on
+    // glGen* and bind-to-edit
+    bool useDirectStateAccess(int requested) {
+        directStateAccess = requested && GLAD_GL_VERSION_4_5;
+        if (requested && !directStateAccess)
+            std::cout << "Direct state access needs GL 4.5, creating buffers and textures through binds" << std::endl;
+        return directStateAccess;
+    }
+
+    // glad.c is generated for GL 4.5 without extensions and only loads the functions of the
+    // versions the context has, so on an older one the entry points of the extensions the
+    // renderer can fall back on are loaded here, after gladLoadGLLoader
+    void loadExtensions(GLADloadproc load) {
+        bufferStorage = GLAD_GL_VERSION_4_4 != 0;
+        if (!bufferStorage && hasExtension("GL_ARB_buffer_storage")) {
+            glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+            bufferStorage = glad_glBufferStorage != nullptr;
+        }
+        programBinary = GLAD_GL_VERSION_4_1 != 0;
+        if (!programBinary && hasExtension("GL_ARB_get_program_binary")) {
+            glad_glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)load("glGetProgramBinary");
+            glad_glProgramBinary = (PFNGLPROGRAMBINARYPROC)load("glProgramBinary");
+            glad_glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)load("glProgramParameteri");
+            programBinary = glad_glGetProgramBinary && glad_glProgramBinary && glad_glProgramParameteri;
+        }
+    }
+
+    static bool hasExtension(const char* name) {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++) {
+            const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+            if (extension && strcmp(extension, name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void depthFunc(GLenum function) {
+        if (changed(depthFunction, function))
+            glDepthFunc(function);
+    }
+
+    void frontFace(GLenum mode) {
+        if (changed(frontFaceMode, mode))
+            glFrontFace(mode);
+    }
+
+    // GL_DEPTH_TEST and GL_CULL_FACE are shadowed, anything else is passed on
+    void enable(GLenum capability, bool enabled) {
+        int* shadow = capability == GL_DEPTH_TEST ? &depthTest : capability == GL_CULL_FACE ? &cullFace : nullptr;
+        if (shadow && !changed(*shadow, (int)enabled))
+            return;
+        if (!shadow)
+            stats.issued++;
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    void report(const Stats& since) const {
+        std::cout << "GL state: " << stats.issued - since.issued << " calls issued, " << stats.filtered - since.filtered
+            << " filtered as redundant in the last frame" << std::endl;
+    }
+
+private:
+    static const GLuint unknown = 0xFFFFFFFFu;
+
+    GLuint program, vertexArray;
+    int activeUnit;
+    GLuint textures2D[maxUnits], texturesCube[maxUnits], samplers[maxUnits];
+    int depthTest, cullFace;
+    GLenum depthFunction, frontFaceMode;
+
+    GLState() : directStateAccess(false), bufferStorage(false), programBinary(false) {
+        stats.issued = stats.filtered = 0;
+        invalidate();
+    }
+
+    template <typename T>
+    bool changed(T& shadow, T value) {
+        if (shadow == value) {
+            stats.filtered++;
+            return false;
+        }
+        shadow = value;
+        stats.issued++;
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,128 @@
+#ifndef HEIGHTMAP_H
+#define HEIGHTMAP_H
+
+#include <glm/glm/glm.hpp>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// CPU copy of the red channel of the height texture at 16 bits, sampled the way the GL
+// samplers of Cubesphere do it: GL_LINEAR on level 0, the 2D map repeating in s and clamped in t,
+// the cube map clamped to the edge of every face
+class Heightmap {
+public:
+    int width, height;
+    int cubeMap;
+    // the cube map faces are on the equal-angle grid of TilePyramid.h
+    int equalAngle;
+    // one image for the 2D map, six in GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order for the cube map
+    std::vector<uint16_t> faces[6];
+
+    Heightmap() : width(0), height(0), cubeMap(0), equalAngle(0) {}
+
+    // keeps the red channel of an image as it was passed to glTexImage2D, with 1 (unsigned
+    // byte), 2 (unsigned short) or 4 (float in [0, 1]) bytes a channel
+    void setImage(int face, const void* data, int width, int height, int channels, int cubeMap, int bytesPerChannel = 1) {
+        this->width = width;
+        this->height = height;
+        this->cubeMap = cubeMap;
+        std::vector<uint16_t>& texels = faces[face];
+        texels.resize((size_t)width * height);
+        for (size_t k = 0; k < texels.size(); k++) {
+            if (bytesPerChannel == 1) {
+                texels[k] = (uint16_t)(((const unsigned char*)data)[k * channels] * 257);
+            }
+            else if (bytesPerChannel == 2) {
+                texels[k] = ((const uint16_t*)data)[k * channels];
+            }
+            else {
+                float value = ((const float*)data)[k * channels];
+                texels[k] = (uint16_t)(glm::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+            }
+        }
+    }
+
+    bool empty() const {
+        return faces[0].empty();
+    }
+
+    // height in [0, 1] under a vertex (x, y, z, s, t) of the unit sphere
+    float sample(const float* vertex) const {
+        if (cubeMap)
+            return sampleCube(glm::vec3(vertex[0], vertex[1], vertex[2]));
+        return sample2D(vertex[3], vertex[4]);
+    }
+
+    // same, for a direction only; s and t as CubesphereMesh computes them
+    float sample(glm::vec3 direction) const {
+        if (cubeMap)
+            return sampleCube(direction);
+        const float pi = 3.14159265358979f;
+        return sample2D((atan2(-direction.z, direction.x) + pi) / (2 * pi), acos(glm::clamp(-direction.y, -1.0f, 1.0f)) / pi);
+    }
+
+    float sample2D(float s, float t) const {
+        return bilinear(faces[0], s, t, 1);
+    }
+
+    // face selection and (s, t) of the GL cube map rules (table 8.19 of the 4.5 spec)
+    float sampleCube(glm::vec3 r) const {
+        float ax = std::fabs(r.x), ay = std::fabs(r.y), az = std::fabs(r.z);
+        int face;
+        float sc, tc, ma;
+        if (ax >= ay && ax >= az) {
+            face = r.x >= 0 ? 0 : 1;
+            sc = r.x >= 0 ? -r.z : r.z;
+            tc = -r.y;
+            ma = ax;
+        }
+        else if (ay >= az) {
+            face = r.y >= 0 ? 2 : 3;
+            sc = r.x;
+            tc = r.y >= 0 ? r.z : -r.z;
+            ma = ay;
+        }
+        else {
+            face = r.z >= 0 ? 4 : 5;
+            sc = r.z >= 0 ? r.x : -r.x;
+            tc = -r.y;
+            ma = az;
+        }
+        sc /= ma;
+        tc /= ma;
+        if (equalAngle) {
+            const float pi = 3.14159265358979f;
+            sc = std::atan(sc) * 4.0f / pi;
+            tc = std::atan(tc) * 4.0f / pi;
+        }
+        return bilinear(faces[face], 0.5f * (sc + 1.0f), 0.5f * (tc + 1.0f), 0);
+    }
+
+private:
+    float bilinear(const std::vector<uint16_t>& texels, float s, float t, int repeatS) const {
+        float x = s * width - 0.5f;
+        float y = t * height - 0.5f;
+        float x0 = std::floor(x), y0 = std::floor(y);
+        float fx = x - x0, fy = y - y0;
+        int i0 = (int)x0, j0 = (int)y0;
+        int i1 = i0 + 1, j1 = j0 + 1;
+        if (repeatS) {
+            i0 = ((i0 % width) + width) % width;
+            i1 = ((i1 % width) + width) % width;
+        }
+        else {
+            i0 = clampIndex(i0, width);
+            i1 = clampIndex(i1, width);
+        }
+        j0 = clampIndex(j0, height);
+        j1 = clampIndex(j1, height);
+        float top = texels[(size_t)j0 * width + i0] * (1.0f - fx) + texels[(size_t)j0 * width + i1] * fx;
+        float bottom = texels[(size_t)j1 * width + i0] * (1.0f - fx) + texels[(size_t)j1 * width + i1] * fx;
+        return (top * (1.0f - fy) + bottom * fy) / 65535.0f;
+    }
+
+    static int clampIndex(int i, int size) {
+        return i < 0 ? 0 : (i >= size ? size - 1 : i);
+    }
+};
+#endif
@@ -0,0 +1,434 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <stb_image.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "CubeMipmaps.h"
+#include "GLState.h"
+#include "TextureContainer.h"
+#include "TextureStreamer.h"
+#include "ThreadPool.h"
+
+// pixels of one file, data is null when the file failed to load
+struct DecodedImage {
+    std::string path;
+    unsigned char* data;
+    int width, height, channels;
+    GLenum type;                        // GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_FLOAT channels
+    GLenum internalFormat;              // the texture is stored in, 0 when the request didn't say
+
+    int bytesPerChannel() const {
+        return type == GL_FLOAT ? 4 : (type == GL_UNSIGNED_SHORT ? 2 : 1);
+    }
+};
+
+// the files of one texture and the container they are converted to
+struct TextureFiles {
+    std::vector<std::string> paths;     // one file for a 2D texture, the six cube faces in GL order
+    bool flip;                          // last row first, for 2D textures sampled with t going up
+    bool mipmaps;                       // bake the whole mip chain into the container, seam-aware for cube maps
+    GLenum internalFormat;
+    std::string container;              // .gtex file, empty to always decode the images
+};
+
+// Decodes image files on a thread pool ahead of time so only the uploads are left for the
+// GL thread. request() queues the files, upload() waits for one of them, hands the pixels to
+// the caller on the calling thread and frees them; uploads happen in the order of the calls,
+// decoding in whatever order the workers get to it. Textures with a container are converted
+// on their first request and mapped instead of decoded afterwards, see uploadContainer().
+// Every file keeps its decode and upload times for report().
+class ImageLoader {
+public:
+    ImageLoader(ThreadPool* pool) : pool(pool), streamer(nullptr), created(std::chrono::high_resolution_clock::now()), mipmapTime(0.0) {}
+
+    ~ImageLoader() {
+        // jobs still running reference their entries
+        for (auto& it : entries) {
+            Entry& entry = *it.second;
+            std::unique_lock<std::mutex> lock(mutex);
+            decodedCondition.wait(lock, [&entry] { return entry.decoded; });
+            stbi_image_free(entry.image.data);
+        }
+    }
+
+    ImageLoader(const ImageLoader&) = delete;
+    ImageLoader& operator=(const ImageLoader&) = delete;
+
+    // flip puts the last row first, for 2D textures sampled with t going up; channels other
+    // than 0 keeps that many channels; 16-bit and float internal formats decode the files at
+    // that precision (see sourceType); files already requested are skipped
+    void request(const std::vector<std::string>& paths, bool flip, int channels = 0, GLenum internalFormat = 0) {
+        for (unsigned int i = 0; i < paths.size(); i++) {
+            if (entries.count(paths[i]))
+                continue;
+            Entry* entry = new Entry();
+            entry->image.path = paths[i];
+            entry->image.internalFormat = internalFormat;
+            entries[paths[i]].reset(entry);
+            order.push_back(entry);
+            pool->submit([this, entry, flip, channels] { decode(entry, flip, channels); });
+        }
+    }
+
+    void request(const std::string& path, bool flip, int channels = 0) {
+        request(std::vector<std::string>{ path }, flip, channels);
+    }
+
+    // maps the texture's container, converting the files first when it is missing or stale;
+    // the files are decoded as usual when there is no container or it can't be written
+    void request(const TextureFiles& files) {
+        if (!files.container.empty() && !containers.count(files.paths[0])) {
+            std::unique_ptr<TextureContainer> container(new TextureContainer(files.container));
+            if (!container->load(files.paths, files.flip, files.mipmaps, files.internalFormat)) {
+                container.reset(new TextureContainer(files.container));
+                if (!convert(files, pool) || !container->load(files.paths, files.flip, files.mipmaps, files.internalFormat))
+                    container.reset();
+            }
+            if (container) {
+                containers[files.paths[0]] = std::move(container);
+                return;
+            }
+        }
+        request(files.paths, files.flip, singleChannel(files.internalFormat) ? 1 : 0, files.internalFormat);
+    }
+
+    // on the GL thread: waits until the file is decoded, calls upload with its pixels and frees them
+    void upload(const std::string& path, const std::function<void(const DecodedImage&)>& upload) {
+        auto it = entries.find(path);
+        if (it == entries.end()) {
+            request(path, false);
+            it = entries.find(path);
+        }
+        Entry& entry = *it->second;
+        auto start = std::chrono::high_resolution_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            decodedCondition.wait(lock, [&entry] { return entry.decoded; });
+        }
+        auto decoded = std::chrono::high_resolution_clock::now();
+        upload(entry.image);
+        auto end = std::chrono::high_resolution_clock::now();
+        entry.waitTime = std::chrono::duration<double, std::milli>(decoded - start).count();
+        entry.uploadTime = std::chrono::duration<double, std::milli>(end - decoded).count();
+        entry.uploaded = true;
+        stbi_image_free(entry.image.data);
+        entry.image.data = nullptr;
+    }
+
+    // containers uploadContainer() gets to go through streamer from then on, null to upload them whole
+    void streamContainers(TextureStreamer* streamer) {
+        this->streamer = streamer;
+    }
+
+    // on the GL thread: uploads every face and level of the container request() mapped for the
+    // texture whose first file is path into texture, null when there is none and the files have
+    // to go through upload(); with a streamer only the coarse levels are in when it returns.
+    // texture has to be bound to target on the active unit unless GLState has direct state access;
+    // fullChain as for TextureContainer::upload.
+    const TextureContainer* uploadContainer(const std::string& path, GLenum target, unsigned int texture, bool fullChain = false) {
+        auto it = containers.find(path);
+        if (it == containers.end())
+            return nullptr;
+        const TextureContainer& container = *it->second;
+        auto start = std::chrono::high_resolution_clock::now();
+        if (streamer && streamer->available() && (container.header.format != 0 || TextureContainer::formatSupported(container.header.internalFormat)))
+            streamer->stream(container, target, texture, fullChain);
+        else
+            container.upload(target, GLState::get().directStateAccess ? texture : 0, fullChain);
+        auto end = std::chrono::high_resolution_clock::now();
+        Entry* entry = new Entry();
+        entry->image.path = container.path;
+        entry->image.width = container.header.width;
+        entry->image.height = container.header.height;
+        entry->image.channels = container.header.channels;
+        entry->image.type = container.header.format == 0 ? GL_UNSIGNED_BYTE : container.header.type;
+        entry->image.internalFormat = container.header.internalFormat;
+        entry->decoded = entry->uploaded = true;
+        entry->uploadTime = std::chrono::duration<double, std::milli>(end - start).count();
+        entries[container.path].reset(entry);
+        order.push_back(entry);
+        return &container;
+    }
+
+    // on the GL thread: upload() for the six faces of the cube map bound to the active unit,
+    // uploadFace gets face i the way upload's callback does; for CPU_CUBE_MIPMAPS the rest of
+    // the mip chain is built from the decoded faces and uploaded after them
+    void uploadCubeMap(const std::vector<std::string>& paths, CubeMipmapMode mipmaps, const std::function<void(int, const DecodedImage&)>& uploadFace) {
+        std::vector<std::vector<std::vector<unsigned char>>> levels(1, std::vector<std::vector<unsigned char>>(paths.size()));
+        bool complete = paths.size() == 6;
+        int size = 0, channels = 0;
+        GLenum type = GL_UNSIGNED_BYTE;
+        for (unsigned int i = 0; i < paths.size(); i++) {
+            upload(paths[i], [&](const DecodedImage& image) {
+                uploadFace(i, image);
+                if (mipmaps != CPU_CUBE_MIPMAPS)
+                    return;
+                if (!image.data || image.width != image.height || (i > 0 && (image.width != size || image.channels != channels))) {
+                    complete = false;
+                    return;
+                }
+                size = image.width;
+                channels = image.channels;
+                type = image.type;
+                levels[0][i].assign(image.data, image.data + (size_t)size * size * channels * image.bytesPerChannel());
+            });
+        }
+        if (mipmaps != CPU_CUBE_MIPMAPS || !complete)
+            return;
+        auto start = std::chrono::high_resolution_clock::now();
+        CubeMipmaps::build(levels, size, channels, type, pool);
+        // the levels go in with the internal format uploadFace picked for level 0
+        GLint internalFormat = GL_RGB;
+        glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+        CubeMipmaps::upload(levels, size, internalFormat, channels == 1 ? GL_RED : (channels == 4 ? GL_RGBA : GL_RGB), type);
+        auto end = std::chrono::high_resolution_clock::now();
+        mipmapTime += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // decodes the files on the pool, builds the mip chain and writes the container
+    static bool convert(const TextureFiles& files, ThreadPool* pool) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned int i = 0; i < files.paths.size(); i++) {
+            struct stat info;
+            if (stat(files.paths[i].c_str(), &info) != 0) {
+                std::cout << "Texture container " << files.container << " not written, " << files.paths[i] << " is missing" << std::endl;
+                return false;
+            }
+        }
+        int faces = (int)files.paths.size();
+        bool compressed = BlockCompression::isCompressed(files.internalFormat);
+        int channels = compressed ? BlockCompression::channels(files.internalFormat) : (singleChannel(files.internalFormat) ? 1 : (files.internalFormat == GL_RGBA ? 4 : 3));
+        std::vector<DecodedImage> images(faces);
+        // levels[l][f], level 0 first
+        std::vector<std::vector<std::vector<unsigned char>>> levels(1, std::vector<std::vector<unsigned char>>(faces));
+        std::vector<std::vector<std::vector<unsigned char>>> mips(faces);
+        pool->parallelFor(faces, [&](int face) {
+            DecodedImage& image = images[face];
+            image.path = files.paths[face];
+            image.internalFormat = files.internalFormat;
+            // keeps the channels the internal format uses
+            decode(image, files.flip, channels, pool);
+            if (!image.data)
+                return;
+            std::vector<unsigned char>& level0 = levels[0][face];
+            level0.assign(image.data, image.data + (size_t)image.width * image.height * channels * image.bytesPerChannel());
+            stbi_image_free(image.data);
+            int width = image.width, height = image.height;
+            const std::vector<unsigned char>* previous = &level0;
+            // the faces of a cube map are filtered together once they are all decoded
+            while (files.mipmaps && faces == 1 && (width > 1 || height > 1)) {
+                mips[face].push_back(TextureContainer::downsample(previous->data(), width, height, channels, image.type));
+                previous = &mips[face].back();
+                width = width > 1 ? width / 2 : 1;
+                height = height > 1 ? height / 2 : 1;
+            }
+        });
+        for (int face = 0; face < faces; face++) {
+            if (levels[0][face].empty() || images[face].width != images[0].width || images[face].height != images[0].height) {
+                std::cout << "Texture container " << files.container << " not written, " << files.paths[face] << " failed to load" << std::endl;
+                return false;
+            }
+        }
+        for (size_t l = 0; l < mips[0].size(); l++) {
+            levels.push_back(std::vector<std::vector<unsigned char>>(faces));
+            for (int face = 0; face < faces; face++)
+                levels.back()[face].swap(mips[face][l]);
+        }
+        if (files.mipmaps && faces == 6 && images[0].width == images[0].height)
+            CubeMipmaps::build(levels, images[0].width, channels, images[0].type, pool);
+
+        // block compress every level, the blocks of a level spread over the pool
+        size_t rawBytes = 0, storedBytes = 0;
+        double psnr = 0.0;
+        for (size_t l = 0; l < levels.size(); l++) {
+            int width = images[0].width >> l > 0 ? images[0].width >> l : 1;
+            int height = images[0].height >> l > 0 ? images[0].height >> l : 1;
+            for (int face = 0; face < faces; face++) {
+                std::vector<unsigned char>& level = levels[l][face];
+                rawBytes += level.size();
+                if (compressed) {
+                    std::vector<unsigned char> blocks = BlockCompression::compress(level.data(), width, height, files.internalFormat, pool);
+                    if (l == 0) {
+                        std::vector<unsigned char> decoded = BlockCompression::decompress(blocks.data(), width, height, files.internalFormat);
+                        psnr += BlockCompression::psnr(level.data(), decoded.data(), level.size()) / faces;
+                    }
+                    level.swap(blocks);
+                }
+                storedBytes += level.size();
+            }
+        }
+
+        TextureContainerHeader header;
+        memset(&header, 0, sizeof(header));
+        header.internalFormat = files.internalFormat;
+        header.format = compressed ? 0 : (channels == 1 ? GL_RED : (channels == 4 ? GL_RGBA : GL_RGB));
+        header.type = compressed ? 0 : images[0].type;
+        header.channels = channels;
+        header.width = images[0].width;
+        header.height = images[0].height;
+        header.faces = faces;
+        header.flipped = files.flip;
+        header.sourceStamp = TextureContainer::sourceStamp(files.paths);
+        bool stored = TextureContainer::store(files.container, header, levels);
+        auto end = std::chrono::high_resolution_clock::now();
+        if (stored) {
+            std::cout << "Texture container " << files.container << " converted in " << std::chrono::duration<double, std::milli>(end - start).count()
+                << " ms, " << levels.size() << " levels";
+            if (compressed)
+                std::cout << ", " << BlockCompression::name(files.internalFormat) << " " << storedBytes << " bytes against " << rawBytes
+                    << " uncompressed (" << (double)rawBytes / storedBytes << ":1), level 0 PSNR " << psnr << " dB";
+            std::cout << std::endl;
+        }
+        return stored;
+    }
+
+    // formats that keep one channel of the grey maps
+    static bool singleChannel(GLenum internalFormat) {
+        return internalFormat == GL_RED || internalFormat == GL_R8 || internalFormat == GL_COMPRESSED_RED_RGTC1
+            || internalFormat == GL_R16 || internalFormat == GL_R16F || internalFormat == GL_R32F;
+    }
+
+    // channel type the files of a texture are decoded to: 16 bits for GL_R16, float for the
+    // float formats when the file is float (.hdr), 16 bits otherwise, which GL converts to float
+    static GLenum sourceType(GLenum internalFormat) {
+        if (internalFormat == GL_R16F || internalFormat == GL_R32F)
+            return GL_FLOAT;
+        return internalFormat == GL_R16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    }
+
+    // per file: decode time on its worker, time the GL thread waited for it and upload time
+    void report() const {
+        double decodeTotal = 0.0, waitTotal = 0.0, uploadTotal = 0.0;
+        std::cout << "Image loading on " << pool->size() << " threads, .gtex containers mapped instead of decoded:" << std::endl;
+        std::cout << std::left << std::setw(24) << "  file" << std::right << std::setw(12) << "size"
+            << std::setw(12) << "decode ms" << std::setw(12) << "wait ms" << std::setw(12) << "upload ms" << std::endl;
+        for (unsigned int i = 0; i < order.size(); i++) {
+            const Entry& entry = *order[i];
+            if (!entry.uploaded)
+                continue;
+            std::string size = std::to_string(entry.image.width) + "x" + std::to_string(entry.image.height);
+            std::cout << "  " << std::left << std::setw(22) << entry.image.path << std::right << std::setw(12) << (entry.failed ? "failed" : size)
+                << std::fixed << std::setprecision(2) << std::setw(12) << entry.decodeTime << std::setw(12) << entry.waitTime
+                << std::setw(12) << entry.uploadTime << std::defaultfloat << std::endl;
+            decodeTotal += entry.decodeTime;
+            waitTotal += entry.waitTime;
+            uploadTotal += entry.uploadTime;
+        }
+        double wall = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - created).count();
+        std::cout << std::fixed << std::setprecision(2) << "  decode " << decodeTotal << " ms summed over workers, GL thread waited "
+            << waitTotal << " ms and uploaded for " << uploadTotal << " ms, " << wall << " ms since the first request" << std::defaultfloat << std::endl;
+        if (mipmapTime > 0.0)
+            std::cout << std::fixed << std::setprecision(2) << "  cube map mip chains built and uploaded in " << mipmapTime << " ms" << std::defaultfloat << std::endl;
+    }
+
+private:
+    struct Entry {
+        DecodedImage image = DecodedImage();
+        bool decoded = false;
+        bool failed = false;
+        bool uploaded = false;
+        double decodeTime = 0.0, waitTime = 0.0, uploadTime = 0.0;
+    };
+
+    ThreadPool* pool;
+    TextureStreamer* streamer;
+    std::chrono::high_resolution_clock::time_point created;
+    double mipmapTime;
+    std::map<std::string, std::unique_ptr<Entry>> entries;
+    std::vector<const Entry*> order;
+    std::mutex mutex;
+    std::condition_variable decodedCondition;
+
+    std::map<std::string, std::unique_ptr<TextureContainer>> containers;
+
+    // on a worker
+    void decode(Entry* entry, bool flip, int channels) {
+        auto start = std::chrono::high_resolution_clock::now();
+        decode(entry->image, flip, channels, pool);
+        auto end = std::chrono::high_resolution_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        entry->failed = entry->image.data == nullptr;
+        entry->decodeTime = std::chrono::duration<double, std::milli>(end - start).count();
+        entry->decoded = true;
+        decodedCondition.notify_all();
+    }
+
+    // Decodes at the precision of image.internalFormat. The flip (stbi_set_flip_vertically_on_load
+    // is global) and keeping another number of channels than the file has are done in row
+    // stripes spread over the pool: a flip alone swaps the row pairs in place, with a row per
+    // stripe to spare, and only a channel conversion writes a second image, in one pass that
+    // flips along the way.
+    static void decode(DecodedImage& image, bool flip, int channels, ThreadPool* pool) {
+        const char* path = image.path.c_str();
+        int fileChannels = 0;
+        void* decoded;
+        GLenum type = sourceType(image.internalFormat);
+        if (type == GL_FLOAT && stbi_is_hdr(path)) {
+            decoded = stbi_loadf(path, &image.width, &image.height, &fileChannels, 0);
+            image.type = GL_FLOAT;
+        }
+        else if (type != GL_UNSIGNED_BYTE) {
+            decoded = stbi_load_16(path, &image.width, &image.height, &fileChannels, 0);
+            image.type = GL_UNSIGNED_SHORT;
+        }
+        else {
+            decoded = stbi_load(path, &image.width, &image.height, &fileChannels, 0);
+            image.type = GL_UNSIGNED_BYTE;
+        }
+        image.data = (unsigned char*)decoded;
+        image.channels = channels != 0 ? channels : fileChannels;
+        if (!decoded || (!flip && image.channels == fileChannels))
+            return;
+
+        const int stripeRows = 64;
+        size_t channelBytes = image.bytesPerChannel();
+        size_t rowBytes = (size_t)image.width * image.channels * channelBytes;
+        size_t fileRowBytes = (size_t)image.width * fileChannels * channelBytes;
+        if (image.channels == fileChannels) {
+            // row y trades places with row height - 1 - y, the middle row of an odd height stays
+            int pairs = image.height / 2;
+            pool->parallelFor((pairs + stripeRows - 1) / stripeRows, [&](int stripe) {
+                std::vector<unsigned char> row(rowBytes);
+                int end = (stripe + 1) * stripeRows < pairs ? (stripe + 1) * stripeRows : pairs;
+                for (int y = stripe * stripeRows; y < end; y++) {
+                    unsigned char* top = image.data + (size_t)y * rowBytes;
+                    unsigned char* bottom = image.data + (size_t)(image.height - 1 - y) * rowBytes;
+                    memcpy(row.data(), top, rowBytes);
+                    memcpy(top, bottom, rowBytes);
+                    memcpy(bottom, row.data(), rowBytes);
+                }
+            });
+            return;
+        }
+        // freed with stbi_image_free like the decoded images, which is free() unless STBI_FREE is changed
+        unsigned char* converted = (unsigned char*)malloc(rowBytes * image.height);
+        pool->parallelFor((image.height + stripeRows - 1) / stripeRows, [&](int stripe) {
+            int end = (stripe + 1) * stripeRows < image.height ? (stripe + 1) * stripeRows : image.height;
+            for (int y = stripe * stripeRows; y < end; y++) {
+                const unsigned char* source = (const unsigned char*)decoded + (flip ? image.height - 1 - y : y) * fileRowBytes;
+                unsigned char* destination = converted + y * rowBytes;
+                for (int x = 0; x < image.width; x++) {
+                    for (int c = 0; c < image.channels; c++) {
+                        // grey files fill the colour channels from their first one
+                        int from = fileChannels < 3 && c < 3 ? 0 : (c < fileChannels ? c : fileChannels - 1);
+                        memcpy(destination + ((size_t)x * image.channels + c) * channelBytes, source + ((size_t)x * fileChannels + from) * channelBytes, channelBytes);
+                    }
+                }
+            }
+        });
+        stbi_image_free(decoded);
+        image.data = converted;
+    }
+};
+#endif
@@ -8,14 +8,122 @@
 #include <glm/glm/gtc/type_ptr.hpp>
 #include "Shader.h"
 #include "Camera.h"
+#include "ThreadPool.h"
 #include "Cubesphere.h"
+#include "CubesphereLod.h"
+#include "TileCulling.h"
 #include "Skybox.h"
+#include "ImageLoader.h"
+#include "VirtualTexture.h"
+#include "FrameUniforms.h"
 #include <iostream>
+#include <memory>
 
 const int subdivision = 6;
 
 const int useCubeSphere = 0;
 
+// share the vertices on cube edges and corners between faces
+const MeshMapping meshMapping = SEPARATE_FACES;
+// reorder the index and vertex buffers for the post-transform vertex cache
+const int optimizeVertexCache = 1;
+// FLOAT_VERTICES (20 bytes), PACKED_VERTICES (8 bytes: octahedral direction + 16-bit uv)
+// or PROCEDURAL_VERTICES (no vertex buffer, one face of indices drawn once per face)
+// or DISPLACED_VERTICES (32 bytes, heightmap and normals baked on the CPU, no texture fetch per vertex)
+const VertexFormat vertexFormat = FLOAT_VERTICES;
+// keep the generated mesh in a .meshcache file next to the executable and map it on later launches
+const int useMeshCache = 1;
+// keep the linked shader programs in .program files, keyed by their sources and the driver, and
+// load those binaries instead of compiling on later launches
+const int useProgramCache = 1;
+
+// draw the globe as per-face quadtrees of patches picked by screen-space error instead of one mesh
+const int useLod = 0;
+// quads along the side of one patch, finest quadtree level and allowed quad size on screen
+const int lodPatchQuads = 16;
+const int lodMaxDepth = 8;
+const float lodMaxPixelError = 4.0f;
+
+// split the mesh into tilesPerSide^2 tiles per face and skip tiles outside the frustum or behind the horizon
+const int useCulling = 1;
+const int cullingTilesPerSide = 8;
+// print drawn and culled triangles once a second
+const int reportCulling = 0;
+// print the uniform name lookups of the last frame once a second, 0 while the render loop only
+// sets uniforms through locations resolved before it, and how often FrameData waited for the GPU
+const int reportUniformLookups = 0;
+// copies of the FrameData uniform block (camera and light) the frames rotate through
+const int frameDataSlots = 3;
+// print the GL state calls the render loop issued and those GLState filtered out once a second
+const int reportStateChanges = 0;
+// create the globe and skybox buffers and textures through GL 4.5 direct state access, with
+// immutable storage and without binding them to edit them; 0 keeps glGen* and bind-to-edit
+const int useDirectStateAccess = 1;
+
+// worker threads for startup work, 0 = one per hardware thread, 1 = everything on the render thread
+const int startupThreads = 0;
+// print serial vs threaded mesh generation time and mesh sizes before creating the window
+const int benchmarkMeshGeneration = 0;
+// print simulated ACMR/ATVR before and after vertex cache optimization for subdivisions 1..subdivision
+const int reportVertexCache = 0;
+// print the vertex stage time of the texture fetching shader.vs against displacedShader.vs
+const int benchmarkVertexShaders = 0;
+// print decode and upload time of every texture file once they are all loaded
+const int reportImageLoading = 0;
+// convert the texture files to .gtex containers with their mip chains on the first launch and map those afterwards
+const int useTextureContainers = 1;
+// store the containers block compressed: colorBlockFormat for the colour maps, BC4 for the grey height and specular maps
+const int compressTextures = 1;
+// GL_COMPRESSED_RGBA_BPTC_UNORM (BC7, 16 bytes a block) keeps about 8 dB more PSNR on earth.jpg than
+// GL_COMPRESSED_RGB_S3TC_DXT1_EXT (BC1, 8 bytes) and takes ten times as long to encode
+const GLenum colorBlockFormat = GL_COMPRESSED_RGBA_BPTC_UNORM;
+// upload only the levels of the containers up to streamPlaceholderSize texels a side before the
+// first frame and stream the finer ones in over the next frames through a persistently mapped ring
+const int streamTextures = 1;
+const int streamRingMB = 16;
+const int streamMBPerFrame = 8;
+const int streamPlaceholderSize = 256;
+// print what was streamed once the last level is in
+const int reportTextureStreaming = 0;
+// print the GPU bytes of every globe texture against storing it as GL_RGB
+const int reportTextureMemory = 0;
+// GL_R8 keeps 8 bits of the heightmap (BC4 when compressing); GL_R16 decodes 16-bit PNGs at full
+// precision, GL_R16F/GL_R32F take float .hdr heightmaps as they are
+const GLenum heightFormat = GL_R8;
+// 2D heightmap file, the cube map faces are heightMap-px.png and so on
+const char* const heightMapFile = "heightMap.png";
+// mip chains of the globe and skybox cube maps: NO_CUBE_MIPMAPS (level 0 only), CPU_CUBE_MIPMAPS
+// (filtered across face edges on the thread pool, baked into the containers) or GL_CUBE_MIPMAPS (glGenerateMipmap)
+const CubeMipmapMode cubeMipmaps = CPU_CUBE_MIPMAPS;
+// print the CPU cube map mip chain build time against glGenerateMipmap on the earth cube map faces
+const int benchmarkCubeMipmaps = 0;
+// cube sphere only: reproject earth.jpg, the heightmap and specularMap.png into .tiles pyramids of
+// equal-angle cube faces on the first launch and use those instead of px.png ... nz.png,
+// heightMap-*.png and specularMap-*.png (uncompressed, whatever compressTextures says)
+const int useTilePyramids = 0;
+// texels along a face of level 0 and along a tile, powers of two
+const int tilePyramidFaceSize = 1024;
+const int tilePyramidTileSize = 128;
+// raster rows the generator reads at a time
+const int tilePyramidStripRows = 256;
+
+// 2D globe only: sample the earth imagery through a virtual texture, a page pyramid on disk built
+// from virtualTextureSource on the first launch, of which only the pages a feedback pass asks for
+// are kept in a page cache of virtualTextureCacheMB. The 2D earth texture isn't loaded then. A
+// binary PPM source is read a strip at a time, imagery too large to decode whole has to be one.
+const int useVirtualTexture = 0;
+const char* const virtualTextureSource = "earth.jpg";
+const char* const virtualTextureFile = "earth.vtex";
+// texels of a page without its 1 texel border, 128 with it
+const int virtualTexturePageSize = 126;
+const int virtualTextureCacheMB = 16;
+// the feedback pass renders at the window size divided by this
+const int virtualTextureFeedbackDivisor = 8;
+// pages copied into the cache per frame at most, more wait for the next frames
+const int maxPageUploadsPerFrame = 32;
+// print requested, resident and uploaded pages once a second
+const int reportVirtualTexture = 0;
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
@@ -42,10 +150,66 @@ glm::vec3 lightPos(3.0f, 0.5f, 1.5f);
 
 int main()
 {
+    ThreadPool threadPool(startupThreads);
+    if (benchmarkMeshGeneration) {
+        CubesphereMesh::benchmark(subdivision, &threadPool);
+        CubesphereMesh::memoryReport(subdivision, &threadPool);
+    }
+    if (reportVertexCache) {
+        CubesphereMesh::vertexCacheReport(subdivision, meshMapping, &threadPool);
+    }
+
+    // map the converted textures and start decoding the rest on the pool, the window, shaders and mesh are set up meanwhile
+    std::vector<std::string> textures_faces{ "px.png", "nx.png", "py.png", "ny.png", "pz.png", "nz.png" };
+    std::vector<std::string> height_faces{ "heightMap-px.png", "heightMap-nx.png", "heightMap-py.png", "heightMap-ny.png", "heightMap-pz.png", "heightMap-nz.png" };
+    std::vector<std::string> specular_faces{ "specularMap-px.png", "specularMap-nx.png", "specularMap-py.png", "specularMap-ny.png", "specularMap-pz.png", "specularMap-nz.png" };
+    std::vector<std::string> skybox_faces{ "skybox-px.png", "skybox-nx.png", "skybox-py.png", "skybox-ny.png", "skybox-pz.png", "skybox-nz.png" };
+    // the 2D maps have the first row at t = 0, both get mipmapped; cube map containers only bake the CPU chain
+    GLenum colorFormat = compressTextures ? colorBlockFormat : GL_RGB;
+    GLenum greyFormat = compressTextures ? GL_COMPRESSED_RED_RGTC1 : GL_R8;
+    GLenum heightMapFormat = heightFormat == GL_R8 ? greyFormat : heightFormat;
+    std::vector<TextureFiles> textureFiles;
+    // made from the 2D maps, which may be rasters too large to decode whole
+    TilePyramid earthTiles("earthCube.tiles"), heightTiles("heightMapCube.tiles"), specularTiles("specularMapCube.tiles");
+    bool tilePyramidsReady = false;
+    if (useCubeSphere && useTilePyramids) {
+        GLenum heightType = heightFormat == GL_R8 ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT;
+        struct { TilePyramid* tiles; const char* source; int channels; GLenum type; } pyramids[] = {
+            { &earthTiles, "earth.jpg", 3, GL_UNSIGNED_BYTE },
+            { &heightTiles, heightMapFile, 1, heightType },
+            { &specularTiles, "specularMap.png", 1, GL_UNSIGNED_BYTE },
+        };
+        tilePyramidsReady = true;
+        for (auto& pyramid : pyramids) {
+            if (!pyramid.tiles->load(pyramid.source, pyramid.channels, pyramid.type, tilePyramidFaceSize, tilePyramidTileSize)
+                && !(TilePyramid::generate(pyramid.tiles->path, pyramid.source, pyramid.channels, pyramid.type, tilePyramidFaceSize, tilePyramidTileSize, tilePyramidStripRows, &threadPool)
+                    && pyramid.tiles->load(pyramid.source, pyramid.channels, pyramid.type, tilePyramidFaceSize, tilePyramidTileSize)))
+                tilePyramidsReady = false;
+        }
+    }
+    // nothing to decode for the globe when its cube maps come from the tile pyramids
+    if (useCubeSphere && !tilePyramidsReady) {
+        textureFiles.push_back({ textures_faces, false, cubeMipmaps == CPU_CUBE_MIPMAPS, colorFormat, "earthCube.gtex" });
+        textureFiles.push_back({ height_faces, false, cubeMipmaps == CPU_CUBE_MIPMAPS, heightMapFormat, "heightMapCube.gtex" });
+        textureFiles.push_back({ specular_faces, false, cubeMipmaps == CPU_CUBE_MIPMAPS, greyFormat, "specularMapCube.gtex" });
+    }
+    else if (!useCubeSphere) {
+        textureFiles.push_back({ { "earth.jpg" }, true, true, colorFormat, "earth.gtex" });
+        textureFiles.push_back({ { heightMapFile }, true, true, heightMapFormat, "heightMap.gtex" });
+        textureFiles.push_back({ { "specularMap.png" }, true, true, greyFormat, "specularMap.gtex" });
+    }
+    textureFiles.push_back({ skybox_faces, false, cubeMipmaps == CPU_CUBE_MIPMAPS, colorFormat, "skybox.gtex" });
+    ImageLoader imageLoader(&threadPool);
+    for (unsigned int i = 0; i < textureFiles.size(); i++) {
+        if (!useTextureContainers)
+            textureFiles[i].container.clear();
+        imageLoader.request(textureFiles[i]);
+    }
+
     // glfw
     glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
     GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
@@ -67,53 +231,166 @@ int main()
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
-
-    glEnable(GL_DEPTH_TEST);
-
-    Shader cubesphereShader("Shader.vs", "Shader.fs");
-    Shader skyboxShader("skyboxShader.vs", "skyboxShader.fs");
-
-    Cubesphere cubesphere = Cubesphere(subdivision, &cubesphereShader, useCubeSphere);
+    GLState::get().loadExtensions((GLADloadproc)glfwGetProcAddress);
+
+    GLState::get().useDirectStateAccess(useDirectStateAccess);
+    GLState::get().enable(GL_DEPTH_TEST, true);
+    // filter across cube map face edges when sampling too, not only when building the mip chains
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    // units 6 and 7, after the globe's own maps
+    VirtualTexture virtualTexture(virtualTextureFile, 6, 7);
+    bool virtualTextureReady = false;
+    if (useVirtualTexture && !useCubeSphere) {
+        virtualTextureReady = virtualTexture.load(virtualTextureSource, true)
+            || (VirtualTexture::build(virtualTextureFile, virtualTextureSource, true, virtualTexturePageSize, 1, &threadPool) && virtualTexture.load(virtualTextureSource, true));
+        if (virtualTextureReady)
+            virtualTexture.createTextures((size_t)virtualTextureCacheMB << 20, SCR_WIDTH, SCR_HEIGHT, virtualTextureFeedbackDivisor);
+    }
+    float lastVirtualTextureReport = 0.0f;
+
+    MeshSettings meshSettings = { subdivision, meshMapping, optimizeVertexCache, vertexFormat, useCulling ? cullingTilesPerSide : 0 };
+    // 2D maps or cube maps, where they come from and the vertex format pick the variant, there are
+    // no branches on them in the shaders
+    ShaderVariants cubesphereShaders(useLod ? "lodShader.vs" : (vertexFormat == DISPLACED_VERTICES ? "displacedShader.vs" : "Shader.vs"), "Shader.fs", useProgramCache);
+    unsigned int earthFeatures = Cubesphere::shaderFeatures(meshSettings, useCubeSphere, tilePyramidsReady, virtualTextureReady);
+    Shader& cubesphereShader = cubesphereShaders.get(earthFeatures);
+    // the feedback pass of the virtual texture draws the globe with a variant of its own
+    Shader* feedbackShader = virtualTextureReady ? &cubesphereShaders.get(earthFeatures | SHADER_PAGE_FEEDBACK) : nullptr;
+    Shader skyboxShader("skyboxShader.vs", "skyboxShader.fs", useProgramCache);
+
+    // unit 15, out of the way of the ones the shaders sample
+    TextureStreamer textureStreamer(&threadPool, (size_t)streamRingMB << 20, (size_t)streamMBPerFrame << 20, streamPlaceholderSize, 15);
+    if (streamTextures)
+        imageLoader.streamContainers(&textureStreamer);
+
+    // camera and light for both programs, through the block at FrameUniforms::binding
+    FrameUniforms frameUniforms(frameDataSlots);
+
+    // the LOD patches replace the mesh, the globe's textures are still set up by the Cubesphere
+    Cubesphere cubesphere = Cubesphere(meshSettings, &cubesphereShader, &threadPool, useMeshCache, !useLod);
     int numberOfVertices = cubesphere.numberOfVerticesToDraw;
-    
-    std::vector<std::string> textures_faces{ "px.png", "nx.png", "py.png", "ny.png", "pz.png", "nz.png" };
-    std::vector<std::string> height_faces{ "heightMap-px.png", "heightMap-nx.png", "heightMap-py.png", "heightMap-ny.png", "heightMap-pz.png", "heightMap-nz.png" };
-    std::vector<std::string> specular_faces{ "specularMap-px.png", "specularMap-nx.png", "specularMap-py.png", "specularMap-ny.png", "specularMap-pz.png", "specularMap-nz.png" };
+    std::unique_ptr<CubesphereLod> lod;
+    if (useLod)
+        lod.reset(new CubesphereLod(&cubesphereShader, lodPatchQuads, lodMaxDepth, lodMaxPixelError));
+    if (virtualTextureReady) {
+        for (Shader* shader : { &cubesphereShader, feedbackShader }) {
+            shader->use();
+            virtualTexture.setUniforms(*shader);
+        }
+        // the patches set up their own program only
+        if (lod)
+            lod->setUniforms(*feedbackShader);
+    }
+    TileCulling tileCulling;
+    float lastCullingReport = 0.0f;
 
     if (useCubeSphere) {
-        cubesphere.initEarthTextureCubeMap(textures_faces);
-        cubesphere.initEarthHeightTextureCubeMap(height_faces);
-        cubesphere.initEarthSpecularTextureCubeMap(specular_faces);
+        cubesphere.initEarthTextureCubeMap(imageLoader, textures_faces, cubeMipmaps, tilePyramidsReady ? &earthTiles : nullptr);
+        cubesphere.initEarthHeightTextureCubeMap(imageLoader, height_faces, cubeMipmaps, tilePyramidsReady ? &heightTiles : nullptr, heightFormat);
+        cubesphere.initEarthSpecularTextureCubeMap(imageLoader, specular_faces, cubeMipmaps, tilePyramidsReady ? &specularTiles : nullptr);
     }
     else {
-        cubesphere.initEarthTexture2D();
-        cubesphere.initEarthHeightTexture();
-        cubesphere.initEarthSpecularTexture();
+        // the virtual texture has the imagery instead
+        if (!virtualTextureReady)
+            cubesphere.initEarthTexture2D(imageLoader);
+        cubesphere.initEarthHeightTexture(imageLoader, heightMapFile);
+        cubesphere.initEarthSpecularTexture(imageLoader);
+    }
+    if (reportTextureMemory)
+        cubesphere.textureMemoryReport();
+    if (benchmarkCubeMipmaps)
+        CubeMipmaps::benchmark(textures_faces, &threadPool);
+
+    if (vertexFormat == DISPLACED_VERTICES && !useLod)
+        numberOfVertices = cubesphere.bakeDisplacement(cubesphere.heightmap, &threadPool);
+
+    if (benchmarkVertexShaders) {
+        // the same mesh with the height fetched per vertex and baked in, fragments switched off
+        MeshSettings fetchSettings = meshSettings;
+        fetchSettings.format = FLOAT_VERTICES;
+        MeshSettings bakedSettings = meshSettings;
+        bakedSettings.format = DISPLACED_VERTICES;
+        Shader fetchShader("Shader.vs", "Shader.fs", useProgramCache, Cubesphere::shaderFeatures(fetchSettings, useCubeSphere, tilePyramidsReady));
+        Shader bakedShader("displacedShader.vs", "Shader.fs", useProgramCache, Cubesphere::shaderFeatures(bakedSettings, useCubeSphere, tilePyramidsReady));
+        Cubesphere fetchSphere(fetchSettings, &fetchShader, &threadPool, useMeshCache);
+        Cubesphere bakedSphere(bakedSettings, &bakedShader, &threadPool);
+        bakedSphere.bakeDisplacement(cubesphere.heightmap, &threadPool);
+
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        Shader* shaders[] = { &fetchShader, &bakedShader };
+        frameUniforms.data.projection = projection;
+        frameUniforms.data.view = camera.GetViewMatrix();
+        frameUniforms.update();
+        for (int k = 0; k < 2; k++) {
+            shaders[k]->use();
+            shaders[k]->setMat4("model", glm::mat4(1.0f));
+            shaders[k]->setMat3("normalMatrix", glm::mat3(1.0f));
+        }
+        fetchShader.use();
+        double fetchTime = fetchSphere.timeVertexShading(20);
+        bakedShader.use();
+        double bakedTime = bakedSphere.timeVertexShading(20);
+        std::cout << "Vertex stage, " << fetchSphere.numberOfVerticesToDraw / 3 << " triangles: height fetched per vertex "
+            << fetchTime << " ms, baked " << bakedTime << " ms per draw (" << fetchTime / bakedTime << "x)" << std::endl;
+
+        Cubesphere* spheres[] = { &fetchSphere, &bakedSphere };
+        for (int k = 0; k < 2; k++) {
+            glDeleteVertexArrays(1, &spheres[k]->VAO);
+            glDeleteBuffers(1, &spheres[k]->VBO);
+            glDeleteBuffers(1, &spheres[k]->EBO);
+        }
     }
     
     
   
 
     Skybox skybox = Skybox(&skyboxShader);
-    std::vector<std::string> skybox_faces{ "skybox-px.png", "skybox-nx.png", "skybox-py.png", "skybox-ny.png", "skybox-pz.png", "skybox-nz.png" };
-    skybox.initCubemapTexture(skybox_faces);
+    skybox.initCubemapTexture(imageLoader, skybox_faces, cubeMipmaps);
+    if (reportImageLoading)
+        imageLoader.report();
 
     //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
     // light properties
-    cubesphereShader.use();
-    cubesphereShader.setVec3("light.ambient", 0.2f, 0.2f, 0.2f);
-    cubesphereShader.setVec3("light.diffuse", 0.8f, 0.8f, 0.8f);
-    cubesphereShader.setVec3("light.specular", 0.4f, 0.4f, 0.4f);
-    cubesphereShader.setVec3("light.position", lightPos);
-    cubesphereShader.setFloat("light.constant", 1.0f);
-    cubesphereShader.setFloat("light.linear", 0.0014f);
-    cubesphereShader.setFloat("light.quadratic", 0.000007f);
-
+    FrameLight& light = frameUniforms.data.light;
+    light.ambient = glm::vec3(0.2f, 0.2f, 0.2f);
+    light.diffuse = glm::vec3(0.8f, 0.8f, 0.8f);
+    light.specular = glm::vec3(0.4f, 0.4f, 0.4f);
+    light.position = lightPos;
+    light.constant = 1.0f;
+    light.linear = 0.0014f;
+    light.quadratic = 0.000007f;
+
+
+    bool texturesStreamed = textureStreamer.idle();
+
+    // resolved once, so the render loop doesn't look names up
+    UniformLocation earthModel = cubesphereShader.location("model");
+    UniformLocation earthNormalMatrix = cubesphereShader.location("normalMatrix");
+    UniformLocation earthCameraModelPos = cubesphereShader.location("cameraModelPos");
+    UniformLocation feedbackModel = { -1 }, feedbackCameraModelPos = { -1 };
+    if (feedbackShader) {
+        feedbackModel = feedbackShader->location("model");
+        feedbackCameraModelPos = feedbackShader->location("cameraModelPos");
+    }
+    float lastUniformReport = 0.0f;
+    // the setup above binds and deletes behind GLState's back
+    GLState::get().invalidate();
+    float lastStateReport = 0.0f;
 
     // render loop
     while (!glfwWindowShouldClose(window))
     {
+        int frameLookups = Shader::lookups();
+        GLState::Stats frameState = GLState::get().stats;
+        textureStreamer.update();
+        if (!texturesStreamed && textureStreamer.idle()) {
+            texturesStreamed = true;
+            if (reportTextureStreaming)
+                textureStreamer.report();
+        }
+
         // time
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
@@ -125,48 +402,99 @@ int main()
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        cubesphereShader.use();
-
-        cubesphereShader.setVec3("viewPos", camera.Position);
-
         glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        cubesphereShader.setMat4("projection", projection);
-
         // camera/view transformation
         glm::mat4 view = camera.GetViewMatrix();
-        cubesphereShader.setMat4("view", view);
+        frameUniforms.data.projection = projection;
+        frameUniforms.data.view = view;
+        frameUniforms.data.skyboxView = glm::mat4(glm::mat3(view)); // remove translation from the view matrix
+        frameUniforms.data.viewPos = camera.Position;
+        frameUniforms.update();
+
+        cubesphereShader.use();
 
         // render Earth
-        glBindVertexArray(cubesphere.VAO);
+        GLState::get().bindVertexArray(cubesphere.VAO);
         glm::mat4 model = glm::mat4(1.0f);
         if (useCubeSphere) {
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, cubesphere.cubemapTexture);
-            model = glm::rotate(model, glm::radians(150.0f), glm::vec3(0.0f,1.0f,0.0f));
+            GLState::get().bindTextureUnit(1, GL_TEXTURE_CUBE_MAP, cubesphere.cubemapTexture);
+            // the hand-made faces are turned against the 2D maps, the tile pyramids are made from them
+            model = glm::rotate(model, glm::radians(tilePyramidsReady ? -60.0f : 150.0f), glm::vec3(0.0f,1.0f,0.0f));
         }
         else {
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, cubesphere.texture2D);
+            GLState::get().bindTextureUnit(0, GL_TEXTURE_2D, cubesphere.texture2D);
             model = glm::rotate(model, glm::radians(-60.0f), glm::vec3(0.0f, 1.0f, 0.0f));
         } 
         
-        cubesphereShader.setMat4("model", model);
-
-        glDrawElements(GL_TRIANGLES, numberOfVertices, GL_UNSIGNED_INT, 0);
+        cubesphereShader.setMat4(earthModel, model);
+        cubesphereShader.setMat3(earthNormalMatrix, glm::transpose(glm::inverse(glm::mat3(model))));
+
+        // the globe is a unit sphere in model space
+        glm::vec3 cameraModelPos = glm::vec3(glm::inverse(model) * glm::vec4(camera.Position, 1.0f));
+        // every face is wound clockwise seen from outside
+        GLState::get().enable(GL_CULL_FACE, true);
+        GLState::get().frontFace(GL_CW);
+        if (useLod) {
+            cubesphereShader.setVec3(earthCameraModelPos, cameraModelPos);
+            lod->select(cameraModelPos, glm::radians(camera.Zoom), (float)SCR_HEIGHT);
+        }
+        else if (useCulling && !cubesphere.tiles.empty() && vertexFormat != PROCEDURAL_VERTICES) {
+            tileCulling.cull(cubesphere.tiles, projection * view * model, cameraModelPos);
+            if (reportCulling && currentFrame - lastCullingReport >= 1.0f) {
+                lastCullingReport = currentFrame;
+                std::cout << "Culling: " << tileCulling.stats.drawnTriangles << " triangles drawn in " << tileCulling.stats.drawnTiles << " tiles ("
+                    << tileCulling.stats.drawCalls << " ranges), " << tileCulling.stats.culledTriangles() << " culled ("
+                    << tileCulling.stats.frustumCulledTriangles << " frustum, " << tileCulling.stats.horizonCulledTriangles << " horizon)" << std::endl;
+            }
+        }
+        auto drawEarth = [&]() {
+            if (useLod)
+                lod->draw();
+            else if (vertexFormat == PROCEDURAL_VERTICES)
+                glDrawElementsInstanced(GL_TRIANGLES, numberOfVertices, GL_UNSIGNED_INT, 0, CubesphereMesh::numOfFaces);
+            else if (useCulling && !cubesphere.tiles.empty())
+                tileCulling.draw();
+            else
+                glDrawElements(GL_TRIANGLES, numberOfVertices, GL_UNSIGNED_INT, 0);
+        };
+        if (virtualTextureReady) {
+            // pages this view needs, made resident before the globe is drawn with them
+            if (virtualTexture.beginFeedback()) {
+                feedbackShader->use();
+                feedbackShader->setMat4(feedbackModel, model);
+                if (useLod)
+                    feedbackShader->setVec3(feedbackCameraModelPos, cameraModelPos);
+                drawEarth();
+                virtualTexture.endFeedback();
+                cubesphereShader.use();
+            }
+            virtualTexture.update(maxPageUploadsPerFrame);
+            if (reportVirtualTexture && currentFrame - lastVirtualTextureReport >= 1.0f) {
+                lastVirtualTextureReport = currentFrame;
+                virtualTexture.report();
+            }
+        }
+        drawEarth();
+        GLState::get().enable(GL_CULL_FACE, false);
 
 
         // draw skybox
-        glDepthFunc(GL_LEQUAL);  // change depth function so depth test passes when cube's depth is 1.0 (like the depth buffer max)
+        GLState::get().depthFunc(GL_LEQUAL);  // change depth function so depth test passes when cube's depth is 1.0 (like the depth buffer max)
         skyboxShader.use();
-        view = glm::mat4(glm::mat3(camera.GetViewMatrix())); // remove translation from the view matrix
-        skyboxShader.setMat4("view", view);
-        skyboxShader.setMat4("projection", projection);
-        glBindVertexArray(skybox.VAO);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, skybox.textureID);
+        GLState::get().bindVertexArray(skybox.VAO);
+        GLState::get().bindTextureUnit(Skybox::unit, GL_TEXTURE_CUBE_MAP, skybox.textureID);
         glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
-        glDepthFunc(GL_LESS); // set depth function back to default
+        GLState::get().depthFunc(GL_LESS); // set depth function back to default
+
+        if (reportUniformLookups && currentFrame - lastUniformReport >= 1.0f) {
+            lastUniformReport = currentFrame;
+            std::cout << "Uniform lookups in the last frame: " << Shader::lookups() - frameLookups << std::endl;
+            frameUniforms.report();
+        }
+        if (reportStateChanges && currentFrame - lastStateReport >= 1.0f) {
+            lastStateReport = currentFrame;
+            GLState::get().report(frameState);
+        }
         
 
         // glfw: swap buffers and poll IO events
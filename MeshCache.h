@@ -0,0 +1,147 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include "CubesphereMesh.h"
+#include "MappedFile.h"
+
+// bump whenever CubesphereMesh output changes for the same settings
+const uint32_t MESH_CACHE_VERSION = 4;
+
+struct MeshCacheHeader {
+    char magic[4];              // "CSMC"
+    uint32_t version;
+    uint32_t subdivision;
+    uint32_t mapping;
+    uint32_t optimizeVertexCache;
+    uint32_t format;
+    uint32_t tilesPerSide;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t tileCount;
+    uint64_t vertexBytes;
+    uint64_t indexBytes;
+    uint64_t tileBytes;
+    uint64_t checksum;          // of everything after the header
+};
+
+// Generated vertex and index buffers on disk, one file per MeshSettings.
+// The file is memory mapped on load so the buffers can go straight to glBufferData.
+class MeshCache {
+public:
+    MeshSettings settings;
+    std::string path;
+
+    // after a successful load, point into the mapped file
+    const void* vertexData;
+    const unsigned int* indexData;
+    const MeshTile* tileData;
+    MeshCacheHeader header;
+
+    MeshCache(const MeshSettings& settings) : settings(settings), vertexData(nullptr), indexData(nullptr), tileData(nullptr), file(nullptr) {
+        const char* mappings[] = { "separate", "welded" };
+        const char* formats[] = { "float", "packed" };
+        path = "cubesphere_" + std::to_string(settings.subdivision) + "_" + mappings[settings.mapping] + "_"
+            + formats[settings.format] + (settings.optimizeVertexCache ? "_optimized" : "") + "_tiles" + std::to_string(settings.tilesPerSide) + ".meshcache";
+    }
+
+    ~MeshCache() {
+        delete file;
+    }
+
+    MeshCache(const MeshCache&) = delete;
+    MeshCache& operator=(const MeshCache&) = delete;
+
+    // false when the file is missing, from another version or settings, truncated or fails the checksum
+    bool load() {
+        file = new MappedFile(path);
+        if (!file->data || file->size < sizeof(MeshCacheHeader))
+            return false;
+        memcpy(&header, file->data, sizeof(header));
+        MeshCacheHeader expected = makeHeader(header.vertexCount, header.indexCount, header.tileCount);
+        if (memcmp(header.magic, expected.magic, 4) != 0 || header.version != expected.version
+            || header.subdivision != expected.subdivision || header.mapping != expected.mapping
+            || header.optimizeVertexCache != expected.optimizeVertexCache || header.format != expected.format
+            || header.tilesPerSide != expected.tilesPerSide || header.vertexBytes != expected.vertexBytes
+            || header.indexBytes != expected.indexBytes || header.tileBytes != expected.tileBytes
+            || file->size != sizeof(MeshCacheHeader) + header.vertexBytes + header.indexBytes + header.tileBytes) {
+            std::cout << "Mesh cache " << path << " is stale, regenerating" << std::endl;
+            return false;
+        }
+        const unsigned char* payload = file->data + sizeof(MeshCacheHeader);
+        if (checksum(payload, (size_t)(header.vertexBytes + header.indexBytes + header.tileBytes)) != header.checksum) {
+            std::cout << "Mesh cache " << path << " is corrupt, regenerating" << std::endl;
+            return false;
+        }
+        vertexData = payload;
+        indexData = (const unsigned int*)(payload + header.vertexBytes);
+        tileData = (const MeshTile*)(payload + header.vertexBytes + header.indexBytes);
+        return true;
+    }
+
+    // written to a temporary file first so a crash never leaves a half written cache behind
+    bool store(const void* vertices, uint32_t vertexCount, const unsigned int* indices, uint32_t indexCount, const MeshTile* tiles, uint32_t tileCount) {
+        MeshCacheHeader out = makeHeader(vertexCount, indexCount, tileCount);
+        uint64_t hash = checksum((const unsigned char*)vertices, (size_t)out.vertexBytes);
+        hash = checksum((const unsigned char*)indices, (size_t)out.indexBytes, hash);
+        out.checksum = checksum((const unsigned char*)tiles, (size_t)out.tileBytes, hash);
+
+        std::string temporaryPath = path + ".tmp";
+        std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+        stream.write((const char*)&out, sizeof(out));
+        stream.write((const char*)vertices, (std::streamsize)out.vertexBytes);
+        stream.write((const char*)indices, (std::streamsize)out.indexBytes);
+        stream.write((const char*)tiles, (std::streamsize)out.tileBytes);
+        stream.close();
+        if (!stream) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        // the old file may still be mapped by load()
+        delete file;
+        file = nullptr;
+        std::remove(path.c_str());
+        return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+
+    // FNV-1a over 64-bit words, bytes at the tail, continuing from a previous hash
+    static uint64_t checksum(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+        const uint64_t prime = 1099511628211ull;
+        size_t k = 0;
+        for (; k + 8 <= size; k += 8) {
+            uint64_t word;
+            memcpy(&word, data + k, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; k < size; k++)
+            hash = (hash ^ data[k]) * prime;
+        return hash;
+    }
+
+private:
+    MappedFile* file;
+
+    MeshCacheHeader makeHeader(uint32_t vertexCount, uint32_t indexCount, uint32_t tileCount) const {
+        MeshCacheHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "CSMC", 4);
+        h.version = MESH_CACHE_VERSION;
+        h.subdivision = settings.subdivision;
+        h.mapping = settings.mapping;
+        h.optimizeVertexCache = settings.optimizeVertexCache;
+        h.format = settings.format;
+        h.tilesPerSide = settings.tilesPerSide;
+        h.vertexCount = vertexCount;
+        h.indexCount = indexCount;
+        h.tileCount = tileCount;
+        h.vertexBytes = (uint64_t)vertexCount * (settings.format == PACKED_VERTICES ? sizeof(PackedVertex) : CubesphereMesh::floatsPerVertex * sizeof(float));
+        h.indexBytes = (uint64_t)indexCount * sizeof(unsigned int);
+        h.tileBytes = (uint64_t)tileCount * sizeof(MeshTile);
+        return h;
+    }
+};
+#endif
@@ -0,0 +1,132 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "GLState.h"
+
+// bump whenever the file layout changes
+const uint32_t PROGRAM_CACHE_VERSION = 2;
+
+struct ProgramCacheHeader {
+    char magic[4];              // "GPRB"
+    uint32_t version;
+    uint32_t binaryFormat;      // from glGetProgramBinary, handed back to glProgramBinary
+    uint32_t binaryBytes;
+    uint64_t key;               // of the driver strings and the source text
+    uint64_t checksum;          // of the binary
+};
+
+// Linked program binaries on disk, one file per pair of shader files and variant of their
+// defines, like the mesh cache has one per MeshSettings. The key in the header hashes
+// GL_VENDOR, GL_RENDERER and GL_VERSION along with the sources exactly as they are compiled,
+// so after a driver update or an edited shader the file misses, is relinked and overwritten;
+// a binary the driver rejects anyway (glProgramBinary leaves the program unlinked) does too.
+class ProgramCache {
+public:
+    uint64_t key;
+    std::string path;
+
+    // variant tells apart the programs the same files are compiled to, "" when there is one
+    ProgramCache(const char* vertexPath, const char* fragmentPath, const std::string& variant, const std::string& vertexCode, const std::string& fragmentCode) {
+        key = checksum((const unsigned char*)vertexCode.data(), vertexCode.size());
+        key = checksum((const unsigned char*)fragmentCode.data(), fragmentCode.size(), key);
+        const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        for (GLenum name : strings) {
+            const char* value = (const char*)glGetString(name);
+            if (value)
+                key = checksum((const unsigned char*)value, strlen(value) + 1, key);
+        }
+        std::ostringstream name;
+        name << fileName(vertexPath) << "_" << fileName(fragmentPath) << variant << ".program";
+        path = name.str();
+    }
+
+    // GL 4.1 or ARB_get_program_binary, and a driver that offers at least one binary format
+    static bool supported() {
+        if (!GLState::get().programBinary)
+            return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }
+
+    // false when there is no usable file or the driver doesn't take the binary, program is
+    // then still empty and can be compiled and linked as usual
+    bool load(unsigned int program) const {
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream)
+            return false;
+        ProgramCacheHeader header;
+        if (!stream.read((char*)&header, sizeof(header)) || memcmp(header.magic, "GPRB", 4) != 0
+            || header.version != PROGRAM_CACHE_VERSION || header.key != key) {
+            std::cout << "Program cache " << path << " is stale, relinking" << std::endl;
+            return false;
+        }
+        std::vector<char> binary(header.binaryBytes);
+        if (!stream.read(binary.data(), binary.size()) || checksum((const unsigned char*)binary.data(), binary.size()) != header.checksum) {
+            std::cout << "Program cache " << path << " is corrupt, relinking" << std::endl;
+            return false;
+        }
+        glProgramBinary(program, header.binaryFormat, binary.data(), (GLsizei)binary.size());
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked)
+            std::cout << "Program cache " << path << " was rejected by the driver, relinking" << std::endl;
+        return linked == GL_TRUE;
+    }
+
+    // written to a temporary file first, like the mesh cache
+    bool store(unsigned int program) const {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return false;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, &length, &format, binary.data());
+        ProgramCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GPRB", 4);
+        header.version = PROGRAM_CACHE_VERSION;
+        header.binaryFormat = format;
+        header.binaryBytes = (uint32_t)length;
+        header.key = key;
+        header.checksum = checksum((const unsigned char*)binary.data(), (size_t)length);
+
+        std::string temporaryPath = path + ".tmp";
+        std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+        stream.write((const char*)&header, sizeof(header));
+        stream.write(binary.data(), length);
+        stream.close();
+        if (!stream) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+
+    // FNV-1a, continuing from a previous hash
+    static uint64_t checksum(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+        for (size_t k = 0; k < size; k++)
+            hash = (hash ^ data[k]) * 1099511628211ull;
+        return hash;
+    }
+
+private:
+    // file name without directories, "shader.vs" stays as it is
+    static std::string fileName(const char* path) {
+        std::string name(path);
+        size_t slash = name.find_last_of("/\\");
+        return slash == std::string::npos ? name : name.substr(slash + 1);
+    }
+};
+#endif
@@ -0,0 +1,107 @@
+#ifndef RASTERROWS_H
+#define RASTERROWS_H
+
+#include <stb_image.h>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Rows of a raster in order, top first, converted to channels of T. A binary PPM or PGM (8 or
+// 16 bits) is read from the file as the rows are asked for, so it is never held whole; any
+// other format goes through stb_image, which can only decode it whole. Grey rasters fill all
+// the channels. TilePyramid::generate and VirtualTexture::build read their sources with it.
+template<class T>
+class RasterRows {
+public:
+    int width, height, channels;
+
+    RasterRows(const std::string& path, int channels) : width(0), height(0), channels(channels), fileChannels(0), maxValue(0), next(0), decoded(nullptr) {
+        stream.open(path, std::ios::binary);
+        char magic[2] = {};
+        stream.read(magic, 2);
+        if (stream && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+            fileChannels = magic[1] == '5' ? 1 : 3;
+            width = readNumber();
+            height = readNumber();
+            maxValue = readNumber();
+            // a single whitespace byte before the texels
+            stream.get();
+            if (!stream || width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 65535)
+                width = height = 0;
+            return;
+        }
+        stream.close();
+        int fileChannelsUnused;
+        if (sizeof(T) == 2)
+            decoded = stbi_load_16(path.c_str(), &width, &height, &fileChannelsUnused, channels);
+        else
+            decoded = stbi_load(path.c_str(), &width, &height, &fileChannelsUnused, channels);
+        if (!decoded)
+            width = height = 0;
+    }
+
+    ~RasterRows() {
+        if (decoded)
+            stbi_image_free(decoded);
+    }
+
+    // true when the whole raster is in memory anyway
+    bool decodedWhole() const {
+        return decoded != nullptr;
+    }
+
+    // the next count rows into rows, width * channels values each
+    bool read(T* rows, int count) {
+        size_t rowValues = (size_t)width * channels;
+        if (decoded) {
+            memcpy(rows, (const T*)decoded + (size_t)next * rowValues, count * rowValues * sizeof(T));
+            next += count;
+            return true;
+        }
+        int bytes = maxValue > 255 ? 2 : 1;
+        std::vector<unsigned char> line((size_t)width * fileChannels * bytes);
+        for (int y = 0; y < count; y++, next++) {
+            if (!stream.read((char*)line.data(), line.size()))
+                return false;
+            T* row = rows + y * rowValues;
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    const unsigned char* value = &line[((size_t)x * fileChannels + (c < fileChannels ? c : 0)) * bytes];
+                    // big endian when 16 bits, scaled to the range of T
+                    uint32_t v = bytes == 2 ? (uint32_t)value[0] << 8 | value[1] : value[0];
+                    uint32_t maxT = sizeof(T) == 2 ? 65535 : 255;
+                    row[(size_t)x * channels + c] = (T)((v * maxT + maxValue / 2) / maxValue);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    std::ifstream stream;
+    int fileChannels, maxValue, next;
+    void* decoded;
+
+    // next decimal in a PNM header, skipping whitespace and comments
+    int readNumber() {
+        int c = stream.get();
+        while (c == '#' || std::isspace(c)) {
+            if (c == '#') {
+                while (c != '\n' && c != EOF)
+                    c = stream.get();
+            }
+            c = stream.get();
+        }
+        int value = 0;
+        while (c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            c = stream.get();
+        }
+        stream.unget();
+        return value;
+    }
+};
+#endif
@@ -0,0 +1,41 @@
+#ifndef SAMPLERS_H
+#define SAMPLERS_H
+
+#include <glad/glad.h>
+#include "GLState.h"
+
+// how the globe and skybox textures are sampled
+enum SamplerKind {
+    SAMPLER_MAP_2D,                 // the 2D maps: s is longitude and wraps around, t is clamped, linear
+    SAMPLER_CUBE_MAP,               // clamped to the face edges, linear
+    SAMPLER_CUBE_MAP_TRILINEAR      // the same, and linear between the levels of the mip chain
+};
+
+// One sampler object per SamplerKind, made on first use. With direct state access the globe
+// and skybox textures carry no wrap or filter parameters of their own: the sampler bound to
+// their unit next to them has those. Without it the textures keep setting them themselves.
+class Samplers {
+public:
+    static GLuint get(SamplerKind kind) {
+        static GLuint samplers[3] = {};
+        if (samplers[kind])
+            return samplers[kind];
+        glCreateSamplers(1, &samplers[kind]);
+        GLuint sampler = samplers[kind];
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, kind == SAMPLER_MAP_2D ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, kind == SAMPLER_CUBE_MAP_TRILINEAR ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        return sampler;
+    }
+
+    // texture on unit for the shaders with the sampler of kind next to it when there is direct
+    // state access; otherwise the texture is bound there with its own parameters
+    static void bind(int unit, GLenum target, GLuint texture, SamplerKind kind) {
+        GLState::get().bindTextureUnit(unit, target, texture);
+        if (GLState::get().directStateAccess)
+            GLState::get().bindSampler(unit, get(kind));
+    }
+};
+#endif
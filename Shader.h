@@ -9,14 +9,58 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include "GLState.h"
+#include "ProgramCache.h"
+
+// FNV-1a of a uniform name; constexpr so names written as literals are hashed by the compiler
+constexpr uint32_t uniformHash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+// a uniform name by its hash, built from a string literal without allocating
+struct Uniform
+{
+    uint32_t hash;
+    template <size_t N>
+    constexpr Uniform(const char (&name)[N]) : hash(uniformHash(name)) {}
+};
+
+// a uniform resolved in one program with Shader::location(), for code that runs every frame
+struct UniformLocation
+{
+    GLint value;
+};
+
+// compile-time switches of the globe shaders, one #define each (see Shader::featureNames()), so a
+// program is built per combination instead of branching on uniforms
+enum ShaderFeature
+{
+    SHADER_CUBE_MAPS = 1,               // CUBE_MAPS: cube map textures instead of the 2D maps
+    SHADER_PACKED_VERTICES = 2,         // PACKED_VERTICES: octahedral encoded directions
+    SHADER_PROCEDURAL_VERTICES = 4,     // PROCEDURAL_VERTICES: vertices built from gl_VertexID
+    SHADER_EQUAL_ANGLE = 8,             // EQUAL_ANGLE: cube maps on the equal-angle grid of TilePyramid.h
+    SHADER_VIRTUAL_TEXTURE = 16,        // VIRTUAL_TEXTURE: 2D imagery from VirtualTexture.h instead of textureMap
+    SHADER_PAGE_FEEDBACK = 32           // PAGE_FEEDBACK: writes the virtual texture pages asked for, no shading
+};
 
 class Shader
 {
 public:
     unsigned int ID;
-    // constructor generates the shader on the fly
+    // constructor generates the shader on the fly,
+    // with useProgramCache the linked program is kept in a ProgramCache file for the next launch,
+    // features are ShaderFeature bits defined at the top of both sources (see featureNames())
     // ------------------------------------------------------------------------
-    Shader(const char* vertexPath, const char* fragmentPath)
+    Shader(const char* vertexPath, const char* fragmentPath, int useProgramCache = 0, unsigned int features = 0)
     {
         // 1. retrieve the vertex/fragment source code from filePath
         std::string vertexCode;
@@ -46,68 +90,221 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
         }
-        const char* vShaderCode = vertexCode.c_str();
-        const char* fShaderCode = fragmentCode.c_str();
-        // 2. compile shaders
-        unsigned int vertex, fragment;
-        // vertex shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
-        // fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
-        // shader Program
+        if (features)
+        {
+            vertexCode = injectDefines(vertexCode, features);
+            fragmentCode = injectDefines(fragmentCode, features);
+        }
+        auto start = std::chrono::high_resolution_clock::now();
         ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessary
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
+        // 2. take the binary an earlier launch linked from the same sources on the same driver
+        bool cached = useProgramCache && ProgramCache::supported();
+        ProgramCache cache(vertexPath, fragmentPath, featureNames(features, "_", ""), vertexCode, fragmentCode);
+        bool warm = cached && cache.load(ID);
+        bool stored = false;
+        if (!warm)
+        {
+            const char* vShaderCode = vertexCode.c_str();
+            const char* fShaderCode = fragmentCode.c_str();
+            // 3. compile shaders
+            unsigned int vertex, fragment;
+            // vertex shader
+            vertex = glCreateShader(GL_VERTEX_SHADER);
+            glShaderSource(vertex, 1, &vShaderCode, NULL);
+            glCompileShader(vertex);
+            checkCompileErrors(vertex, "VERTEX");
+            // fragment Shader
+            fragment = glCreateShader(GL_FRAGMENT_SHADER);
+            glShaderSource(fragment, 1, &fShaderCode, NULL);
+            glCompileShader(fragment);
+            checkCompileErrors(fragment, "FRAGMENT");
+            // shader Program
+            glAttachShader(ID, vertex);
+            glAttachShader(ID, fragment);
+            if (cached)
+                glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            glLinkProgram(ID);
+            checkCompileErrors(ID, "PROGRAM");
+            // delete the shaders as they're linked into our program now and no longer necessary
+            glDetachShader(ID, vertex);
+            glDetachShader(ID, fragment);
+            glDeleteShader(vertex);
+            glDeleteShader(fragment);
+            stored = cached && cache.store(ID);
+        }
+        introspectUniforms();
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Program " << vertexPath << " + " << fragmentPath << featureNames(features, " ", "") << (warm ? " loaded from its binary in " : " compiled and linked in ")
+            << std::chrono::duration<double, std::milli>(end - start).count() << " ms"
+            << (warm ? " (warm start)" : stored ? " (cold start, binary cached)" : "") << std::endl;
     }
     // activate the shader
     // ------------------------------------------------------------------------
     void use()
     {
-        glUseProgram(ID);
+        GLState::get().useProgram(ID);
+    }
+    // location of a uniform of this program, looked up in the table built after linking; -1
+    // when the program has no such active uniform, which glUniform* ignores
+    // ------------------------------------------------------------------------
+    UniformLocation location(Uniform name) const
+    {
+        lookupCount()++;
+        size_t mask = uniforms.size() - 1;
+        for (size_t i = name.hash & mask; uniforms[i].used; i = (i + 1) & mask) {
+            if (uniforms[i].hash == name.hash)
+                return UniformLocation{ uniforms[i].location };
+        }
+        return UniformLocation{ -1 };
+    }
+    // the names of the ShaderFeature bits of features, each after prefix and before suffix:
+    // "#define ", "\n" gives the lines injected into the sources
+    // ------------------------------------------------------------------------
+    static std::string featureNames(unsigned int features, const char* prefix, const char* suffix)
+    {
+        const char* names[] = { "CUBE_MAPS", "PACKED_VERTICES", "PROCEDURAL_VERTICES", "EQUAL_ANGLE", "VIRTUAL_TEXTURE", "PAGE_FEEDBACK" };
+        std::string text;
+        for (int bit = 0; bit < 6; bit++)
+        {
+            if (features & (1u << bit))
+                text += prefix + std::string(names[bit]) + suffix;
+        }
+        return text;
+    }
+    // table probes made through location() and the setters taking a Uniform, so a caller can
+    // check its per-frame path resolved everything beforehand
+    static int lookups()
+    {
+        return lookupCount();
+    }
+    // utility uniform functions, by name for setup code and by resolved location for every frame
+    // ------------------------------------------------------------------------
+    void setBool(Uniform name, bool value) const { setBool(location(name), value); }
+    void setBool(UniformLocation location, bool value) const
+    {
+        glUniform1i(location.value, (int)value);
+    }
+    // ------------------------------------------------------------------------
+    void setInt(Uniform name, int value) const { setInt(location(name), value); }
+    void setInt(UniformLocation location, int value) const
+    {
+        glUniform1i(location.value, value);
+    }
+    // ------------------------------------------------------------------------
+    void setFloat(Uniform name, float value) const { setFloat(location(name), value); }
+    void setFloat(UniformLocation location, float value) const
+    {
+        glUniform1f(location.value, value);
     }
-    // utility uniform functions
     // ------------------------------------------------------------------------
-    void setBool(const std::string& name, bool value) const
+    void setMat3(Uniform name, const glm::mat3& value) const { setMat3(location(name), value); }
+    void setMat3(UniformLocation location, const glm::mat3& value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        glUniformMatrix3fv(location.value, 1, GL_FALSE, glm::value_ptr(value));
     }
     // ------------------------------------------------------------------------
-    void setInt(const std::string& name, int value) const
+    void setMat4(Uniform name, const glm::mat4& value) const { setMat4(location(name), value); }
+    void setMat4(UniformLocation location, const glm::mat4& value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniformMatrix4fv(location.value, 1, GL_FALSE, glm::value_ptr(value));
     }
+
     // ------------------------------------------------------------------------
-    void setFloat(const std::string& name, float value) const
+    void setVec2(Uniform name, float x, float y) const { setVec2(location(name), x, y); }
+    void setVec2(UniformLocation location, float x, float y) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform2f(location.value, x, y);
     }
     // ------------------------------------------------------------------------
-    void setMat4(const std::string& name, glm::mat4 value) const
+    void setIntArray(Uniform name, const int* values, int count) const { setIntArray(location(name), values, count); }
+    void setIntArray(UniformLocation location, const int* values, int count) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(value));
+        glUniform1iv(location.value, count, values);
     }
 
-    void setVec3(const std::string& name, const glm::vec3& value) const
+    void setVec3(Uniform name, const glm::vec3& value) const { setVec3(location(name), value); }
+    void setVec3(UniformLocation location, const glm::vec3& value) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform3fv(location.value, 1, &value[0]);
     }
-    void setVec3(const std::string& name, float x, float y, float z) const
+    void setVec3(Uniform name, float x, float y, float z) const { setVec3(location(name), x, y, z); }
+    void setVec3(UniformLocation location, float x, float y, float z) const
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        glUniform3f(location.value, x, y, z);
     }
 
 private:
+    struct UniformSlot {
+        bool used;
+        uint32_t hash;
+        GLint location;
+    };
+    // open addressing on the name hash, a power of two of slots at most half full
+    std::vector<UniformSlot> uniforms;
+
+    // the defines go right after #version, the only thing allowed before them; #line keeps
+    // the line numbers of compile errors those of the file
+    static std::string injectDefines(const std::string& code, unsigned int features)
+    {
+        size_t version = code.find("#version");
+        if (version == std::string::npos)
+            return featureNames(features, "#define ", "\n") + code;
+        size_t end = code.find('\n', version);
+        if (end == std::string::npos)
+            return code;
+        int line = 2;
+        for (size_t k = 0; k < version; k++)
+            line += code[k] == '\n';
+        return code.substr(0, end + 1) + featureNames(features, "#define ", "\n") + "#line " + std::to_string(line) + "\n" + code.substr(end + 1);
+    }
+
+    static int& lookupCount()
+    {
+        static int count = 0;
+        return count;
+    }
+
+    // fills the table with every active uniform of the linked program; arrays are reported as
+    // "name[0]" and go in under "name" as well
+    void introspectUniforms()
+    {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        size_t slots = 16;
+        while (slots < 4 * (size_t)count)
+            slots *= 2;
+        uniforms.assign(slots, UniformSlot{ false, 0, -1 });
+        std::vector<char> name(maxLength + 1);
+        for (GLint i = 0; i < count; i++) {
+            GLsizei length = 0;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(ID, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+            // members of uniform blocks have no location
+            GLint location = glGetUniformLocation(ID, name.data());
+            if (location < 0)
+                continue;
+            addUniform(std::string(name.data(), length), location);
+            if (length > 3 && std::string(name.data() + length - 3) == "[0]")
+                addUniform(std::string(name.data(), length - 3), location);
+        }
+    }
+
+    void addUniform(const std::string& name, GLint location)
+    {
+        uint32_t hash = uniformHash(name.c_str());
+        size_t mask = uniforms.size() - 1;
+        size_t i = hash & mask;
+        for (; uniforms[i].used; i = (i + 1) & mask) {
+            if (uniforms[i].hash == hash) {
+                std::cout << "ERROR::SHADER::UNIFORM_HASH_COLLISION " << name << std::endl;
+                return;
+            }
+        }
+        uniforms[i] = UniformSlot{ true, hash, location };
+    }
+
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(unsigned int shader, std::string type)
@@ -134,5 +331,26 @@ private:
         }
     }
 };
-#endif
 
+// The programs of one pair of shader files by ShaderFeature bits, each compiled (or loaded from
+// the program cache) the first time it is asked for and kept from then on.
+class ShaderVariants
+{
+public:
+    ShaderVariants(const char* vertexPath, const char* fragmentPath, int useProgramCache = 0)
+        : vertexPath(vertexPath), fragmentPath(fragmentPath), useProgramCache(useProgramCache) {}
+
+    Shader& get(unsigned int features)
+    {
+        std::unique_ptr<Shader>& variant = variants[features];
+        if (!variant)
+            variant.reset(new Shader(vertexPath.c_str(), fragmentPath.c_str(), useProgramCache, features));
+        return *variant;
+    }
+
+private:
+    std::string vertexPath, fragmentPath;
+    int useProgramCache;
+    std::map<unsigned int, std::unique_ptr<Shader>> variants;
+};
+#endif
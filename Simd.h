@@ -0,0 +1,137 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin float pack wrappers so CPU kernels can be written once and compiled for
+// AVX2 (8 lanes), SSE2 (4 lanes) or plain scalar code. simd::FloatPack is the widest
+// one the compiler was told it may use (/arch:AVX2 or -mavx2 for the 8-wide one).
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2 1
+#define SIMD_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#endif
+
+namespace simd {
+
+// one lane, used as the fallback and for checking the vector versions
+struct FloatPack1 {
+    static const int width = 1;
+    float v;
+    FloatPack1() {}
+    FloatPack1(float f) : v(f) {}
+    static FloatPack1 load(const float* p) { return FloatPack1(*p); }
+    void store(float* p) const { *p = v; }
+};
+inline uint32_t simdBits(float f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+inline float simdFloat(uint32_t u) { float f; memcpy(&f, &u, 4); return f; }
+inline FloatPack1 operator+(FloatPack1 a, FloatPack1 b) { return a.v + b.v; }
+inline FloatPack1 operator-(FloatPack1 a, FloatPack1 b) { return a.v - b.v; }
+inline FloatPack1 operator*(FloatPack1 a, FloatPack1 b) { return a.v * b.v; }
+inline FloatPack1 operator/(FloatPack1 a, FloatPack1 b) { return a.v / b.v; }
+inline FloatPack1 operator&(FloatPack1 a, FloatPack1 b) { return simdFloat(simdBits(a.v) & simdBits(b.v)); }
+inline FloatPack1 operator|(FloatPack1 a, FloatPack1 b) { return simdFloat(simdBits(a.v) | simdBits(b.v)); }
+inline FloatPack1 operator^(FloatPack1 a, FloatPack1 b) { return simdFloat(simdBits(a.v) ^ simdBits(b.v)); }
+inline FloatPack1 andNot(FloatPack1 a, FloatPack1 b) { return simdFloat(~simdBits(a.v) & simdBits(b.v)); }
+inline FloatPack1 sqrt(FloatPack1 a) { return std::sqrt(a.v); }
+inline FloatPack1 min(FloatPack1 a, FloatPack1 b) { return b.v < a.v ? b.v : a.v; }
+inline FloatPack1 max(FloatPack1 a, FloatPack1 b) { return a.v < b.v ? b.v : a.v; }
+inline FloatPack1 lessThan(FloatPack1 a, FloatPack1 b) { return simdFloat(a.v < b.v ? 0xffffffffu : 0u); }
+inline FloatPack1 equal(FloatPack1 a, FloatPack1 b) { return simdFloat(a.v == b.v ? 0xffffffffu : 0u); }
+// all bits set in lanes whose sign bit is set (also for -0.0)
+inline FloatPack1 signMask(FloatPack1 a) { return simdFloat((simdBits(a.v) & 0x80000000u) ? 0xffffffffu : 0u); }
+
+#ifdef SIMD_SSE2
+struct FloatPack4 {
+    static const int width = 4;
+    __m128 v;
+    FloatPack4() {}
+    FloatPack4(__m128 m) : v(m) {}
+    FloatPack4(float f) : v(_mm_set1_ps(f)) {}
+    static FloatPack4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+inline FloatPack4 operator+(FloatPack4 a, FloatPack4 b) { return _mm_add_ps(a.v, b.v); }
+inline FloatPack4 operator-(FloatPack4 a, FloatPack4 b) { return _mm_sub_ps(a.v, b.v); }
+inline FloatPack4 operator*(FloatPack4 a, FloatPack4 b) { return _mm_mul_ps(a.v, b.v); }
+inline FloatPack4 operator/(FloatPack4 a, FloatPack4 b) { return _mm_div_ps(a.v, b.v); }
+inline FloatPack4 operator&(FloatPack4 a, FloatPack4 b) { return _mm_and_ps(a.v, b.v); }
+inline FloatPack4 operator|(FloatPack4 a, FloatPack4 b) { return _mm_or_ps(a.v, b.v); }
+inline FloatPack4 operator^(FloatPack4 a, FloatPack4 b) { return _mm_xor_ps(a.v, b.v); }
+inline FloatPack4 andNot(FloatPack4 a, FloatPack4 b) { return _mm_andnot_ps(a.v, b.v); }
+inline FloatPack4 sqrt(FloatPack4 a) { return _mm_sqrt_ps(a.v); }
+inline FloatPack4 min(FloatPack4 a, FloatPack4 b) { return _mm_min_ps(a.v, b.v); }
+inline FloatPack4 max(FloatPack4 a, FloatPack4 b) { return _mm_max_ps(a.v, b.v); }
+inline FloatPack4 lessThan(FloatPack4 a, FloatPack4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline FloatPack4 equal(FloatPack4 a, FloatPack4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline FloatPack4 signMask(FloatPack4 a) { return _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(a.v), 31)); }
+#endif
+
+#ifdef SIMD_AVX2
+struct FloatPack8 {
+    static const int width = 8;
+    __m256 v;
+    FloatPack8() {}
+    FloatPack8(__m256 m) : v(m) {}
+    FloatPack8(float f) : v(_mm256_set1_ps(f)) {}
+    static FloatPack8 load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+inline FloatPack8 operator+(FloatPack8 a, FloatPack8 b) { return _mm256_add_ps(a.v, b.v); }
+inline FloatPack8 operator-(FloatPack8 a, FloatPack8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline FloatPack8 operator*(FloatPack8 a, FloatPack8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline FloatPack8 operator/(FloatPack8 a, FloatPack8 b) { return _mm256_div_ps(a.v, b.v); }
+inline FloatPack8 operator&(FloatPack8 a, FloatPack8 b) { return _mm256_and_ps(a.v, b.v); }
+inline FloatPack8 operator|(FloatPack8 a, FloatPack8 b) { return _mm256_or_ps(a.v, b.v); }
+inline FloatPack8 operator^(FloatPack8 a, FloatPack8 b) { return _mm256_xor_ps(a.v, b.v); }
+inline FloatPack8 andNot(FloatPack8 a, FloatPack8 b) { return _mm256_andnot_ps(a.v, b.v); }
+inline FloatPack8 sqrt(FloatPack8 a) { return _mm256_sqrt_ps(a.v); }
+inline FloatPack8 min(FloatPack8 a, FloatPack8 b) { return _mm256_min_ps(a.v, b.v); }
+inline FloatPack8 max(FloatPack8 a, FloatPack8 b) { return _mm256_max_ps(a.v, b.v); }
+inline FloatPack8 lessThan(FloatPack8 a, FloatPack8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline FloatPack8 equal(FloatPack8 a, FloatPack8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline FloatPack8 signMask(FloatPack8 a) { return _mm256_castsi256_ps(_mm256_srai_epi32(_mm256_castps_si256(a.v), 31)); }
+#endif
+
+#if defined(SIMD_AVX2)
+typedef FloatPack8 FloatPack;
+#elif defined(SIMD_SSE2)
+typedef FloatPack4 FloatPack;
+#else
+typedef FloatPack1 FloatPack;
+#endif
+
+// operations written once on top of the wrappers above
+// ------------------------------------------------------------------------
+template<class P> inline P select(P mask, P a, P b) { return (mask & a) | andNot(mask, b); }
+template<class P> inline P negate(P a) { return P(-0.0f) ^ a; }
+template<class P> inline P abs(P a) { return andNot(P(-0.0f), a); }
+template<class P> inline P copySign(P magnitude, P sign) { return andNot(P(-0.0f), magnitude) | (P(-0.0f) & sign); }
+
+// atan2 with the same quadrant and signed zero rules as std::atan2, about 2 ulp
+// (Cephes atanf polynomial on [0, tan(pi/8)] after range reduction)
+template<class P> inline P atan2(P y, P x)
+{
+    const float pi = 3.14159265358979f;
+    P ax = abs(x);
+    P ay = abs(y);
+    P big = max(ax, ay);
+    P a = min(ax, ay) / select(equal(big, P(0.0f)), P(1.0f), big);
+    P reduce = lessThan(P(0.414213562373095f), a);
+    P t = select(reduce, (a - P(1.0f)) / (a + P(1.0f)), a);
+    P z = t * t;
+    P r = (((P(8.05374449538e-2f) * z - P(1.38776856032e-1f)) * z + P(1.99777106478e-1f)) * z - P(3.33329491539e-1f)) * z * t + t;
+    r = r + (reduce & P(pi / 4));
+    r = select(lessThan(ax, ay), P(pi / 2) - r, r);
+    r = select(signMask(x), P(pi) - r, r);
+    return copySign(r, y);
+}
+
+}
+#endif
@@ -52,10 +52,20 @@ public:
             1.0f, -1.0f, 1.0f
     } {
         this->shader = shader;
-        // skybox VAO
+        // skybox VAO, with immutable storage and set up by name when there is direct state access
+        if (GLState::get().directStateAccess) {
+            glCreateBuffers(1, &VBO);
+            glNamedBufferStorage(VBO, sizeof(skyboxVertices), &skyboxVertices, 0);
+            glCreateVertexArrays(1, &VAO);
+            glVertexArrayVertexBuffer(VAO, 0, VBO, 0, 3 * sizeof(float));
+            glVertexArrayAttribFormat(VAO, 0, 3, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribBinding(VAO, 0, 0);
+            glEnableVertexArrayAttrib(VAO, 0);
+            return;
+        }
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
-        glBindVertexArray(VAO);
+        GLState::get().bindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
         glEnableVertexAttribArray(0);
@@ -64,34 +74,52 @@ public:
         
 	}
 	float skyboxVertices[108];
-    void initCubemapTexture(std::vector<std::string> faces){
-        glGenTextures(1, &textureID);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+    // the unit of its own the skybox is sampled from, the sampler bound there is for cube maps
+    static const int unit = 8;
 
-        int width, height, nrChannels;
-        for (unsigned int i = 0; i < faces.size(); i++)
-        {
-            unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-            if (data)
-            {
-                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-                stbi_image_free(data);
-            }
-            else
-            {
-                std::cout << "Cubemap texture failed to load at path: " << faces[i] << std::endl;
-                stbi_image_free(data);
+    void initCubemapTexture(ImageLoader& loader, std::vector<std::string> faces, CubeMipmapMode mipmaps = NO_CUBE_MIPMAPS){
+        // with direct state access the container goes in by name and only the decoded faces
+        // get the texture bound; the sampler does the filtering
+        bool named = GLState::get().directStateAccess;
+        if (named) {
+            glCreateTextures(GL_TEXTURE_CUBE_MAP, 1, &textureID);
+        }
+        else {
+            glGenTextures(1, &textureID);
+            GLState::get().bindTexture(unit, GL_TEXTURE_CUBE_MAP, textureID);
+        }
+
+        // mapped when converted, otherwise decoded face by face
+        const TextureContainer* container = loader.uploadContainer(faces[0], GL_TEXTURE_CUBE_MAP, textureID, mipmaps == GL_CUBE_MIPMAPS);
+        bool trilinear;
+        if (named && container) {
+            trilinear = CubeMipmaps::finish(mipmaps, textureID, container->header.levels);
+        }
+        else {
+            GLState::get().bindTexture(unit, GL_TEXTURE_CUBE_MAP, textureID);
+            if (!container) {
+                loader.uploadCubeMap(faces, mipmaps, [&](int i, const DecodedImage& image) {
+                    if (image.data)
+                    {
+                        Cubesphere::uploadImage(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, image);
+                    }
+                    else
+                    {
+                        std::cout << "Cubemap texture failed to load at path: " << faces[i] << std::endl;
+                    }
+                });
             }
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            trilinear = CubeMipmaps::finish(mipmaps);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
         }
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        Samplers::bind(unit, GL_TEXTURE_CUBE_MAP, textureID, trilinear ? SAMPLER_CUBE_MAP_TRILINEAR : SAMPLER_CUBE_MAP);
 
         shader->use();
-        shader->setInt("skybox", 0);
+        shader->setInt("skybox", unit);
     }
 };
 
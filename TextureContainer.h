@@ -0,0 +1,350 @@
+#ifndef TEXTURECONTAINER_H
+#define TEXTURECONTAINER_H
+
+#include <glad/glad.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "BlockCompression.h"
+#include "GLState.h"
+#include "MappedFile.h"
+#include "MeshCache.h"
+
+// bump whenever the layout or the converter output changes
+const uint32_t TEXTURE_CONTAINER_VERSION = 1;
+const int TEXTURE_CONTAINER_MAX_LEVELS = 16;
+
+struct TextureContainerHeader {
+    char magic[4];              // "GTEX"
+    uint32_t version;
+    uint32_t internalFormat;    // for glTexImage2D or glCompressedTexImage2D
+    uint32_t format;            // pixel format and type of the levels, 0 when block compressed
+    uint32_t type;
+    uint32_t channels;          // bytes per texel of uncompressed levels, texel channels of compressed ones
+    uint32_t width, height;
+    uint32_t faces;             // 1 for a 2D texture, 6 for a cube map
+    uint32_t levels;
+    uint32_t flipped;           // rows bottom first, for the 2D maps
+    uint32_t reserved;
+    uint64_t sourceStamp;       // sourceStamp() of the files it was converted from
+    // level l of face f starts at levelOffsets[l] + f * levelBytes[l] from the start of the file
+    uint64_t levelOffsets[TEXTURE_CONTAINER_MAX_LEVELS];
+    uint64_t levelBytes[TEXTURE_CONTAINER_MAX_LEVELS];
+};
+
+// A texture with its whole mip chain in the layout glTexSubImage2D takes, converted once
+// from the image files (ImageLoader::convert) so later launches map the file and hand the
+// levels to GL without decoding anything. Levels are tightly packed rows, uploaded with
+// GL_UNPACK_ALIGNMENT 1.
+class TextureContainer {
+public:
+    TextureContainerHeader header;
+    std::string path;
+
+    TextureContainer(const std::string& path) : path(path), file(nullptr) {
+        memset(&header, 0, sizeof(header));
+    }
+
+    ~TextureContainer() {
+        delete file;
+    }
+
+    TextureContainer(const TextureContainer&) = delete;
+    TextureContainer& operator=(const TextureContainer&) = delete;
+
+    // false when the file is missing, from another version, truncated, converted with other
+    // options or older than one of its sources
+    bool load(const std::vector<std::string>& sources, bool flip, bool mipmaps, GLenum internalFormat) {
+        file = new MappedFile(path);
+        if (!file->data || file->size < sizeof(TextureContainerHeader))
+            return false;
+        memcpy(&header, file->data, sizeof(header));
+        if (memcmp(header.magic, "GTEX", 4) != 0 || header.version != TEXTURE_CONTAINER_VERSION
+            || header.faces != sources.size() || header.flipped != (uint32_t)flip || header.internalFormat != internalFormat
+            || header.levels == 0 || header.levels > TEXTURE_CONTAINER_MAX_LEVELS || header.sourceStamp != sourceStamp(sources)
+            || (mipmaps && header.width > 1 && header.levels == 1) || (!mipmaps && header.levels > 1)) {
+            std::cout << "Texture container " << path << " is stale, converting" << std::endl;
+            return false;
+        }
+        for (uint32_t level = 0; level < header.levels; level++) {
+            if (header.levelOffsets[level] + header.faces * header.levelBytes[level] > file->size) {
+                std::cout << "Texture container " << path << " is truncated, converting" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const unsigned char* level(int face, int level) const {
+        return file->data + header.levelOffsets[level] + face * header.levelBytes[level];
+    }
+
+    int levelWidth(int level) const {
+        return header.width >> level > 0 ? header.width >> level : 1;
+    }
+
+    int levelHeight(int level) const {
+        return header.height >> level > 0 ? header.height >> level : 1;
+    }
+
+    size_t dataBytes() const {
+        size_t bytes = 0;
+        for (uint32_t level = 0; level < header.levels; level++)
+            bytes += (size_t)(header.faces * header.levelBytes[level]);
+        return bytes;
+    }
+
+    // of the texels() of a level, block compressed levels decompress to bytes
+    int bytesPerChannel() const {
+        return header.type == GL_FLOAT ? 4 : (header.type == GL_UNSIGNED_SHORT ? 2 : 1);
+    }
+
+    // the texels of a level, decompressed when it is block compressed
+    std::vector<unsigned char> texels(int face, int level) const {
+        if (header.format == 0)
+            return BlockCompression::decompress(this->level(face, level), levelWidth(level), levelHeight(level), header.internalFormat);
+        const unsigned char* data = this->level(face, level);
+        return std::vector<unsigned char>(data, data + header.levelBytes[level]);
+    }
+
+    // target is GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP, bound to the active unit, or the texture
+    // of that target with direct state access; every level is allocated first, then filled
+    // straight from the mapping. Block compressed levels the driver can't take are decompressed
+    // here, single channel textures read as grey in .rgb. fullChain makes room in the immutable
+    // storage of texture for the levels glGenerateTextureMipmap adds to a container without them.
+    void upload(GLenum target, unsigned int texture = 0, bool fullChain = false) const {
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        bool decompress = header.format == 0 && !formatSupported(header.internalFormat);
+        if (decompress)
+            std::cout << "Texture container " << path << ": " << BlockCompression::name(header.internalFormat) << " not supported, uploading decompressed" << std::endl;
+        GLenum plainFormat = header.channels == 1 ? GL_RED : GL_RGB;
+        if (decompress && texture)
+            glTextureStorage2D(texture, storageLevels(fullChain), storageFormat(plainFormat), levelWidth(0), levelHeight(0));
+        else if (!decompress)
+            allocate(target, texture, fullChain);
+        for (uint32_t face = 0; face < header.faces; face++) {
+            GLenum faceTarget = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+            for (uint32_t l = 0; l < header.levels; l++) {
+                if (decompress) {
+                    std::vector<unsigned char> data = texels(face, l);
+                    if (texture && target == GL_TEXTURE_2D)
+                        glTextureSubImage2D(texture, l, 0, 0, levelWidth(l), levelHeight(l), plainFormat, GL_UNSIGNED_BYTE, data.data());
+                    else if (texture)
+                        glTextureSubImage3D(texture, l, 0, 0, face, levelWidth(l), levelHeight(l), 1, plainFormat, GL_UNSIGNED_BYTE, data.data());
+                    else
+                        glTexImage2D(faceTarget, l, plainFormat, levelWidth(l), levelHeight(l), 0, plainFormat, GL_UNSIGNED_BYTE, data.data());
+                }
+                else {
+                    subImage(faceTarget, l, 0, levelHeight(l), level(face, l), texture);
+                }
+            }
+        }
+        setLevelParameters(target, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    // every face and level of target, bound to the active unit, with undefined texels; given a
+    // texture the levels are its immutable storage instead, allocated in one call, with the
+    // levels down to 1x1 for fullChain
+    void allocate(GLenum target, unsigned int texture = 0, bool fullChain = false) const {
+        if (texture) {
+            glTextureStorage2D(texture, storageLevels(fullChain), storageFormat(header.internalFormat), levelWidth(0), levelHeight(0));
+            return;
+        }
+        for (uint32_t face = 0; face < header.faces; face++) {
+            GLenum faceTarget = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+            for (uint32_t l = 0; l < header.levels; l++) {
+                GLsizei width = levelWidth(l), height = levelHeight(l);
+                if (header.format == 0)
+                    glCompressedTexImage2D(faceTarget, l, header.internalFormat, width, height, 0, (GLsizei)header.levelBytes[l], NULL);
+                else
+                    glTexImage2D(faceTarget, l, header.internalFormat, width, height, 0, header.format, header.type, NULL);
+            }
+        }
+    }
+
+    // the grey swizzle and the level range of target, bound to the active unit, or of texture
+    void setLevelParameters(GLenum target, unsigned int texture = 0) const {
+        if (texture) {
+            if (header.channels == 1) {
+                glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_G, GL_RED);
+                glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_B, GL_RED);
+            }
+            glTextureParameteri(texture, GL_TEXTURE_BASE_LEVEL, 0);
+            glTextureParameteri(texture, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+            return;
+        }
+        if (header.channels == 1) {
+            glTexParameteri(target, GL_TEXTURE_SWIZZLE_G, GL_RED);
+            glTexParameteri(target, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        }
+        glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+    }
+
+    // texel rows of a level a row of data covers: 4 for block compressed levels, whose rows
+    // are rows of 4x4 blocks
+    int rowHeight() const {
+        return header.format == 0 ? 4 : 1;
+    }
+
+    size_t rowBytes(int level) const {
+        int rows = (levelHeight(level) + rowHeight() - 1) / rowHeight();
+        return (size_t)(header.levelBytes[level] / rows);
+    }
+
+    // texel rows [y, y + height) of a level, y a multiple of rowHeight(); data is client memory,
+    // or an offset into the bound GL_PIXEL_UNPACK_BUFFER, at the first of those rows. Given a
+    // texture they go to it by name, to the layer of the face faceTarget stands for of a cube map.
+    void subImage(GLenum faceTarget, int level, int y, int height, const void* data, unsigned int texture = 0) const {
+        GLsizei width = levelWidth(level);
+        GLsizei bytes = (GLsizei)((height + rowHeight() - 1) / rowHeight() * rowBytes(level));
+        if (texture && faceTarget == GL_TEXTURE_2D) {
+            if (header.format == 0)
+                glCompressedTextureSubImage2D(texture, level, 0, y, width, height, header.internalFormat, bytes, data);
+            else
+                glTextureSubImage2D(texture, level, 0, y, width, height, header.format, header.type, data);
+        }
+        else if (texture) {
+            GLint face = (GLint)(faceTarget - GL_TEXTURE_CUBE_MAP_POSITIVE_X);
+            if (header.format == 0)
+                glCompressedTextureSubImage3D(texture, level, 0, y, face, width, height, 1, header.internalFormat, bytes, data);
+            else
+                glTextureSubImage3D(texture, level, 0, y, face, width, height, 1, header.format, header.type, data);
+        }
+        else if (header.format == 0) {
+            glCompressedTexSubImage2D(faceTarget, level, 0, y, width, height, header.internalFormat, bytes, data);
+        }
+        else {
+            glTexSubImage2D(faceTarget, level, 0, y, width, height, header.format, header.type, data);
+        }
+    }
+
+    // levels[l][f] holds level l of face f, written to a temporary file first like MeshCache::store
+    static bool store(const std::string& path, TextureContainerHeader header, const std::vector<std::vector<std::vector<unsigned char>>>& levels) {
+        memcpy(header.magic, "GTEX", 4);
+        header.version = TEXTURE_CONTAINER_VERSION;
+        header.levels = (uint32_t)levels.size();
+        uint64_t offset = sizeof(TextureContainerHeader);
+        for (uint32_t l = 0; l < header.levels; l++) {
+            // levels start 16 byte aligned
+            offset = (offset + 15) & ~(uint64_t)15;
+            header.levelOffsets[l] = offset;
+            header.levelBytes[l] = levels[l][0].size();
+            offset += header.faces * header.levelBytes[l];
+        }
+
+        std::string temporaryPath = path + ".tmp";
+        std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+        stream.write((const char*)&header, sizeof(header));
+        uint64_t written = sizeof(header);
+        const char padding[16] = {};
+        for (uint32_t l = 0; l < header.levels; l++) {
+            stream.write(padding, (std::streamsize)(header.levelOffsets[l] - written));
+            for (uint32_t face = 0; face < header.faces; face++)
+                stream.write((const char*)levels[l][face].data(), (std::streamsize)header.levelBytes[l]);
+            written = header.levelOffsets[l] + header.faces * header.levelBytes[l];
+        }
+        stream.close();
+        if (!stream) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+
+    // next level of a tightly packed image with GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_FLOAT
+    // channels, 2x2 box filter; odd edges repeat their last texel
+    static std::vector<unsigned char> downsample(const unsigned char* source, int width, int height, int channels, GLenum type) {
+        if (type == GL_FLOAT)
+            return downsample<float>((const float*)source, width, height, channels);
+        if (type == GL_UNSIGNED_SHORT)
+            return downsample<uint16_t>((const uint16_t*)source, width, height, channels);
+        return downsample<unsigned char>(source, width, height, channels);
+    }
+
+    // size and modification time of every source, so an edited image gets converted again
+    static uint64_t sourceStamp(const std::vector<std::string>& sources) {
+        uint64_t hash = MeshCache::checksum((const unsigned char*)"", 0);
+        for (unsigned int i = 0; i < sources.size(); i++) {
+            struct stat info;
+            int64_t values[2] = { -1, -1 };
+            if (stat(sources[i].c_str(), &info) == 0) {
+                values[0] = (int64_t)info.st_size;
+                values[1] = (int64_t)info.st_mtime;
+            }
+            hash = MeshCache::checksum((const unsigned char*)sources[i].c_str(), sources[i].size(), hash);
+            hash = MeshCache::checksum((const unsigned char*)values, sizeof(values), hash);
+        }
+        return hash;
+    }
+
+    // levels of a full mip chain down to 1x1
+    static int chainLevels(int width, int height) {
+        int levels = 1;
+        while ((width > height ? width : height) >> levels > 0)
+            levels++;
+        return levels;
+    }
+
+    // glTextureStorage2D only takes sized formats, the unsized ones get the size drivers pick for them
+    static GLenum storageFormat(GLenum internalFormat) {
+        switch (internalFormat) {
+        case GL_RED: return GL_R8;
+        case GL_RGB: return GL_RGB8;
+        case GL_RGBA: return GL_RGBA8;
+        default: return internalFormat;
+        }
+    }
+
+    // RGTC is core, BPTC core since 4.2, S3TC an extension every desktop driver has in practice
+    static bool formatSupported(GLenum internalFormat) {
+        if (internalFormat == GL_COMPRESSED_RGBA_BPTC_UNORM)
+            return GLAD_GL_VERSION_4_2 || GLState::hasExtension("GL_ARB_texture_compression_bptc");
+        if (internalFormat != GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+            return true;
+        return GLState::hasExtension("GL_EXT_texture_compression_s3tc");
+    }
+
+private:
+    MappedFile* file;
+
+    int storageLevels(bool fullChain) const {
+        int levels = (int)header.levels;
+        int chain = chainLevels(header.width, header.height);
+        return fullChain && chain > levels ? chain : levels;
+    }
+
+    template<class T>
+    static std::vector<unsigned char> downsample(const T* source, int width, int height, int channels) {
+        int nextWidth = width > 1 ? width / 2 : 1;
+        int nextHeight = height > 1 ? height / 2 : 1;
+        // integer channels round to nearest
+        const float rounding = std::is_integral<T>::value ? 0.5f : 0.0f;
+        std::vector<unsigned char> next((size_t)nextWidth * nextHeight * channels * sizeof(T));
+        T* texels = (T*)next.data();
+        for (int y = 0; y < nextHeight; y++) {
+            const T* row0 = source + (size_t)(2 * y) * width * channels;
+            const T* row1 = source + (size_t)(2 * y + 1 < height ? 2 * y + 1 : 2 * y) * width * channels;
+            for (int x = 0; x < nextWidth; x++) {
+                int x0 = 2 * x * channels;
+                int x1 = (2 * x + 1 < width ? 2 * x + 1 : 2 * x) * channels;
+                for (int c = 0; c < channels; c++) {
+                    float sum = (float)row0[x0 + c] + (float)row0[x1 + c] + (float)row1[x0 + c] + (float)row1[x1 + c];
+                    texels[((size_t)y * nextWidth + x) * channels + c] = (T)(sum * 0.25f + rounding);
+                }
+            }
+        }
+        return next;
+    }
+};
+#endif
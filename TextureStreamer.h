@@ -0,0 +1,309 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include <glad/glad.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "GLState.h"
+#include "TextureContainer.h"
+#include "ThreadPool.h"
+
+// Uploads the levels of texture containers over the frames after startup instead of all at
+// once before the first one. Every texture gets its storage and its coarse levels (up to
+// placeholderSize texels a side) right away, with GL_TEXTURE_BASE_LEVEL on the finest of
+// them, so it can be drawn from the first frame; the finer levels are queued coarsest first
+// in chunks of rows. The chunks go through one buffer, persistently and coherently mapped,
+// used as a ring: a chunk gets the next free stretch of the ring, a worker of the pool copies
+// its rows from the container mapping into it (reading the file is the worker's page faults,
+// not the GL thread's), and update() issues the glTexSubImage2D of the chunks whose copy has
+// finished from the bound GL_PIXEL_UNPACK_BUFFER, then lowers the base level of textures
+// whose next level is complete. With GLState's direct state access all of that goes to the
+// textures by name, into immutable storage, and nothing gets bound on unit. A fence after
+// every batch tells when its stretch of the ring can be handed out again. The GL thread never
+// waits: chunks that aren't copied yet and ring space that is still being read wait for a
+// later frame.
+class TextureStreamer {
+public:
+    struct Stats {
+        size_t streamedBytes, placeholderBytes;
+        int chunks, batches, textures;
+        int ringFullFrames;         // frames that had chunks left but no ring space for them
+        int stagingFrames;          // frames whose first chunk was still being copied
+        int frames;                 // update() calls until everything was uploaded
+        double residentMs;          // from the first stream() until the last level was issued
+    } stats;
+
+    // textures are bound on unit while their levels go in without direct state access, so the
+    // units the shaders read stay as they are; bytesPerFrame limits the uploads update() issues at a time
+    TextureStreamer(ThreadPool* pool, size_t ringBytes, size_t bytesPerFrame, int placeholderSize, int unit) : pool(pool), ringBytes(ringBytes),
+        bytesPerFrame(bytesPerFrame), placeholderSize(placeholderSize), unit(unit), buffer(0), ring(nullptr), head(0), tail(0), used(0), outstanding(0) {
+        memset(&stats, 0, sizeof(stats));
+        // GL 4.4, or the extension on older contexts
+        if (!GLState::get().bufferStorage) {
+            std::cout << "Texture streaming needs GL_ARB_buffer_storage, uploading every level at startup" << std::endl;
+            return;
+        }
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ringBytes, NULL, flags);
+        ring = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ringBytes, flags);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!ring) {
+            std::cout << "Texture streaming ring of " << ringBytes << " bytes failed to map, uploading every level at startup" << std::endl;
+            glDeleteBuffers(1, &buffer);
+            buffer = 0;
+        }
+    }
+
+    ~TextureStreamer() {
+        // workers still copying write into the ring
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            copiedCondition.wait(lock, [this] { return outstanding == 0; });
+        }
+        for (Batch& batch : batches)
+            glDeleteSync(batch.fence);
+        if (buffer) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+        }
+    }
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+    bool available() const {
+        return ring != nullptr;
+    }
+
+    // everything queued has been issued
+    bool idle() const {
+        return queued.empty() && staging.empty();
+    }
+
+    // takes over the upload of container into texture, bound to target on the active unit the
+    // way TextureContainer::upload expects it unless there is direct state access; the
+    // container has to outlive the streaming; fullChain as for TextureContainer::upload
+    void stream(const TextureContainer& container, GLenum target, unsigned int texture, bool fullChain = false) {
+        auto now = std::chrono::high_resolution_clock::now();
+        if (stats.textures++ == 0)
+            started = now;
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        unsigned int named = GLState::get().directStateAccess ? texture : 0;
+        container.allocate(target, named, fullChain);
+        container.setLevelParameters(target, named);
+        std::shared_ptr<Texture> streamed(new Texture{ texture, named, target, &container, std::vector<int>(container.header.levels, 0) });
+        // the coarsest level always, so there is something to draw
+        int placeholder = (int)container.header.levels - 1;
+        while (placeholder > 0 && std::max(container.levelWidth(placeholder - 1), container.levelHeight(placeholder - 1)) <= placeholderSize)
+            placeholder--;
+        for (int l = (int)container.header.levels - 1; l >= 0; l--) {
+            int step = container.rowHeight();
+            int rows = (container.levelHeight(l) + step - 1) / step;
+            size_t rowBytes = container.rowBytes(l);
+            // a quarter of the ring at most per chunk, so a few are in flight at once
+            int rowsPerChunk = (int)std::max((size_t)1, ringBytes / 4 / rowBytes);
+            for (uint32_t face = 0; face < container.header.faces; face++) {
+                GLenum faceTarget = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+                if (l >= placeholder || !available()) {
+                    container.subImage(faceTarget, l, 0, container.levelHeight(l), container.level(face, l), named);
+                    stats.placeholderBytes += (size_t)container.header.levelBytes[l];
+                    continue;
+                }
+                for (int row = 0; row < rows; row += rowsPerChunk) {
+                    std::unique_ptr<Chunk> chunk(new Chunk());
+                    chunk->texture = streamed;
+                    chunk->faceTarget = faceTarget;
+                    chunk->level = l;
+                    chunk->y = row * step;
+                    chunk->height = std::min(rowsPerChunk * step, container.levelHeight(l) - chunk->y);
+                    chunk->source = container.level(face, l) + row * rowBytes;
+                    chunk->bytes = (size_t)std::min(rowsPerChunk, rows - row) * rowBytes;
+                    streamed->remainingChunks[l]++;
+                    queued.push_back(std::move(chunk));
+                }
+            }
+        }
+        if (available() && named)
+            glTextureParameteri(texture, GL_TEXTURE_BASE_LEVEL, placeholder);
+        else if (available())
+            glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, placeholder);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        if (idle())
+            finished(now);
+    }
+
+    // once a frame on the GL thread: hands ring space to queued chunks, issues the copied ones
+    // up to bytesPerFrame and recycles the ring behind signalled fences
+    void update() {
+        if (idle() && batches.empty())
+            return;
+        stats.frames += idle() ? 0 : 1;
+        // the stretches of the ring the GPU is done reading
+        while (!batches.empty()) {
+            GLenum status = glClientWaitSync(batches.front().fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(batches.front().fence);
+            tail = (tail + batches.front().bytes) % ringBytes;
+            used -= batches.front().bytes;
+            batches.pop_front();
+        }
+        stage();
+
+        size_t issuedBytes = 0, batchBytes = 0;
+        // by value, the last chunk of a texture takes it along when it is popped
+        unsigned int bound = 0;
+        GLenum boundTarget = GL_TEXTURE_2D;
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        // in ring order, so the ring is released in the order it was handed out
+        while (!staging.empty() && issuedBytes < bytesPerFrame) {
+            Chunk& chunk = *staging.front();
+            if (!chunk.copied.load(std::memory_order_acquire)) {
+                if (issuedBytes == 0)
+                    stats.stagingFrames++;
+                break;
+            }
+            Texture& texture = *chunk.texture;
+            if (!texture.named && bound != texture.name) {
+                GLState::get().bindTexture(unit, texture.target, texture.name);
+                bound = texture.name;
+                boundTarget = texture.target;
+            }
+            texture.container->subImage(chunk.faceTarget, chunk.level, chunk.y, chunk.height, (const void*)chunk.offset, texture.named);
+            issuedBytes += chunk.bytes;
+            batchBytes += chunk.allocatedBytes;
+            stats.streamedBytes += chunk.bytes;
+            stats.chunks++;
+            // a level is sampled once every chunk of it and of the levels above is issued,
+            // commands run in order so the texels are there by then
+            if (--texture.remainingChunks[chunk.level] == 0) {
+                int base = chunk.level;
+                while (base > 0 && texture.remainingChunks[base - 1] == 0)
+                    base--;
+                GLint current = 0;
+                if (texture.named)
+                    glGetTextureParameteriv(texture.named, GL_TEXTURE_BASE_LEVEL, &current);
+                else
+                    glGetTexParameteriv(texture.target, GL_TEXTURE_BASE_LEVEL, &current);
+                if (base < current && texture.named)
+                    glTextureParameteri(texture.named, GL_TEXTURE_BASE_LEVEL, base);
+                else if (base < current)
+                    glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, base);
+            }
+            staging.pop_front();
+        }
+        if (bound)
+            GLState::get().bindTexture(unit, boundTarget, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        if (batchBytes > 0) {
+            batches.push_back({ glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), batchBytes });
+            stats.batches++;
+        }
+        if (!stage())
+            stats.ringFullFrames++;
+        if (idle() && issuedBytes > 0)
+            finished(std::chrono::high_resolution_clock::now());
+    }
+
+    void report() const {
+        std::cout << "Texture streaming: " << stats.textures << " textures, " << stats.placeholderBytes << " bytes of placeholder levels at startup, "
+            << stats.streamedBytes << " bytes in " << stats.chunks << " chunks over " << stats.frames << " frames (" << stats.batches << " fenced batches, ring of "
+            << ringBytes / (1024 * 1024) << " MB), all levels in after " << stats.residentMs << " ms; " << stats.ringFullFrames << " frames waited for ring space, "
+            << stats.stagingFrames << " for copies" << std::endl;
+    }
+
+private:
+    struct Texture {
+        unsigned int name;
+        unsigned int named;     // name with direct state access, 0 to work on it bound
+        GLenum target;
+        const TextureContainer* container;
+        // chunks of every level not issued yet
+        std::vector<int> remainingChunks;
+    };
+
+    struct Chunk {
+        std::shared_ptr<Texture> texture;
+        GLenum faceTarget;
+        int level, y, height;
+        const unsigned char* source;
+        size_t bytes;
+        size_t offset = 0, allocatedBytes = 0;  // in the ring, with the end of the ring skipped to wrap
+        std::atomic<bool> copied{ false };
+    };
+
+    struct Batch {
+        GLsync fence;
+        size_t bytes;
+    };
+
+    ThreadPool* pool;
+    size_t ringBytes, bytesPerFrame;
+    int placeholderSize, unit;
+    unsigned int buffer;
+    unsigned char* ring;
+    // next offset handed out, oldest offset still in use and the bytes between
+    size_t head, tail, used;
+    std::deque<std::unique_ptr<Chunk>> queued, staging;
+    std::deque<Batch> batches;
+    std::chrono::high_resolution_clock::time_point started;
+    int outstanding;
+    std::mutex mutex;
+    std::condition_variable copiedCondition;
+
+    // ring space for queued chunks while there is some, their copies go to the pool; false when
+    // chunks are left without
+    bool stage() {
+        while (!queued.empty()) {
+            Chunk& chunk = *queued.front();
+            // 16 byte aligned offsets suit every format and type
+            size_t bytes = (chunk.bytes + 15) & ~(size_t)15;
+            size_t skipped = 0;
+            if (head + bytes > ringBytes)
+                skipped = ringBytes - head;
+            if (used + skipped + bytes > ringBytes)
+                return false;
+            chunk.offset = skipped ? 0 : head;
+            chunk.allocatedBytes = skipped + bytes;
+            head = (chunk.offset + bytes) % ringBytes;
+            used += chunk.allocatedBytes;
+            Chunk* staged = &chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                outstanding++;
+            }
+            pool->submit([this, staged] {
+                memcpy(ring + staged->offset, staged->source, staged->bytes);
+                staged->copied.store(true, std::memory_order_release);
+                std::unique_lock<std::mutex> lock(mutex);
+                if (--outstanding == 0)
+                    copiedCondition.notify_all();
+            });
+            staging.push_back(std::move(queued.front()));
+            queued.pop_front();
+        }
+        return true;
+    }
+
+    void finished(std::chrono::high_resolution_clock::time_point now) {
+        stats.residentMs = std::chrono::duration<double, std::milli>(now - started).count();
+    }
+};
+#endif
@@ -0,0 +1,126 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // constructor starts the worker threads, 0 means one per hardware thread
+    // ------------------------------------------------------------------------
+    ThreadPool(unsigned int numberOfThreads = 0) : stopping(false)
+    {
+        if (numberOfThreads == 0) {
+            numberOfThreads = std::thread::hardware_concurrency();
+            if (numberOfThreads == 0)
+                numberOfThreads = 1;
+        }
+        // the calling thread also takes part in parallelFor, so it counts as one of the threads
+        for (unsigned int i = 1; i < numberOfThreads; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCondition.notify_all();
+        for (unsigned int i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    // number of threads that take part in parallelFor (workers + caller)
+    // ------------------------------------------------------------------------
+    unsigned int size() const
+    {
+        return (unsigned int)workers.size() + 1;
+    }
+
+    // queue a job for a worker thread, without waiting for it
+    // ------------------------------------------------------------------------
+    void submit(std::function<void()> job)
+    {
+        if (workers.empty()) {
+            job();
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            jobs.push(std::move(job));
+        }
+        queueCondition.notify_one();
+    }
+
+    // run job(0) .. job(count - 1) on the pool and the calling thread, returns when all are done.
+    // The caller only waits for jobs, not for helpers that never got a worker, so it can also
+    // be called from a job running on the pool.
+    // ------------------------------------------------------------------------
+    void parallelFor(int count, const std::function<void(int)>& job)
+    {
+        // helpers that start late may outlive this call, they only touch the shared state
+        struct State {
+            std::atomic<int> next;
+            std::atomic<int> finished;
+            int count;
+            const std::function<void(int)>* job;
+            std::mutex doneMutex;
+            std::condition_variable doneCondition;
+        };
+        std::shared_ptr<State> state = std::make_shared<State>();
+        state->next = 0;
+        state->finished = 0;
+        state->count = count;
+        state->job = &job;
+        int helpers = (int)workers.size() < count - 1 ? (int)workers.size() : count - 1;
+
+        auto run = [](State& state) {
+            int i;
+            while ((i = state.next.fetch_add(1)) < state.count) {
+                (*state.job)(i);
+                if (state.finished.fetch_add(1) + 1 == state.count) {
+                    std::unique_lock<std::mutex> lock(state.doneMutex);
+                    state.doneCondition.notify_one();
+                }
+            }
+        };
+        for (int h = 0; h < helpers; h++) {
+            submit([state, run]() { run(*state); });
+        }
+        run(*state);
+        std::unique_lock<std::mutex> lock(state->doneMutex);
+        state->doneCondition.wait(lock, [&] { return state->finished == state->count; });
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    bool stopping;
+
+    void workerLoop()
+    {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCondition.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop();
+            }
+            job();
+        }
+    }
+};
+#endif
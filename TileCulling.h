@@ -0,0 +1,108 @@
+#ifndef TILECULLING_H
+#define TILECULLING_H
+
+#include <glad/glad.h>
+#include <glm/glm/glm.hpp>
+#include <cmath>
+#include <vector>
+#include "CubesphereMesh.h"
+
+// triangle counters of the last cull()
+struct CullingStats {
+    unsigned int drawnTiles;
+    unsigned int drawnTriangles;
+    unsigned int frustumCulledTriangles;
+    unsigned int horizonCulledTriangles;
+    unsigned int drawCalls;
+
+    unsigned int culledTriangles() const { return frustumCulledTriangles + horizonCulledTriangles; }
+};
+
+// Per-tile visibility for the globe mesh, done on the CPU in model space where the globe
+// is a unit sphere displaced outwards by at most CubesphereMesh::maxHeight:
+//  - frustum: the tile's bounding sphere against the six planes of projection * view * model
+//  - horizon: the tile's normal cone against the horizon of the camera. The sphere of radius
+//    r inside every flat triangle of the mesh is opaque, and a point at radius s in direction
+//    d can only be seen from the camera c past it if the angle between d and c is at most
+//    acos(r / |c|) + acos(r / s), the horizon angles of camera and point.
+// Visible tiles next to each other in the index buffer are merged into one range and the
+// ranges go out in one glMultiDrawElements.
+class TileCulling {
+public:
+    CullingStats stats;
+
+    void cull(const std::vector<MeshTile>& tiles, const glm::mat4& modelViewProjection, glm::vec3 cameraModelPos) {
+        extractPlanes(modelViewProjection);
+        float cameraDistance = glm::length(cameraModelPos);
+        glm::vec3 cameraDirection = cameraModelPos / cameraDistance;
+        float occluderRadius = 1.0f;
+        for (size_t n = 0; n < tiles.size(); n++)
+            occluderRadius = tiles[n].innerRadius < occluderRadius ? tiles[n].innerRadius : occluderRadius;
+        bool horizon = cameraDistance > occluderRadius;
+        float horizonAngle = horizon ? acos(occluderRadius / cameraDistance) + acos(occluderRadius / (1.0f + CubesphereMesh::maxHeight)) : 0.0f;
+
+        counts.clear();
+        offsets.clear();
+        stats = CullingStats();
+        unsigned int rangeEnd = 0;
+        for (size_t n = 0; n < tiles.size(); n++) {
+            const MeshTile& tile = tiles[n];
+            unsigned int triangles = tile.indexCount / 3;
+            if (!insideFrustum(tile)) {
+                stats.frustumCulledTriangles += triangles;
+                continue;
+            }
+            if (horizon) {
+                float cosine = glm::dot(glm::vec3(tile.coneAxis[0], tile.coneAxis[1], tile.coneAxis[2]), cameraDirection);
+                float angle = acos(glm::clamp(cosine, -1.0f, 1.0f));
+                if (angle - tile.coneAngle > horizonAngle) {
+                    stats.horizonCulledTriangles += triangles;
+                    continue;
+                }
+            }
+            stats.drawnTiles++;
+            stats.drawnTriangles += triangles;
+            if (!counts.empty() && rangeEnd == tile.firstIndex) {
+                counts.back() += tile.indexCount;
+            }
+            else {
+                counts.push_back(tile.indexCount);
+                offsets.push_back((const void*)(tile.firstIndex * sizeof(unsigned int)));
+            }
+            rangeEnd = tile.firstIndex + tile.indexCount;
+        }
+        stats.drawCalls = (unsigned int)counts.size();
+    }
+
+    // with the globe's VAO bound
+    void draw() const {
+        if (!counts.empty())
+            glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), (GLsizei)counts.size());
+    }
+
+private:
+    glm::vec4 planes[6];
+    std::vector<GLsizei> counts;
+    std::vector<const void*> offsets;
+
+    // Gribb and Hartmann, normalized so the plane distance is in model units
+    void extractPlanes(const glm::mat4& m) {
+        for (int k = 0; k < 3; k++) {
+            for (int side = 0; side < 2; side++) {
+                float sign = side == 0 ? 1.0f : -1.0f;
+                glm::vec4 plane(m[0][3] + sign * m[0][k], m[1][3] + sign * m[1][k], m[2][3] + sign * m[2][k], m[3][3] + sign * m[3][k]);
+                planes[k * 2 + side] = plane / glm::length(glm::vec3(plane.x, plane.y, plane.z));
+            }
+        }
+    }
+
+    bool insideFrustum(const MeshTile& tile) const {
+        for (int p = 0; p < 6; p++) {
+            float distance = planes[p].x * tile.center[0] + planes[p].y * tile.center[1] + planes[p].z * tile.center[2] + planes[p].w;
+            if (distance < -tile.radius)
+                return false;
+        }
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,447 @@
+#ifndef TILEPYRAMID_H
+#define TILEPYRAMID_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+#include "RasterRows.h"
+#include "TextureContainer.h"
+#include "ThreadPool.h"
+
+// bump whenever the layout or the reprojection changes
+const uint32_t TILE_PYRAMID_VERSION = 1;
+const int TILE_PYRAMID_MAX_LEVELS = 16;
+
+struct TilePyramidHeader {
+    char magic[4];              // "GTIL"
+    uint32_t version;
+    uint32_t faceSize;          // texels along the side of a face of level 0, a power of two
+    uint32_t tileSize;          // texels along the side of a tile, a power of two
+    uint32_t channels;
+    uint32_t type;              // GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT channels
+    uint32_t levels;            // down to 1x1 faces
+    uint32_t reserved;
+    uint64_t sourceStamp;       // TextureContainer::sourceStamp() of the raster it was made from
+    // level l has tilesPerSide[l]^2 tiles per face, face by face, each row by row of tiles; a
+    // tile of level l is min(tileSize, faceSize >> l) texels a side
+    uint32_t tilesPerSide[TILE_PYRAMID_MAX_LEVELS];
+    uint64_t levelOffsets[TILE_PYRAMID_MAX_LEVELS];
+};
+
+// The six faces of a cube map cut into a quadtree of fixed size tiles per face, a level of
+// the quadtree per mip level, made offline by generate() from an equirectangular raster of
+// any size. Texels sit on the equal-angle grid of Cubesphere::generateCubeSphereVertices
+// (the tangent of the face coordinate is linear in the mesh, the angle is linear in the
+// texels), with the faces in GL order and orientation; samplers look the faces up with
+// equalAngleDirection() of shader.fs. Replaces the hand-made px.png ... nz.png sets.
+class TilePyramid {
+public:
+    TilePyramidHeader header;
+    std::string path;
+
+    TilePyramid(const std::string& path) : path(path), file(nullptr) {
+        memset(&header, 0, sizeof(header));
+    }
+
+    ~TilePyramid() {
+        delete file;
+    }
+
+    TilePyramid(const TilePyramid&) = delete;
+    TilePyramid& operator=(const TilePyramid&) = delete;
+
+    // false when the file is missing, from another version, truncated, made with other options
+    // or older than source
+    bool load(const std::string& source, int channels, GLenum type, int faceSize, int tileSize) {
+        delete file;
+        file = new MappedFile(path);
+        if (!file->data || file->size < sizeof(TilePyramidHeader))
+            return false;
+        memcpy(&header, file->data, sizeof(header));
+        if (memcmp(header.magic, "GTIL", 4) != 0 || header.version != TILE_PYRAMID_VERSION || header.channels != (uint32_t)channels
+            || header.type != type || header.faceSize != (uint32_t)faceSize || header.tileSize != (uint32_t)tileSize
+            || header.levels == 0 || header.levels > TILE_PYRAMID_MAX_LEVELS || header.sourceStamp != TextureContainer::sourceStamp({ source })) {
+            std::cout << "Tile pyramid " << path << " is stale, generating" << std::endl;
+            return false;
+        }
+        uint32_t top = header.levels - 1;
+        if (header.levelOffsets[top] + 6 * tileBytes(top) > file->size) {
+            std::cout << "Tile pyramid " << path << " is truncated, generating" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    int levelSize(int level) const {
+        return std::max((int)header.faceSize >> level, 1);
+    }
+
+    int tileSide(int level) const {
+        return std::min((int)header.tileSize, levelSize(level));
+    }
+
+    size_t tileBytes(int level) const {
+        size_t side = tileSide(level);
+        return side * side * header.channels * (header.type == GL_UNSIGNED_SHORT ? 2 : 1);
+    }
+
+    const unsigned char* tile(int level, int face, int x, int y) const {
+        size_t tiles = header.tilesPerSide[level];
+        return file->data + header.levelOffsets[level] + ((face * tiles + y) * tiles + x) * tileBytes(level);
+    }
+
+    // a whole face of a level, tightly packed rows
+    std::vector<unsigned char> faceTexels(int face, int level) const {
+        int size = levelSize(level), side = tileSide(level);
+        size_t texelBytes = tileBytes(level) / ((size_t)side * side);
+        std::vector<unsigned char> texels((size_t)size * size * texelBytes);
+        for (uint32_t y = 0; y < header.tilesPerSide[level]; y++) {
+            for (uint32_t x = 0; x < header.tilesPerSide[level]; x++) {
+                const unsigned char* data = tile(level, face, x, y);
+                for (int row = 0; row < side; row++)
+                    memcpy(&texels[(((size_t)y * side + row) * size + (size_t)x * side) * texelBytes], data + (size_t)row * side * texelBytes, side * texelBytes);
+            }
+        }
+        return texels;
+    }
+
+    // every level into the cube map bound to the active unit, a glTexSubImage2D per tile
+    // straight from the mapping; single channel pyramids read as grey in .rgb. Given a
+    // texture (direct state access) it goes in by name instead, into immutable storage.
+    void upload(GLenum internalFormat, unsigned int texture = 0) const {
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        GLenum format = header.channels == 1 ? GL_RED : GL_RGB;
+        if (texture) {
+            glTextureStorage2D(texture, header.levels, internalFormat, levelSize(0), levelSize(0));
+            for (uint32_t l = 0; l < header.levels; l++) {
+                int side = tileSide(l);
+                // the faces are the layers of a cube map addressed by name
+                for (int face = 0; face < 6; face++) {
+                    for (uint32_t y = 0; y < header.tilesPerSide[l]; y++) {
+                        for (uint32_t x = 0; x < header.tilesPerSide[l]; x++)
+                            glTextureSubImage3D(texture, l, x * side, y * side, face, side, side, 1, format, header.type, tile(l, face, x, y));
+                    }
+                }
+            }
+            if (header.channels == 1) {
+                glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_G, GL_RED);
+                glTextureParameteri(texture, GL_TEXTURE_SWIZZLE_B, GL_RED);
+            }
+            glTextureParameteri(texture, GL_TEXTURE_BASE_LEVEL, 0);
+            glTextureParameteri(texture, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+            return;
+        }
+        for (int face = 0; face < 6; face++) {
+            for (uint32_t l = 0; l < header.levels; l++) {
+                int side = tileSide(l);
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, l, internalFormat, levelSize(l), levelSize(l), 0, format, header.type, NULL);
+                for (uint32_t y = 0; y < header.tilesPerSide[l]; y++) {
+                    for (uint32_t x = 0; x < header.tilesPerSide[l]; x++)
+                        glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, l, x * side, y * side, side, side, format, header.type, tile(l, face, x, y));
+                }
+            }
+        }
+        if (header.channels == 1) {
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_SWIZZLE_G, GL_RED);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        }
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    // Reprojects the equirectangular raster source (laid out like earth.jpg, north up) into
+    // a pyramid at path. The raster is read stripRows rows at a
+    // time and never held whole when it is a binary PPM or PGM (8 or 16 bits); other formats
+    // go through stb_image, which can only decode them whole. A level 0 tile is allocated
+    // when the first strip it reads from arrives and written out once the last one has
+    // passed, then box filtered into its quarter of the tile above it, so memory holds a
+    // strip, the tiles the strip crosses and the parents still missing children. Tiles are
+    // filled on the pool. channels are taken from the first ones of the raster, grey rasters
+    // fill all of them; type GL_UNSIGNED_SHORT keeps 16 bit rasters at full precision.
+    static bool generate(const std::string& path, const std::string& source, int channels, GLenum type, int faceSize, int tileSize, int stripRows, ThreadPool* pool) {
+        if (type == GL_UNSIGNED_SHORT)
+            return generate<uint16_t>(path, source, channels, faceSize, tileSize, stripRows, pool);
+        return generate<unsigned char>(path, source, channels, faceSize, tileSize, stripRows, pool);
+    }
+
+private:
+    MappedFile* file;
+
+    // a level 0 tile, or a parent collecting the quarters of its children
+    struct PendingTile {
+        int level, face, x, y;
+        int firstRow, lastRow;      // strips of level 0 tiles: the rows their bilinear taps end at
+        int children;               // still missing, for parents
+        std::vector<unsigned char> texels;
+        // raster x and y of every texel of a level 0 tile, worked out once for all its strips
+        std::vector<float> positions;
+    };
+
+    // direction of (s, t) in [-1, 1] on face, the inverse of the GL cube map face rules
+    static void faceDirection(int face, float s, float t, float d[3]) {
+        switch (face) {
+        case 0: d[0] = 1.0f; d[1] = -t; d[2] = -s; break;
+        case 1: d[0] = -1.0f; d[1] = -t; d[2] = s; break;
+        case 2: d[0] = s; d[1] = 1.0f; d[2] = t; break;
+        case 3: d[0] = s; d[1] = -1.0f; d[2] = -t; break;
+        case 4: d[0] = s; d[1] = -t; d[2] = 1.0f; break;
+        default: d[0] = -s; d[1] = -t; d[2] = -1.0f; break;
+        }
+    }
+
+    // raster position of texel (i, j) of a level 0 face of faceSize texels, texel centres at
+    // .5; the face coordinate of the equal-angle grid is the tangent of the angle
+    static void rasterPosition(int face, int i, int j, int faceSize, int width, int height, float& x, float& y) {
+        const float pi = 3.14159265358979f;
+        float s = std::tan(((i + 0.5f) / faceSize * 2.0f - 1.0f) * pi / 4.0f);
+        float t = std::tan(((j + 0.5f) / faceSize * 2.0f - 1.0f) * pi / 4.0f);
+        float d[3];
+        faceDirection(face, s, t, d);
+        float length = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        // s and t of the 2D maps (see Heightmap::sample), t = 0 at the south pole and the
+        // first row of the raster at the north one
+        float u = (std::atan2(-d[2], d[0]) + pi) / (2.0f * pi);
+        float v = std::acos(std::max(-1.0f, std::min(1.0f, d[1] / length))) / pi;
+        x = u * width - 0.5f;
+        y = v * height - 0.5f;
+    }
+
+    // last raster row the bilinear taps of a texel at raster row y read
+    static int lastTapRow(float y, int height) {
+        return std::max(0, std::min((int)std::floor(y) + 1, height - 1));
+    }
+
+    template<class T>
+    static bool generate(const std::string& path, const std::string& source, int channels, int faceSize, int tileSize, int stripRows, ThreadPool* pool) {
+        auto start = std::chrono::high_resolution_clock::now();
+        if (faceSize < tileSize || (faceSize & (faceSize - 1)) != 0 || (tileSize & (tileSize - 1)) != 0) {
+            std::cout << "Tile pyramid " << path << " not generated, the face and tile sizes must be powers of two" << std::endl;
+            return false;
+        }
+        RasterRows<T> raster(source, channels);
+        if (raster.width == 0) {
+            std::cout << "Tile pyramid " << path << " not generated, " << source << " failed to load" << std::endl;
+            return false;
+        }
+        const int width = raster.width, height = raster.height;
+        TilePyramidHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GTIL", 4);
+        header.version = TILE_PYRAMID_VERSION;
+        header.faceSize = faceSize;
+        header.tileSize = tileSize;
+        header.channels = channels;
+        header.type = sizeof(T) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+        header.sourceStamp = TextureContainer::sourceStamp({ source });
+        uint64_t offset = sizeof(header);
+        for (int size = faceSize; ; size /= 2) {
+            int side = std::min(tileSize, size);
+            header.tilesPerSide[header.levels] = size / side;
+            // levels start 16 byte aligned, like the texture containers
+            offset = (offset + 15) & ~(uint64_t)15;
+            header.levelOffsets[header.levels] = offset;
+            offset += (uint64_t)6 * (size / side) * (size / side) * side * side * channels * sizeof(T);
+            header.levels++;
+            if (size == 1 || header.levels == TILE_PYRAMID_MAX_LEVELS)
+                break;
+        }
+
+        // the rows every level 0 tile reads, from its edge texels; inside a tile the latitude
+        // only peaks at a pole, in the middle of the polar faces
+        std::vector<PendingTile> waiting;
+        int tiles0 = header.tilesPerSide[0];
+        for (int face = 0; face < 6; face++) {
+            for (int ty = 0; ty < tiles0; ty++) {
+                for (int tx = 0; tx < tiles0; tx++) {
+                    PendingTile tile = { 0, face, tx, ty, height, 0, 0, {}, {} };
+                    int i0 = tx * tileSize, j0 = ty * tileSize, i1 = i0 + tileSize - 1, j1 = j0 + tileSize - 1;
+                    for (int k = 0; k < tileSize; k++) {
+                        int edge[4][2] = { { i0 + k, j0 }, { i0 + k, j1 }, { i0, j0 + k }, { i1, j0 + k } };
+                        for (int e = 0; e < 4; e++) {
+                            float x, y;
+                            rasterPosition(face, edge[e][0], edge[e][1], faceSize, width, height, x, y);
+                            tile.firstRow = std::min(tile.firstRow, lastTapRow(y, height));
+                            tile.lastRow = std::max(tile.lastRow, lastTapRow(y, height));
+                        }
+                    }
+                    if (face == 2 || face == 3) {
+                        int centre = faceSize / 2;
+                        if (centre >= i0 - 1 && centre <= i1 + 1 && centre >= j0 - 1 && centre <= j1 + 1) {
+                            if (face == 2)
+                                tile.firstRow = 0;
+                            else
+                                tile.lastRow = height - 1;
+                        }
+                    }
+                    // the tangent and the arc functions round differently from texel to texel
+                    tile.firstRow = std::max(tile.firstRow - 2, 0);
+                    tile.lastRow = std::min(tile.lastRow + 2, height - 1);
+                    waiting.push_back(std::move(tile));
+                }
+            }
+        }
+        std::sort(waiting.begin(), waiting.end(), [](const PendingTile& a, const PendingTile& b) { return a.firstRow < b.firstRow; });
+
+        std::string temporaryPath = path + ".tmp";
+        std::fstream stream(temporaryPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        stream.write((const char*)&header, sizeof(header));
+        // the file at its full size, tiles are written wherever they finish
+        stream.seekp((std::streamoff)offset - 1);
+        stream.put(0);
+
+        size_t rowValues = (size_t)width * channels;
+        size_t tileValues = (size_t)tileSize * tileSize * channels;
+        // the strip with the last row of the one before in front, for the bilinear taps across
+        std::vector<T> window((size_t)(stripRows + 1) * rowValues);
+        std::vector<PendingTile> active;
+        std::map<uint64_t, PendingTile> parents;
+        size_t nextWaiting = 0, peakBytes = 0;
+        for (int stripStart = 0; stripStart < height; stripStart += stripRows) {
+            int stripEnd = std::min(stripStart + stripRows, height);
+            int windowStart = std::max(stripStart - 1, 0);
+            if (stripStart > 0) {
+                // the last row of the strip before, from where it was in the window
+                int previousWindowStart = std::max(stripStart - stripRows - 1, 0);
+                memcpy(window.data(), &window[(size_t)(stripStart - 1 - previousWindowStart) * rowValues], rowValues * sizeof(T));
+            }
+            if (!raster.read(&window[(size_t)(stripStart - windowStart) * rowValues], stripEnd - stripStart)) {
+                std::cout << "Tile pyramid " << path << " not generated, " << source << " is truncated" << std::endl;
+                stream.close();
+                std::remove(temporaryPath.c_str());
+                return false;
+            }
+            while (nextWaiting < waiting.size() && waiting[nextWaiting].firstRow < stripEnd) {
+                waiting[nextWaiting].texels.resize(tileValues * sizeof(T));
+                active.push_back(std::move(waiting[nextWaiting++]));
+            }
+
+            // texels whose last tap row is in this strip, every texel is filled exactly once
+            pool->parallelFor((int)active.size(), [&](int a) {
+                PendingTile& tile = active[a];
+                if (tile.lastRow < stripStart)
+                    return;
+                if (tile.positions.empty()) {
+                    tile.positions.resize((size_t)tileSize * tileSize * 2);
+                    for (int j = 0; j < tileSize; j++) {
+                        for (int i = 0; i < tileSize; i++) {
+                            float* position = &tile.positions[((size_t)j * tileSize + i) * 2];
+                            rasterPosition(tile.face, tile.x * tileSize + i, tile.y * tileSize + j, faceSize, width, height, position[0], position[1]);
+                        }
+                    }
+                }
+                T* texels = (T*)tile.texels.data();
+                for (int j = 0; j < tileSize; j++) {
+                    for (int i = 0; i < tileSize; i++) {
+                        float x = tile.positions[((size_t)j * tileSize + i) * 2];
+                        float y = tile.positions[((size_t)j * tileSize + i) * 2 + 1];
+                        int last = lastTapRow(y, height);
+                        if (last < stripStart || last >= stripEnd)
+                            continue;
+                        float y0 = std::floor(y), x0 = std::floor(x);
+                        float fy = y - y0, fx = x - x0;
+                        int row0 = std::max((int)y0, 0) - windowStart, row1 = last - windowStart;
+                        int column0 = (((int)x0 % width) + width) % width, column1 = (column0 + 1) % width;
+                        const T* r0 = &window[(size_t)row0 * rowValues];
+                        const T* r1 = &window[(size_t)row1 * rowValues];
+                        for (int c = 0; c < channels; c++) {
+                            float top = r0[column0 * channels + c] * (1.0f - fx) + r0[column1 * channels + c] * fx;
+                            float bottom = r1[column0 * channels + c] * (1.0f - fx) + r1[column1 * channels + c] * fx;
+                            texels[((size_t)j * tileSize + i) * channels + c] = (T)(top * (1.0f - fy) + bottom * fy + 0.5f);
+                        }
+                    }
+                }
+            });
+
+            size_t bytes = window.size() * sizeof(T) + (raster.decodedWhole() ? (size_t)height * rowValues * sizeof(T) : 0);
+            for (const PendingTile& tile : active)
+                bytes += tile.texels.size() + tile.positions.size() * sizeof(float);
+            for (const auto& parent : parents)
+                bytes += parent.second.texels.size();
+            peakBytes = std::max(peakBytes, bytes);
+
+            // tiles past their last row, then every parent they complete
+            std::vector<PendingTile> finished;
+            for (size_t a = 0; a < active.size(); ) {
+                if (active[a].lastRow < stripEnd) {
+                    finished.push_back(std::move(active[a]));
+                    std::vector<float>().swap(finished.back().positions);
+                    active[a] = std::move(active.back());
+                    active.pop_back();
+                }
+                else {
+                    a++;
+                }
+            }
+            while (!finished.empty()) {
+                std::vector<std::vector<unsigned char>> halves(finished.size());
+                pool->parallelFor((int)finished.size(), [&](int f) {
+                    const PendingTile& tile = finished[f];
+                    if (tile.level + 1 < (int)header.levels) {
+                        int side = std::min(tileSize, faceSize >> tile.level);
+                        halves[f] = TextureContainer::downsample(tile.texels.data(), side, side, channels, header.type);
+                    }
+                });
+                std::vector<PendingTile> completed;
+                for (size_t f = 0; f < finished.size(); f++) {
+                    const PendingTile& tile = finished[f];
+                    uint32_t tiles = header.tilesPerSide[tile.level];
+                    stream.seekp((std::streamoff)(header.levelOffsets[tile.level] + ((tile.face * tiles + tile.y) * tiles + tile.x) * tile.texels.size()));
+                    stream.write((const char*)tile.texels.data(), (std::streamsize)tile.texels.size());
+                    if (tile.level + 1 == (int)header.levels)
+                        continue;
+                    int level = tile.level + 1;
+                    int childSide = std::min(tileSize, faceSize >> tile.level), side = std::min(tileSize, faceSize >> level);
+                    int children = tiles > 1 ? 4 : 1;
+                    uint64_t key = ((uint64_t)level << 48) | ((uint64_t)tile.face << 40) | ((uint64_t)(tile.y / 2) << 20) | (uint64_t)(tile.x / 2);
+                    auto it = parents.find(key);
+                    if (it == parents.end()) {
+                        PendingTile parent = { level, tile.face, tile.x / 2, tile.y / 2, 0, 0, children, std::vector<unsigned char>((size_t)side * side * channels * sizeof(T)), {} };
+                        it = parents.emplace(key, std::move(parent)).first;
+                    }
+                    // the quarter of the parent this child covers
+                    int halfSide = childSide / 2 > 0 ? childSide / 2 : 1;
+                    int offsetX = children == 4 ? (tile.x & 1) * halfSide : 0, offsetY = children == 4 ? (tile.y & 1) * halfSide : 0;
+                    size_t texelBytes = channels * sizeof(T);
+                    for (int row = 0; row < halfSide; row++)
+                        memcpy(&it->second.texels[(((size_t)offsetY + row) * side + offsetX) * texelBytes], &halves[f][(size_t)row * halfSide * texelBytes], halfSide * texelBytes);
+                    if (--it->second.children == 0) {
+                        completed.push_back(std::move(it->second));
+                        parents.erase(it);
+                    }
+                }
+                finished.swap(completed);
+            }
+        }
+        stream.close();
+        if (!stream || !active.empty() || !parents.empty()) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        bool stored = std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+        auto end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (stored)
+            std::cout << "Tile pyramid " << path << " generated in " << seconds * 1000.0 << " ms (" << pool->size() << " threads), "
+                << width << "x" << height << " read at " << (double)width * height / 1e6 / seconds << " MP/s" << (raster.decodedWhole() ? " (decoded whole)" : "")
+                << ", 6 faces of " << faceSize << "x" << faceSize << " written at " << 6.0 * faceSize * faceSize / 1e6 / seconds << " MP/s, "
+                << header.levels << " levels of " << tileSize << "x" << tileSize << " tiles, " << peakBytes / (1024 * 1024) << " MB peak" << std::endl;
+        return stored;
+    }
+};
+#endif
@@ -0,0 +1,191 @@
+#ifndef VERTEXCACHEOPTIMIZER_H
+#define VERTEXCACHEOPTIMIZER_H
+
+#include <cstring>
+#include <vector>
+
+// post-transform cache hit rate of an index buffer, simulated on the CPU
+struct VertexCacheStats {
+    unsigned int misses;
+    unsigned int triangles;
+    unsigned int referencedVertices;
+    // average cache miss ratio, transformed vertices per triangle (0.5 is the best a grid can do)
+    float acmr() const { return triangles ? (float)misses / triangles : 0.0f; }
+    // average transform to vertex ratio, 1.0 means every vertex is shaded exactly once
+    float atvr() const { return referencedVertices ? (float)misses / referencedVertices : 0.0f; }
+};
+
+class VertexCacheOptimizer {
+public:
+    // Tipsify (Sander, Nehab, Barczak 2007): reorders triangles so that a FIFO cache of
+    // cacheSize entries is reused well, in linear time
+    static void optimizeIndices(std::vector<unsigned int>& indices, unsigned int vertexCount, int cacheSize = 16) {
+        reorderTriangles(indices, triangleOrder(indices, vertexCount, cacheSize));
+    }
+
+    // the triangle numbers of indices in the order Tipsify emits them
+    static std::vector<unsigned int> triangleOrder(const std::vector<unsigned int>& indices, unsigned int vertexCount, int cacheSize = 16) {
+        unsigned int triangleCount = (unsigned int)(indices.size() / 3);
+        std::vector<unsigned int> order;
+        order.reserve(triangleCount);
+        if (triangleCount == 0)
+            return order;
+
+        // vertex -> triangle adjacency, compressed rows
+        std::vector<unsigned int> liveTriangles(vertexCount, 0);
+        for (size_t k = 0; k < indices.size(); k++)
+            liveTriangles[indices[k]]++;
+        std::vector<unsigned int> adjacencyOffset(vertexCount + 1, 0);
+        for (unsigned int v = 0; v < vertexCount; v++)
+            adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+        std::vector<unsigned int> adjacency(indices.size());
+        std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (size_t k = 0; k < indices.size(); k++)
+            adjacency[fill[indices[k]]++] = (unsigned int)(k / 3);
+
+        std::vector<int> cacheTime(vertexCount, 0);
+        std::vector<bool> emitted(triangleCount, false);
+        std::vector<unsigned int> deadEnd;
+        std::vector<unsigned int> candidates;
+        deadEnd.reserve(indices.size());
+
+        int time = cacheSize + 1;
+        unsigned int cursor = 0;
+        int fan = nextLiveVertex(liveTriangles, deadEnd, cursor, vertexCount);
+        while (fan >= 0) {
+            candidates.clear();
+            for (unsigned int a = adjacencyOffset[fan]; a < adjacencyOffset[fan + 1]; a++) {
+                unsigned int t = adjacency[a];
+                if (emitted[t])
+                    continue;
+                for (int c = 0; c < 3; c++) {
+                    unsigned int v = indices[t * 3 + c];
+                    deadEnd.push_back(v);
+                    candidates.push_back(v);
+                    liveTriangles[v]--;
+                    if (time - cacheTime[v] > cacheSize) {
+                        cacheTime[v] = time;
+                        time++;
+                    }
+                }
+                emitted[t] = true;
+                order.push_back(t);
+            }
+
+            // next fan: the candidate that is still in the cache and is oldest, or a dead end
+            int best = -1, bestPriority = -1;
+            for (size_t n = 0; n < candidates.size(); n++) {
+                unsigned int v = candidates[n];
+                if (liveTriangles[v] == 0)
+                    continue;
+                int priority = 0;
+                if (time - cacheTime[v] + 2 * (int)liveTriangles[v] <= cacheSize)
+                    priority = time - cacheTime[v];
+                if (priority > bestPriority) {
+                    bestPriority = priority;
+                    best = v;
+                }
+            }
+            fan = best >= 0 ? best : nextLiveVertex(liveTriangles, deadEnd, cursor, vertexCount);
+        }
+        return order;
+    }
+
+    // applies order to every run of order.size() triangles, for index buffers that repeat one
+    // connectivity at different vertex offsets; in place, through a copy of one run
+    static void reorderTriangles(std::vector<unsigned int>& indices, const std::vector<unsigned int>& order) {
+        size_t run = order.size();
+        std::vector<unsigned int> source(run * 3);
+        for (size_t first = 0; run > 0 && first + run <= indices.size() / 3; first += run) {
+            memcpy(source.data(), &indices[first * 3], source.size() * sizeof(unsigned int));
+            for (size_t t = 0; t < run; t++)
+                memcpy(&indices[(first + t) * 3], &source[(size_t)order[t] * 3], 3 * sizeof(unsigned int));
+        }
+    }
+
+    // renumbers vertices in the order the index buffer first uses them, so vertex fetch
+    // walks the buffer forwards; unused vertices are dropped
+    static void optimizeVertexFetch(std::vector<float>& vertices, int floatsPerVertex, std::vector<unsigned int>& indices) {
+        unsigned int vertexCount = (unsigned int)(vertices.size() / floatsPerVertex);
+        const unsigned int unused = 0xffffffffu;
+        std::vector<unsigned int> remap(vertexCount, unused);
+        std::vector<float> reordered(vertices.size());
+        unsigned int next = 0;
+        for (size_t k = 0; k < indices.size(); k++) {
+            unsigned int v = indices[k];
+            if (remap[v] == unused) {
+                remap[v] = next;
+                memcpy(&reordered[(size_t)next * floatsPerVertex], &vertices[(size_t)v * floatsPerVertex], floatsPerVertex * sizeof(float));
+                next++;
+            }
+            indices[k] = remap[v];
+        }
+        reordered.resize((size_t)next * floatsPerVertex);
+        vertices.swap(reordered);
+    }
+
+    static VertexCacheStats simulateFifo(const std::vector<unsigned int>& indices, unsigned int vertexCount, int cacheSize) {
+        VertexCacheStats stats = { 0, (unsigned int)(indices.size() / 3), countReferenced(indices, vertexCount) };
+        // a vertex is cached if it was inserted less than cacheSize misses ago
+        std::vector<unsigned int> insertedAt(vertexCount, 0);
+        unsigned int time = cacheSize + 1;
+        for (size_t k = 0; k < indices.size(); k++) {
+            unsigned int v = indices[k];
+            if (time - insertedAt[v] > (unsigned int)cacheSize) {
+                insertedAt[v] = time++;
+                stats.misses++;
+            }
+        }
+        return stats;
+    }
+
+    static VertexCacheStats simulateLru(const std::vector<unsigned int>& indices, unsigned int vertexCount, int cacheSize) {
+        VertexCacheStats stats = { 0, (unsigned int)(indices.size() / 3), countReferenced(indices, vertexCount) };
+        // most recently used first
+        std::vector<unsigned int> cache;
+        for (size_t k = 0; k < indices.size(); k++) {
+            unsigned int v = indices[k];
+            size_t slot = 0;
+            while (slot < cache.size() && cache[slot] != v)
+                slot++;
+            if (slot == cache.size()) {
+                stats.misses++;
+                if ((int)cache.size() < cacheSize)
+                    cache.push_back(v);
+                slot = cache.size() - 1;
+            }
+            for (; slot > 0; slot--)
+                cache[slot] = cache[slot - 1];
+            cache[0] = v;
+        }
+        return stats;
+    }
+
+private:
+    static int nextLiveVertex(const std::vector<unsigned int>& liveTriangles, std::vector<unsigned int>& deadEnd, unsigned int& cursor, unsigned int vertexCount) {
+        while (!deadEnd.empty()) {
+            unsigned int v = deadEnd.back();
+            deadEnd.pop_back();
+            if (liveTriangles[v] > 0)
+                return v;
+        }
+        for (; cursor < vertexCount; cursor++) {
+            if (liveTriangles[cursor] > 0)
+                return cursor;
+        }
+        return -1;
+    }
+
+    static unsigned int countReferenced(const std::vector<unsigned int>& indices, unsigned int vertexCount) {
+        std::vector<bool> seen(vertexCount, false);
+        unsigned int count = 0;
+        for (size_t k = 0; k < indices.size(); k++) {
+            if (!seen[indices[k]]) {
+                seen[indices[k]] = true;
+                count++;
+            }
+        }
+        return count;
+    }
+};
+#endif
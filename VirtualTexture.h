@@ -0,0 +1,622 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+#include <glad/glad.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "MappedFile.h"
+#include "RasterRows.h"
+#include "Shader.h"
+#include "TextureContainer.h"
+#include "ThreadPool.h"
+
+// bump whenever the layout or the pyramid the builder writes changes
+const uint32_t VIRTUAL_TEXTURE_VERSION = 1;
+const int VIRTUAL_TEXTURE_MAX_LEVELS = 16;
+
+struct VirtualTextureHeader {
+    char magic[4];              // "VTEX"
+    uint32_t version;
+    uint32_t width, height;     // texels of level 0
+    uint32_t pageSize;          // texels along the side of a page, without the border
+    uint32_t border;            // texels of the neighbouring pages around every page
+    uint32_t channels;          // bytes per texel
+    uint32_t levels;
+    uint32_t flipped;           // rows bottom first, like the 2D maps
+    uint32_t reserved;
+    uint64_t sourceStamp;       // TextureContainer::sourceStamp() of the image it was built from
+    // pages of level l, every page covers 2x2 pages of level l - 1
+    uint32_t pagesX[VIRTUAL_TEXTURE_MAX_LEVELS], pagesY[VIRTUAL_TEXTURE_MAX_LEVELS];
+    // level l starts at levelOffsets[l], its pages row by row, pageBytes() each
+    uint64_t levelOffsets[VIRTUAL_TEXTURE_MAX_LEVELS];
+};
+
+// Sparse virtual texture for earth imagery larger than GL_MAX_TEXTURE_SIZE. The image is a
+// pyramid of fixed size pages on disk (build()), mapped like the texture containers. Only the
+// pages a recent frame needed live on the GPU, in the slots of one page cache texture of a
+// fixed size, recycled least recently used first. Which pages are needed comes from a
+// feedback pass: the globe is drawn small into a framebuffer of its own with shader.fs
+// writing the page and level every fragment wants, and read back into a pixel buffer that
+// is only mapped a frame or two later, once its fence has signalled, so the CPU never waits
+// for the GPU; the pages follow the view that much behind. An indirection texture holds
+// every page of every level (level l in rows indirectionRows[l] onwards) pointing at the
+// cache slot of the page or of its finest resident ancestor, so the shader always has
+// something to show while finer pages stream in. The coarsest level is never evicted.
+class VirtualTexture {
+public:
+    VirtualTextureHeader header;
+    std::string path;
+    unsigned int cacheTexture, indirectionTexture;
+    int cacheColumns, cacheRows;
+    int indirectionUnit, cacheUnit;
+
+    // feedback readbacks in flight at most, beginFeedback() skips the pass while all are
+    static const int feedbackBuffers = 3;
+
+    // of the last update(), resident and capacity in pages
+    struct Stats {
+        int requestedPages, residentPages, capacity;
+        int uploadedPages, evictedPages, deferredPages;
+        int skippedFeedback;        // passes skipped so far with every readback still in flight
+    } stats;
+
+    // the indirection and cache textures stay bound to texture units of their own
+    VirtualTexture(const std::string& path, int indirectionUnit, int cacheUnit) : path(path), cacheTexture(0), indirectionTexture(0),
+        cacheColumns(0), cacheRows(0), indirectionUnit(indirectionUnit), cacheUnit(cacheUnit), file(nullptr), feedbackFramebuffer(0), feedbackWidth(0), feedbackHeight(0), feedbackLodBias(0.0f),
+        feedbackWrite(0), feedbackPending(0) {
+        memset(&header, 0, sizeof(header));
+        memset(&stats, 0, sizeof(stats));
+        feedbackRenderbuffers[0] = feedbackRenderbuffers[1] = 0;
+        for (int b = 0; b < feedbackBuffers; b++) {
+            feedbackPixelBuffers[b] = 0;
+            feedbackFences[b] = 0;
+        }
+    }
+
+    ~VirtualTexture() {
+        glDeleteTextures(1, &cacheTexture);
+        glDeleteTextures(1, &indirectionTexture);
+        glDeleteFramebuffers(1, &feedbackFramebuffer);
+        glDeleteRenderbuffers(2, feedbackRenderbuffers);
+        glDeleteBuffers(feedbackBuffers, feedbackPixelBuffers);
+        for (int b = 0; b < feedbackBuffers; b++)
+            glDeleteSync(feedbackFences[b]);
+        delete file;
+    }
+
+    VirtualTexture(const VirtualTexture&) = delete;
+    VirtualTexture& operator=(const VirtualTexture&) = delete;
+
+    // false when the file is missing, from another version, truncated or older than source
+    bool load(const std::string& source, bool flip) {
+        delete file;
+        file = new MappedFile(path);
+        if (!file->data || file->size < sizeof(VirtualTextureHeader))
+            return false;
+        memcpy(&header, file->data, sizeof(header));
+        if (memcmp(header.magic, "VTEX", 4) != 0 || header.version != VIRTUAL_TEXTURE_VERSION || header.flipped != (uint32_t)flip
+            || header.levels == 0 || header.levels > VIRTUAL_TEXTURE_MAX_LEVELS || header.sourceStamp != TextureContainer::sourceStamp({ source })) {
+            std::cout << "Virtual texture " << path << " is stale, building" << std::endl;
+            return false;
+        }
+        uint32_t top = header.levels - 1;
+        if (header.levelOffsets[top] + (uint64_t)header.pagesX[top] * header.pagesY[top] * pageBytes() > file->size) {
+            std::cout << "Virtual texture " << path << " is truncated, building" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    size_t pageBytes() const {
+        size_t side = header.pageSize + 2 * header.border;
+        return side * side * header.channels;
+    }
+
+    const unsigned char* page(int level, int x, int y) const {
+        return file->data + header.levelOffsets[level] + ((size_t)y * header.pagesX[level] + x) * pageBytes();
+    }
+
+    // the page cache gets as many slots as fit in budgetBytes (at 4 bytes a texel, what drivers
+    // usually store RGB8 as), the indirection texture one texel per page of every level, the
+    // feedback framebuffer the width x height of the window divided by feedbackDivisor
+    void createTextures(size_t budgetBytes, int width, int height, int feedbackDivisor) {
+        int side = header.pageSize + 2 * header.border;
+        GLint maxSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+        int slots = (int)(budgetBytes / ((size_t)side * side * 4));
+        int top = header.levels - 1;
+        slots = std::max(slots, (int)(header.pagesX[top] * header.pagesY[top]) + 1);
+        cacheColumns = std::min((int)std::ceil(std::sqrt((double)slots)), std::min(maxSize / side, 256));
+        cacheRows = std::min((slots + cacheColumns - 1) / cacheColumns, std::min(maxSize / side, 256));
+        freeSlots.clear();
+        for (int slot = cacheColumns * cacheRows - 1; slot >= 0; slot--)
+            freeSlots.push_back(slot);
+
+        glGenTextures(1, &cacheTexture);
+        GLState::get().bindTexture(cacheUnit, GL_TEXTURE_2D, cacheTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, cacheColumns * side, cacheRows * side, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+        int rows = 0;
+        for (uint32_t level = 0; level < header.levels; level++) {
+            indirectionRows[level] = rows;
+            rows += header.pagesY[level];
+        }
+        indirection.assign((size_t)header.pagesX[0] * rows * 4, 0);
+        glGenTextures(1, &indirectionTexture);
+        GLState::get().bindTexture(indirectionUnit, GL_TEXTURE_2D, indirectionTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, header.pagesX[0], rows, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+        // the coarsest level stays resident, every other page falls back to it
+        for (uint32_t y = 0; y < header.pagesY[top]; y++) {
+            for (uint32_t x = 0; x < header.pagesX[top]; x++) {
+                int slot = freeSlots.back();
+                freeSlots.pop_back();
+                uploadPage(slot, top, x, y);
+                pinnedSlots[key(top, x, y)] = slot;
+            }
+        }
+        updateIndirection();
+
+        feedbackWidth = std::max(width / feedbackDivisor, 1);
+        feedbackHeight = std::max(height / feedbackDivisor, 1);
+        // the gradients of the smaller framebuffer are feedbackDivisor times larger
+        feedbackLodBias = -std::log2((float)feedbackDivisor);
+        glGenBuffers(feedbackBuffers, feedbackPixelBuffers);
+        for (int b = 0; b < feedbackBuffers; b++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPixelBuffers[b]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)feedbackWidth * feedbackHeight * 4, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glGenFramebuffers(1, &feedbackFramebuffer);
+        glGenRenderbuffers(2, feedbackRenderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedbackRenderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, feedbackWidth, feedbackHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedbackRenderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackRenderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackRenderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Virtual texture feedback framebuffer is incomplete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // the uniforms shader.fs reads the indirection and cache textures with, on the active program
+    void setUniforms(const Shader& shader) const {
+        int side = header.pageSize + 2 * header.border;
+        shader.setInt("indirectionMap", indirectionUnit);
+        shader.setInt("pageCache", cacheUnit);
+        shader.setVec2("virtualSize", (float)header.width, (float)header.height);
+        shader.setVec2("pageCacheSize", (float)(cacheColumns * side), (float)(cacheRows * side));
+        shader.setInt("virtualLevels", header.levels);
+        shader.setInt("pageSize", header.pageSize);
+        shader.setInt("pageBorder", header.border);
+        shader.setIntArray("indirectionRows", indirectionRows, header.levels);
+        shader.setFloat("feedbackLodBias", feedbackLodBias);
+    }
+
+    // the globe drawn between these two lands in the feedback framebuffer, which endFeedback
+    // copies into the next pixel buffer. The requests update() goes by are those of the newest
+    // readback whose fence has signalled. false when every buffer is still in flight: the
+    // GPU is that far behind, and the pass is skipped this frame.
+    bool beginFeedback() {
+        collectFeedback();
+        if (feedbackPending == feedbackBuffers) {
+            stats.skippedFeedback++;
+            return false;
+        }
+        glGetIntegerv(GL_VIEWPORT, savedViewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+        glViewport(0, 0, feedbackWidth, feedbackHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        return true;
+    }
+
+    void endFeedback() {
+        GLint alignment;
+        glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPixelBuffers[feedbackWrite]);
+        glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+        feedbackFences[feedbackWrite] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        feedbackWrite = (feedbackWrite + 1) % feedbackBuffers;
+        feedbackPending++;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    }
+
+    // makes up to maxUploads of the requested pages resident, coarse levels first, evicting pages
+    // the last feedback didn't ask for; pages that don't fit wait for a later frame
+    void update(int maxUploads) {
+        stats.uploadedPages = stats.evictedPages = stats.deferredPages = 0;
+        std::vector<uint32_t> missing;
+        for (uint32_t page : requested) {
+            auto it = resident.find(page);
+            if (it != resident.end())
+                lru.splice(lru.begin(), lru, it->second.position);
+            else if (!pinnedSlots.count(page))
+                missing.push_back(page);
+        }
+        // higher level bits sort first
+        std::sort(missing.begin(), missing.end(), [](uint32_t a, uint32_t b) { return a > b; });
+        for (size_t i = 0; i < missing.size(); i++) {
+            if (stats.uploadedPages >= maxUploads) {
+                stats.deferredPages += (int)(missing.size() - i);
+                break;
+            }
+            int slot;
+            if (!freeSlots.empty()) {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            else if (!lru.empty() && !requested.count(lru.back())) {
+                uint32_t evicted = lru.back();
+                slot = resident[evicted].slot;
+                resident.erase(evicted);
+                lru.pop_back();
+                stats.evictedPages++;
+            }
+            else {
+                // every slot holds a page this frame needs
+                stats.deferredPages += (int)(missing.size() - i);
+                break;
+            }
+            uint32_t page = missing[i];
+            uploadPage(slot, page >> 24, page & 0xfff, (page >> 12) & 0xfff);
+            lru.push_front(page);
+            resident[page] = { slot, lru.begin() };
+            stats.uploadedPages++;
+        }
+        if (stats.uploadedPages > 0 || stats.evictedPages > 0)
+            updateIndirection();
+        stats.requestedPages = (int)requested.size();
+        stats.residentPages = (int)(resident.size() + pinnedSlots.size());
+        stats.capacity = cacheColumns * cacheRows;
+    }
+
+    void report() const {
+        int side = header.pageSize + 2 * header.border;
+        std::cout << "Virtual texture " << header.width << "x" << header.height << ", " << header.levels << " levels: "
+            << stats.requestedPages << " pages requested, " << stats.residentPages << " of " << stats.capacity << " slots ("
+            << (double)stats.capacity * side * side * 4 / (1024 * 1024) << " MB) used, " << stats.uploadedPages << " uploaded, "
+            << stats.evictedPages << " evicted, " << stats.deferredPages << " deferred, " << stats.skippedFeedback << " feedback passes skipped" << std::endl;
+    }
+
+    // writes the page pyramid of an image file: level 0 is padded to whole pages (repeating in
+    // s, the images are equirectangular, clamped in t), every next level is the 2x2 box filter
+    // of the one before padded to an even number of pages, until one page covers the image.
+    // The source comes through RasterRows a strip of pageSize rows at a time, so a binary PPM
+    // larger than anything stb_image could decode works too. Every level only holds the rows
+    // its next row of pages and the next row of the level above still read: a row of pages
+    // is cut on the pool and written once its rows are in, and every pair of rows is box
+    // filtered into the level above as it completes. flip turns the rows around, the rows of
+    // pages then arrive last first.
+    static bool build(const std::string& path, const std::string& source, bool flip, int pageSize, int border, ThreadPool* pool) {
+        auto start = std::chrono::high_resolution_clock::now();
+        const int channels = 3;
+        RasterRows<unsigned char> raster(source, channels);
+        if (raster.height == 0) {
+            std::cout << "Virtual texture " << path << " not built, " << source << " failed to load" << std::endl;
+            return false;
+        }
+        int width = raster.width, height = raster.height;
+        PyramidBuild build;
+        build.flip = flip;
+        build.pool = pool;
+        VirtualTextureHeader& header = build.header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "VTEX", 4);
+        header.version = VIRTUAL_TEXTURE_VERSION;
+        header.width = width;
+        header.height = height;
+        header.pageSize = pageSize;
+        header.border = border;
+        header.channels = channels;
+        header.flipped = flip;
+        header.sourceStamp = TextureContainer::sourceStamp({ source });
+        uint32_t pagesX = (width + pageSize - 1) / pageSize, pagesY = (height + pageSize - 1) / pageSize;
+        for (;;) {
+            header.pagesX[header.levels] = pagesX;
+            header.pagesY[header.levels] = pagesY;
+            header.levels++;
+            if ((pagesX == 1 && pagesY == 1) || header.levels == VIRTUAL_TEXTURE_MAX_LEVELS)
+                break;
+            pagesX = (pagesX + 1) / 2;
+            pagesY = (pagesY + 1) / 2;
+        }
+        size_t side = pageSize + 2 * border;
+        size_t pageBytes = side * side * channels;
+        size_t pageCount = 0;
+        uint64_t offset = sizeof(header);
+        build.levels.resize(header.levels);
+        for (uint32_t l = 0; l < header.levels; l++) {
+            header.levelOffsets[l] = offset;
+            offset += (uint64_t)header.pagesX[l] * header.pagesY[l] * pageBytes;
+            pageCount += (size_t)header.pagesX[l] * header.pagesY[l];
+            BuildLevel& level = build.levels[l];
+            level.width = header.pagesX[l] * pageSize;
+            // the borders of the pages at the right edge wrap around to the first column of
+            // the image rather than into the padding
+            level.contentWidth = l == 0 ? width : (build.levels[l - 1].contentWidth + 1) / 2;
+            level.rows = l == 0 ? height : header.pagesY[l] * pageSize;
+            level.received = flip ? level.rows : -1;
+            level.nextPageRow = flip ? header.pagesY[l] - 1 : 0;
+            level.nextParentRow = l + 1 == header.levels ? -1 : (flip ? header.pagesY[l + 1] * pageSize - 1 : 0);
+        }
+
+        std::string temporaryPath = path + ".tmp";
+        build.stream.open(temporaryPath, std::ios::binary | std::ios::trunc);
+        build.stream.write((const char*)&header, sizeof(header));
+        std::vector<unsigned char> strip((size_t)pageSize * width * channels);
+        bool complete = true;
+        for (int y = 0; y < height && complete; ) {
+            int count = std::min(pageSize, height - y);
+            complete = raster.read(strip.data(), count);
+            for (int r = 0; r < count && complete; r++, y++) {
+                // level 0 padded to whole pages
+                std::vector<unsigned char> row((size_t)build.levels[0].width * channels);
+                const unsigned char* texels = &strip[(size_t)r * width * channels];
+                memcpy(row.data(), texels, (size_t)std::min(build.levels[0].width, width) * channels);
+                for (int x = width; x < build.levels[0].width; x++)
+                    memcpy(&row[(size_t)x * channels], texels + (size_t)(x % width) * channels, channels);
+                addRow(build, 0, flip ? height - 1 - y : y, std::move(row));
+            }
+        }
+        build.stream.close();
+        if (!complete || !build.stream) {
+            if (!complete)
+                std::cout << "Virtual texture " << path << " not built, " << source << " ended early" << std::endl;
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        bool stored = std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+        auto end = std::chrono::high_resolution_clock::now();
+        if (stored)
+            std::cout << "Virtual texture " << path << " built in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms, "
+                << width << "x" << height << ", " << header.levels << " levels, " << pageCount << " pages of " << side << "x" << side << std::endl;
+        return stored;
+    }
+
+private:
+    struct Residency {
+        int slot;
+        std::list<uint32_t>::iterator position;
+    };
+
+    MappedFile* file;
+    std::vector<int> freeSlots;
+    // the coarsest level, never evicted
+    std::unordered_map<uint32_t, int> pinnedSlots;
+    std::unordered_map<uint32_t, Residency> resident;
+    // resident pages other than the pinned ones, most recently requested first
+    std::list<uint32_t> lru;
+    std::unordered_set<uint32_t> requested;
+    std::vector<unsigned char> indirection;
+    int indirectionRows[VIRTUAL_TEXTURE_MAX_LEVELS];
+    unsigned int feedbackFramebuffer;
+    unsigned int feedbackRenderbuffers[2];
+    int feedbackWidth, feedbackHeight;
+    float feedbackLodBias;
+    // readbacks in flight are the feedbackPending before feedbackWrite, oldest first
+    unsigned int feedbackPixelBuffers[feedbackBuffers];
+    GLsync feedbackFences[feedbackBuffers];
+    int feedbackWrite, feedbackPending;
+    GLint savedViewport[4];
+
+    // 12 bits for x and y, up to 4096 pages a side, and the level above them
+    static uint32_t key(uint32_t level, uint32_t x, uint32_t y) {
+        return level << 24 | y << 12 | x;
+    }
+
+    // retires the readbacks whose fences have signalled and decodes the newest of them into
+    // requested, without waiting for the others
+    void collectFeedback() {
+        int ready = -1;
+        while (feedbackPending > 0) {
+            int oldest = (feedbackWrite - feedbackPending + feedbackBuffers) % feedbackBuffers;
+            GLenum status = glClientWaitSync(feedbackFences[oldest], 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(feedbackFences[oldest]);
+            feedbackFences[oldest] = 0;
+            feedbackPending--;
+            ready = oldest;
+        }
+        if (ready < 0)
+            return;
+        size_t bytes = (size_t)feedbackWidth * feedbackHeight * 4;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPixelBuffers[ready]);
+        const unsigned char* feedback = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)bytes, GL_MAP_READ_BIT);
+        if (feedback) {
+            requested.clear();
+            for (size_t k = 0; k < bytes; k += 4) {
+                // see the feedback encoding in shader.fs, alpha is the level + 1 and 0 where no page was sampled
+                const unsigned char* texel = &feedback[k];
+                if (texel[3] == 0 || texel[3] > header.levels)
+                    continue;
+                uint32_t level = texel[3] - 1;
+                uint32_t x = texel[0] | (texel[2] & 15) << 8;
+                uint32_t y = texel[1] | (texel[2] >> 4) << 8;
+                // the ancestors too, so a page that doesn't fit falls back to the closest level
+                for (; level < header.levels && x < header.pagesX[level] && y < header.pagesY[level]; level++, x >>= 1, y >>= 1) {
+                    if (!requested.insert(key(level, x, y)).second)
+                        break;
+                }
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void uploadPage(int slot, uint32_t level, uint32_t x, uint32_t y) {
+        int side = header.pageSize + 2 * header.border;
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        GLState::get().bindTexture(cacheUnit, GL_TEXTURE_2D, cacheTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, slot % cacheColumns * side, slot / cacheColumns * side, side, side, GL_RGB, GL_UNSIGNED_BYTE, page(level, x, y));
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    // every page points at its own slot when resident, otherwise at what its parent points at
+    void updateIndirection() {
+        size_t rowBytes = (size_t)header.pagesX[0] * 4;
+        for (int level = header.levels - 1; level >= 0; level--) {
+            for (uint32_t y = 0; y < header.pagesY[level]; y++) {
+                for (uint32_t x = 0; x < header.pagesX[level]; x++) {
+                    unsigned char* entry = &indirection[(indirectionRows[level] + y) * rowBytes + x * 4];
+                    uint32_t page = key(level, x, y);
+                    int slot = -1;
+                    auto it = resident.find(page);
+                    if (it != resident.end())
+                        slot = it->second.slot;
+                    else if (level == (int)header.levels - 1)
+                        slot = pinnedSlots[page];
+                    if (slot < 0) {
+                        memcpy(entry, &indirection[(indirectionRows[level + 1] + y / 2) * rowBytes + x / 2 * 4], 4);
+                        continue;
+                    }
+                    entry[0] = (unsigned char)(slot % cacheColumns);
+                    entry[1] = (unsigned char)(slot / cacheColumns);
+                    entry[2] = (unsigned char)level;
+                    entry[3] = 255;
+                }
+            }
+        }
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        GLState::get().bindTexture(indirectionUnit, GL_TEXTURE_2D, indirectionTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, header.pagesX[0], (GLsizei)(indirection.size() / rowBytes), GL_RGBA, GL_UNSIGNED_BYTE, indirection.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    // a level of the pyramid build() is writing
+    struct BuildLevel {
+        int width;                  // texels of a row, padded to whole pages
+        int contentWidth;           // of them from the image
+        int rows;                   // from the image or the level below, the padding repeats the last
+        int received;               // the last row in
+        int nextPageRow;            // the next row of pages to write, out of range when all are
+        int nextParentRow;          // the next row of the level above to filter, likewise
+        std::map<int, std::vector<unsigned char>> texels;
+    };
+
+    struct PyramidBuild {
+        VirtualTextureHeader header;
+        bool flip;
+        ThreadPool* pool;
+        std::ofstream stream;
+        std::vector<BuildLevel> levels;
+    };
+
+    static int clampRow(const BuildLevel& level, int y) {
+        return std::min(std::max(y, 0), level.rows - 1);
+    }
+
+    // whether row y of level, clamped to its rows, is in; rows arrive from the top when they
+    // aren't flipped, from the bottom when they are
+    static bool hasRow(const PyramidBuild& build, const BuildLevel& level, int y) {
+        y = clampRow(level, y);
+        return build.flip ? level.received <= y : level.received >= y;
+    }
+
+    // row y of level l is in: writes the rows of pages and filters the rows of the level above
+    // that now have all their rows, then drops the rows nothing reads any more
+    static void addRow(PyramidBuild& build, int l, int y, std::vector<unsigned char>&& row) {
+        const int channels = 3;
+        const VirtualTextureHeader& header = build.header;
+        BuildLevel& level = build.levels[l];
+        level.texels[y] = std::move(row);
+        level.received = y;
+        int pageSize = header.pageSize, border = header.border;
+        int side = pageSize + 2 * border;
+        size_t pageBytes = (size_t)side * side * channels;
+        int step = build.flip ? -1 : 1;
+        int pagesX = header.pagesX[l], pagesY = header.pagesY[l];
+        auto pageRowDone = [&]() { return level.nextPageRow < 0 || level.nextPageRow >= pagesY; };
+        // nextParentRow is -1 on the top level
+        auto parentRowDone = [&]() { return level.nextParentRow < 0 || level.nextParentRow >= build.levels[l + 1].rows; };
+
+        while (!pageRowDone() && hasRow(build, level, level.nextPageRow * pageSize + (build.flip ? -border : pageSize + border - 1))) {
+            int pageY = level.nextPageRow;
+            std::vector<const unsigned char*> sources(side);
+            for (int y = 0; y < side; y++)
+                sources[y] = level.texels.at(clampRow(level, pageY * pageSize - border + y)).data();
+            // cut the pages with their borders, a page per job
+            std::vector<unsigned char> pages((size_t)pagesX * pageBytes);
+            build.pool->parallelFor(pagesX, [&](int pageX) {
+                unsigned char* page = &pages[(size_t)pageX * pageBytes];
+                for (int y = 0; y < side; y++) {
+                    for (int x = 0; x < side; x++) {
+                        int sourceX = (pageX * pageSize - border + x + level.contentWidth) % level.contentWidth;
+                        memcpy(page + ((size_t)y * side + x) * channels, sources[y] + (size_t)sourceX * channels, channels);
+                    }
+                }
+            });
+            build.stream.seekp((std::streamoff)(header.levelOffsets[l] + (uint64_t)pageY * pagesX * pageBytes));
+            build.stream.write((const char*)pages.data(), (std::streamsize)pages.size());
+            level.nextPageRow += step;
+        }
+
+        while (!parentRowDone() && hasRow(build, level, 2 * level.nextParentRow + (build.flip ? 0 : 1))) {
+            int parentY = level.nextParentRow;
+            // the pair of rows padded to twice the width of the level above, repeating in s
+            int paddedWidth = 2 * build.levels[l + 1].width;
+            std::vector<unsigned char> pair((size_t)paddedWidth * 2 * channels);
+            for (int r = 0; r < 2; r++) {
+                const unsigned char* source = level.texels.at(clampRow(level, 2 * parentY + r)).data();
+                unsigned char* destination = &pair[(size_t)r * paddedWidth * channels];
+                memcpy(destination, source, (size_t)std::min(paddedWidth, level.width) * channels);
+                for (int x = level.width; x < paddedWidth; x++)
+                    memcpy(destination + (size_t)x * channels, source + (size_t)(x % level.width) * channels, channels);
+            }
+            level.nextParentRow += step;
+            addRow(build, l + 1, parentY, TextureContainer::downsample(pair.data(), paddedWidth, 2, channels, GL_UNSIGNED_BYTE));
+        }
+
+        // the first row, in the order they arrive, either of the two still reads
+        if (!build.flip) {
+            int keep = level.rows;
+            if (!pageRowDone())
+                keep = std::min(keep, clampRow(level, level.nextPageRow * pageSize - border));
+            if (!parentRowDone())
+                keep = std::min(keep, clampRow(level, 2 * level.nextParentRow));
+            level.texels.erase(level.texels.begin(), level.texels.lower_bound(keep));
+        }
+        else {
+            int keep = -1;
+            if (!pageRowDone())
+                keep = std::max(keep, clampRow(level, level.nextPageRow * pageSize + pageSize + border - 1));
+            if (!parentRowDone())
+                keep = std::max(keep, clampRow(level, 2 * level.nextParentRow + 1));
+            level.texels.erase(level.texels.upper_bound(keep), level.texels.end());
+        }
+    }
+};
+#endif
@@ -0,0 +1,44 @@
+#version 450 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in vec3 aNormal;
+
+out vec2 texCoord;
+out vec3 texDir;
+out vec3 fragPos;
+out vec3 normal;
+
+uniform mat4 model;
+
+struct Light {
+    vec3 position;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+	
+	float constant;
+    float linear;
+    float quadratic;
+};
+// written once a frame for every program, FrameData in FrameUniforms.h
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+	mat4 skyboxView;
+	vec3 viewPos;
+	Light light;
+};
+uniform mat3 normalMatrix;
+
+// DISPLACED_VERTICES: the heightmap is already applied on the CPU, no texture fetch here
+void main()
+{
+	fragPos = vec3(model * vec4(aPos, 1.0));
+	// cube map lookups only need the direction
+	texDir = aPos;
+	texCoord = aTexCoord;
+	normal = normalMatrix * aNormal;
+
+	gl_Position = projection * view * vec4(fragPos, 1.0);
+}
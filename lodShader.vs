@@ -0,0 +1,119 @@
+#version 450 core
+layout (location = 0) in vec2 aGrid;
+layout (location = 2) in vec4 aPatch;
+layout (location = 3) in vec2 aMorphRange;
+
+out vec2 texCoord;
+out vec3 texDir;
+out vec3 fragPos;
+out vec3 normal;
+
+uniform mat4 model;
+// transpose(inverse(mat3(model))), set by Main once a frame rather than per vertex
+uniform mat3 normalMatrix;
+
+struct Light {
+    vec3 position;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+	
+	float constant;
+    float linear;
+    float quadratic;
+};
+// written once a frame for every program, FrameData in FrameUniforms.h
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+	mat4 skyboxView;
+	vec3 viewPos;
+	Light light;
+};
+uniform vec3 cameraModelPos;
+uniform float patchQuads;
+
+// CUBE_MAPS and EQUAL_ANGLE are defined by Shader for the cube map variants
+#ifdef CUBE_MAPS
+layout (binding = 4) uniform samplerCube heightCubeMap;
+#else
+layout (binding = 2) uniform sampler2D heightMap;
+#endif
+
+const float PI = 3.14159265358979;
+
+// as in shader.fs, for heightCubeMap when it comes from a tile pyramid
+vec3 equalAngleDirection(vec3 d)
+{
+	vec3 a = abs(d);
+	float major = max(a.x, max(a.y, a.z));
+	return major * (4.0 / PI) * atan(d / major);
+}
+
+// point of the unit sphere for (u, v) on a face, the same mapping as CubesphereMesh
+vec3 faceDirection(vec2 uv, int face)
+{
+	float a1 = radians(-45.0 + 90.0 * uv.x);
+	float a2 = radians(45.0 - 90.0 * uv.y);
+	vec3 d = normalize(vec3(cos(a1) * cos(a2), cos(a1) * sin(a2), -sin(a1) * cos(a2)));
+	if (face == 0) return d;
+	if (face == 1) return vec3(-d.x, d.y, -d.z);
+	if (face == 2) return vec3(-d.z, d.x, -d.y);
+	if (face == 3) return vec3(d.z, -d.x, -d.y);
+	if (face == 4) return vec3(-d.z, d.y, d.x);
+	return vec3(d.z, d.y, -d.x);
+}
+
+vec2 sphereTexCoord(vec3 d)
+{
+	return vec2((atan(-d.z, d.x) + PI) / (2.0 * PI), acos(-d.y) / PI);
+}
+
+// displaced point of the globe; s is kept on the same side of the theta = +-pi seam as the
+// patch centre, the 2D maps repeat in s
+vec3 displacedPosition(vec3 dir, float centerS)
+{
+	float earthProportion = 11.0/6371.0;
+	float scale = 20.0;
+#if defined(CUBE_MAPS) && defined(EQUAL_ANGLE)
+	return (1.0f+texture(heightCubeMap, equalAngleDirection(dir)).r*earthProportion*scale)*dir;
+#elif defined(CUBE_MAPS)
+	return (1.0f+texture(heightCubeMap, dir).r*earthProportion*scale)*dir;
+#else
+	vec2 uv = sphereTexCoord(dir);
+	uv.x -= round(uv.x - centerS);
+	return (1.0f+texture(heightMap, uv).r*earthProportion*scale)*dir;
+#endif
+}
+
+void main()
+{
+	int face = int(aPatch.w);
+	vec2 uv = aPatch.xy + aGrid * aPatch.z;
+	vec3 aDir = faceDirection(uv, face);
+	float centerS = sphereTexCoord(faceDirection(aPatch.xy + 0.5 * aPatch.z, face)).x;
+	vec3 position = displacedPosition(aDir, centerS);
+
+	// Vertices that the parent grid doesn't have slide onto the parent's edge between their two
+	// even neighbours (its diagonal for the cell centres) while the camera moves out towards the
+	// distance where the parent takes over. Blending positions keeps the result independent of
+	// the orientation of a face, so patches across a cube edge agree.
+	float morph = clamp((length(cameraModelPos - aDir) - aMorphRange.x) / (aMorphRange.y - aMorphRange.x), 0.0, 1.0);
+	vec2 odd = fract(aGrid * patchQuads * 0.5) * 2.0;
+	if (morph > 0.0 && odd != vec2(0.0)) {
+		vec2 step = vec2(odd.x, odd.x > 0.0 ? -odd.y : odd.y) * aPatch.z / patchQuads;
+		vec3 dirA = faceDirection(uv - step, face);
+		vec3 dirB = faceDirection(uv + step, face);
+		position = mix(position, 0.5 * (displacedPosition(dirA, centerS) + displacedPosition(dirB, centerS)), morph);
+		aDir = normalize(mix(aDir, 0.5 * (dirA + dirB), morph));
+	}
+
+	fragPos = vec3(model * vec4(aDir, 1.0));
+	texDir = aDir;
+	texCoord = sphereTexCoord(aDir);
+	texCoord.x -= round(texCoord.x - centerS);
+	normal = normalMatrix*aDir;
+
+	gl_Position = projection*view*model*vec4(position, 1.0);
+}
@@ -18,13 +18,75 @@ in vec2 texCoord;
 in vec3 normal;
 in vec3 fragPos;
 
-uniform samplerCube textureCubeMap;
-uniform samplerCube specularCubeMap; 
-uniform sampler2D textureMap; 
-uniform sampler2D specularMap; 
-uniform int useTexture; 
-uniform Light light;
-uniform vec3 viewPos;
+// CUBE_MAPS, EQUAL_ANGLE and PROCEDURAL_VERTICES are defined by Shader for the variant, as in
+// the vertex shaders, and VIRTUAL_TEXTURE and PAGE_FEEDBACK for the 2D maps
+#ifdef CUBE_MAPS
+layout (binding = 1) uniform samplerCube textureCubeMap;
+layout (binding = 5) uniform samplerCube specularCubeMap;
+#else
+#ifndef VIRTUAL_TEXTURE
+layout (binding = 0) uniform sampler2D textureMap;
+#endif
+layout (binding = 3) uniform sampler2D specularMap;
+#endif
+// FrameData in FrameUniforms.h, declared the same way in the vertex shaders
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+	mat4 skyboxView;
+	vec3 viewPos;
+	Light light;
+};
+
+const float PI = 3.14159265358979;
+// direction whose GL cube map face coordinates are the equal-angle ones of d, for the cube
+// maps of TilePyramid.h: the texels there are spaced by angle rather than by tangent
+vec3 equalAngleDirection(vec3 d)
+{
+	vec3 a = abs(d);
+	float major = max(a.x, max(a.y, a.z));
+	return major * (4.0 / PI) * atan(d / major);
+}
+
+#ifdef VIRTUAL_TEXTURE
+// the page of the level the gradients ask for, as the feedback pass writes it: x and y in
+// 12 bits split over r, g and b, the level + 1 in alpha
+vec4 pageFeedback = vec4(0.0);
+
+// virtual texture in place of textureMap, see VirtualTexture.h
+uniform sampler2D indirectionMap;
+uniform sampler2D pageCache;
+uniform vec2 virtualSize;
+uniform vec2 pageCacheSize;
+uniform int virtualLevels;
+uniform int pageSize;
+uniform int pageBorder;
+uniform int indirectionRows[16];
+#ifdef PAGE_FEEDBACK
+uniform float feedbackLodBias;
+#endif
+
+vec3 virtualTexture(vec2 uv, vec2 gradX, vec2 gradY)
+{
+	uv = vec2(fract(uv.x), clamp(uv.y, 0.0, 1.0));
+	vec2 texel = min(uv * virtualSize, virtualSize - 0.5);
+	float lod = log2(max(length(gradX * virtualSize), length(gradY * virtualSize)));
+#ifdef PAGE_FEEDBACK
+	lod += feedbackLodBias;
+#endif
+	int level = clamp(int(floor(max(lod, 0.0))), 0, virtualLevels - 1);
+	ivec2 page = ivec2(texel / float(pageSize << level));
+	pageFeedback = vec4(page.x & 255, page.y & 255, (page.x >> 8) | ((page.y >> 8) << 4), level + 1) / 255.0;
+
+	// the page or its finest resident ancestor: cache slot in rg, level in b
+	ivec3 entry = ivec3(texelFetch(indirectionMap, ivec2(page.x, indirectionRows[level] + page.y), 0).rgb * 255.0 + 0.5);
+	vec2 residentTexel = texel / float(1 << entry.z);
+	vec2 inPage = residentTexel - floor(residentTexel / float(pageSize)) * float(pageSize);
+	vec2 cacheTexel = vec2(entry.xy) * float(pageSize + 2 * pageBorder) + float(pageBorder) + inPage;
+	return textureLod(pageCache, cacheTexel / pageCacheSize, 0.0).rgb;
+}
+#endif
 
 void main()
 {
@@ -32,14 +94,41 @@ void main()
 	vec3 specularColor;
 	
 	//use cubeMap or 2D texture
-	if (useTexture == 0){
-		diffuseColor = vec3(texture(textureMap, texCoord).rgb);
-		specularColor = vec3(texture(specularMap, texCoord).rgb);
-	}
-	else {
-		diffuseColor = vec3(texture(textureCubeMap, texDir).rgb);
-		specularColor = vec3(texture(specularCubeMap, texDir).rgb);
+#if defined(CUBE_MAPS)
+#ifdef EQUAL_ANGLE
+	vec3 dir = equalAngleDirection(texDir);
+#else
+	vec3 dir = texDir;
+#endif
+	diffuseColor = vec3(texture(textureCubeMap, dir).rgb);
+	specularColor = vec3(texture(specularCubeMap, dir).rgb);
+#elif defined(PROCEDURAL_VERTICES)
+	// procedural vertices share the theta = +-pi seam between both sides, so s comes from
+	// the direction per fragment and the mip gradients from whichever of s and s shifted
+	// by half a turn is continuous here (Tarini 2012); the 2D maps repeat in s
+	vec3 d = normalize(texDir);
+	vec2 uv = vec2(atan(-d.z, d.x) / (2.0 * 3.14159265358979) + 0.5, acos(-d.y) / 3.14159265358979);
+	float shifted = fract(uv.x + 0.5);
+	vec2 gradX = dFdx(uv);
+	vec2 gradY = dFdy(uv);
+	if (abs(dFdx(shifted)) + abs(dFdy(shifted)) < abs(gradX.x) + abs(gradY.x)) {
+		gradX.x = dFdx(shifted);
+		gradY.x = dFdy(shifted);
 	}
+#ifdef VIRTUAL_TEXTURE
+	diffuseColor = virtualTexture(uv, gradX, gradY);
+#else
+	diffuseColor = vec3(textureGrad(textureMap, uv, gradX, gradY).rgb);
+#endif
+	specularColor = vec3(textureGrad(specularMap, uv, gradX, gradY).rgb);
+#else
+#ifdef VIRTUAL_TEXTURE
+	diffuseColor = virtualTexture(texCoord, dFdx(texCoord), dFdy(texCoord));
+#else
+	diffuseColor = vec3(texture(textureMap, texCoord).rgb);
+#endif
+	specularColor = vec3(texture(specularMap, texCoord).rgb);
+#endif
 		
 	// ambient
     vec3 ambient = light.ambient * diffuseColor.rgb;
@@ -65,6 +154,9 @@ void main()
         
     vec3 result = ambient + diffuse + specular;
     FragColor = vec4(result, 1.0);
+#ifdef PAGE_FEEDBACK
+	FragColor = pageFeedback;
+#endif
 	
 	
 }
\ No newline at end of file
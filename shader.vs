@@ -8,27 +8,98 @@ out vec3 fragPos;
 out vec3 normal;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// transpose(inverse(mat3(model))), set by Main once a frame rather than per vertex
+uniform mat3 normalMatrix;
 
-uniform sampler2D heightMap;
-uniform samplerCube heightCubeMap;
-uniform int useTexture;
+struct Light {
+    vec3 position;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+	
+	float constant;
+    float linear;
+    float quadratic;
+};
+// written once a frame for every program, FrameData in FrameUniforms.h
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+	mat4 skyboxView;
+	vec3 viewPos;
+	Light light;
+};
+
+// CUBE_MAPS, EQUAL_ANGLE, PACKED_VERTICES and PROCEDURAL_VERTICES are defined by Shader for the variant
+#ifdef CUBE_MAPS
+layout (binding = 4) uniform samplerCube heightCubeMap;
+#else
+layout (binding = 2) uniform sampler2D heightMap;
+#endif
+
+#ifdef PROCEDURAL_VERTICES
+// one face of indices is drawn once per face (gl_InstanceID), the vertex at row i and column j
+// of the face arrives as gl_VertexID = j + verticesPerRow * i
+layout (std140, binding = 0) uniform ProceduralSphere
+{
+	int verticesPerRow;
+	mat4 faceAxes[6];
+};
+#endif
+
+const float PI = 3.14159265358979;
+
+// as in shader.fs, for heightCubeMap when it comes from a tile pyramid
+vec3 equalAngleDirection(vec3 d)
+{
+	vec3 a = abs(d);
+	float major = max(a.x, max(a.y, a.z));
+	return major * (4.0 / PI) * atan(d / major);
+}
+
+// unit vector from an octahedral encoded pair in [-1, 1]
+vec3 octDecode(vec2 e)
+{
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (v.z < 0.0)
+		v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(v);
+}
 
 void main()
 {
-	fragPos = vec3(model * vec4(aPos, 1.0));
-	texDir = aPos;
-	texCoord = aTexCoord;
-	normal = mat3(transpose(inverse(model)))*aPos;
+	vec3 aDir;
+	vec2 aUv = aTexCoord;
+#if defined(PROCEDURAL_VERTICES)
+	// same equal-angle planes as generateCubeSphereVertices
+	int i = gl_VertexID / verticesPerRow;
+	int j = gl_VertexID - i * verticesPerRow;
+	float a1 = radians(-45.0 + 90.0 * float(j) / float(verticesPerRow - 1));
+	float a2 = radians(45.0 - 90.0 * float(i) / float(verticesPerRow - 1));
+	vec3 v = normalize(vec3(cos(a1) * cos(a2), cos(a1) * sin(a2), -sin(a1) * cos(a2)));
+	aDir = mat3(faceAxes[gl_InstanceID]) * v;
+	aUv = vec2((atan(-aDir.z, aDir.x) + PI) / (2.0 * PI), acos(-aDir.y) / PI);
+#elif defined(PACKED_VERTICES)
+	aDir = octDecode(aPos.xy);
+#else
+	aDir = aPos;
+#endif
+	fragPos = vec3(model * vec4(aDir, 1.0));
+	texDir = aDir;
+	texCoord = aUv;
+	normal = normalMatrix*aDir;
 	
 	float earthProportion = 11.0/6371.0;
 	float scale = 20.0;
 	vec3 position;
-	if (useTexture == 0)
-		position = (1.0f+texture(heightMap, aTexCoord).r*earthProportion*scale)*aPos;
-	else
-		position = (1.0f+texture(heightCubeMap, aPos).r*earthProportion*scale)*aPos;
+#if defined(CUBE_MAPS) && defined(EQUAL_ANGLE)
+	position = (1.0f+texture(heightCubeMap, equalAngleDirection(aDir)).r*earthProportion*scale)*aDir;
+#elif defined(CUBE_MAPS)
+	position = (1.0f+texture(heightCubeMap, aDir).r*earthProportion*scale)*aDir;
+#else
+	position = (1.0f+texture(heightMap, aUv).r*earthProportion*scale)*aDir;
+#endif
 	
     gl_Position = projection*view*model*vec4(position, 1.0);
 	
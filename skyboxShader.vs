@@ -3,12 +3,29 @@ layout (location = 0) in vec3 aPos;
 
 out vec3 TexCoords;
 
-uniform mat4 projection;
-uniform mat4 view;
+struct Light {
+    vec3 position;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+	
+	float constant;
+    float linear;
+    float quadratic;
+};
+// the same block as in shader.vs, skyboxView is the one drawn with here
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+	mat4 skyboxView;
+	vec3 viewPos;
+	Light light;
+};
 
 void main()
 {
     TexCoords = aPos;
-    vec4 pos = projection * view * vec4(aPos, 1.0);
+    vec4 pos = projection * skyboxView * vec4(aPos, 1.0);
     gl_Position = pos.xyww;
 }  
\ No newline at end of file